@@ -30,57 +30,674 @@
 #ifndef KAINJOW_MUSTACHE_HPP
 #define KAINJOW_MUSTACHE_HPP
 
+#include <algorithm>
+#include <array>
+#include <atomic>
 #include <cassert>
 #include <cctype>
+#include <cstdint>
+#include <cstring>
 #include <functional>
 #include <iostream>
+#include <list>
 #include <memory>
+#include <mutex>
 #include <sstream>
+#include <type_traits>
 #include <unordered_map>
 #include <vector>
 
+// basic_mustache::set_parallel() and basic_async_render run on threads and
+// are only available when KAINJOW_MUSTACHE_THREADS is defined before this
+// header is included. Link with -pthread then.
+#if defined(KAINJOW_MUSTACHE_THREADS)
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <thread>
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define KAINJOW_MUSTACHE_SSE2
+#include <emmintrin.h>
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#endif
+#endif
+
+// AVX2 is selected at run time on GCC and Clang, or always when compiled for it
+#if defined(KAINJOW_MUSTACHE_SSE2) && (defined(__AVX2__) || ((defined(__GNUC__) || defined(__clang__)) && !defined(__INTEL_COMPILER) && (defined(__x86_64__) || defined(__i386__))))
+#define KAINJOW_MUSTACHE_AVX2
+#include <immintrin.h>
+#if defined(__AVX2__)
+#define KAINJOW_MUSTACHE_AVX2_TARGET
+#else
+#define KAINJOW_MUSTACHE_AVX2_TARGET __attribute__((target("avx2")))
+#endif
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+#define KAINJOW_MUSTACHE_POSIX
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
 namespace kainjow {
 namespace mustache {
 
+// ASCII whitespace, as std::isspace() in the "C" locale
+template <typename char_type>
+bool is_space(char_type ch) {
+    return ch == ' ' || ch == '\t' || ch == '\n' || ch == '\r' || ch == '\f' || ch == '\v';
+}
+
+// Narrows [first, last) of s to exclude leading and trailing whitespace
+template <typename string_type>
+void trim(const string_type& s, typename string_type::size_type& first, typename string_type::size_type& last) {
+    while (first != last && is_space(s[first])) {
+        ++first;
+    }
+    while (last != first && is_space(s[last - 1])) {
+        --last;
+    }
+}
+
 template <typename string_type>
 string_type trim(const string_type& s) {
-    auto it = s.begin();
-    while (it != s.end() && std::isspace(*it)) {
-        it++;
+    typename string_type::size_type first = 0;
+    typename string_type::size_type last = s.size();
+    trim(s, first, last);
+    return s.substr(first, last - first);
+}
+
+// Escaping scans for the characters to replace with a character class and
+// copies the runs between them in one append. For char, classes match a
+// block at a time with SSE2, or AVX2 when the CPU supports it. Other
+// character types are scanned one character at a time.
+template <typename char_type>
+std::uint32_t code_unit(char_type ch) {
+    return static_cast<std::uint32_t>(static_cast<typename std::make_unsigned<char_type>::type>(ch));
+}
+
+#if defined(KAINJOW_MUSTACHE_SSE2)
+
+inline unsigned first_set_bit(unsigned mask) {
+#if defined(_MSC_VER) && !defined(__clang__)
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return index;
+#else
+    return static_cast<unsigned>(__builtin_ctz(mask));
+#endif
+}
+
+inline __m128i bytes_equal(__m128i block, char ch) {
+    return _mm_cmpeq_epi8(block, _mm_set1_epi8(ch));
+}
+
+inline __m128i bytes_in_range(__m128i block, char lo, char hi) {
+    return _mm_cmpeq_epi8(_mm_min_epu8(_mm_max_epu8(block, _mm_set1_epi8(lo)), _mm_set1_epi8(hi)), block);
+}
+
+inline __m128i bytes_below(__m128i block, char ch) {
+    // unsigned compare, ch must be above 0
+    return _mm_cmpeq_epi8(_mm_min_epu8(block, _mm_set1_epi8(static_cast<char>(ch - 1))), block);
+}
+
+inline __m128i bytes_not(__m128i block) {
+    return _mm_xor_si128(block, _mm_set1_epi8(-1));
+}
+
+#endif // KAINJOW_MUSTACHE_SSE2
+
+#if defined(KAINJOW_MUSTACHE_AVX2)
+
+KAINJOW_MUSTACHE_AVX2_TARGET inline __m256i bytes_equal(__m256i block, char ch) {
+    return _mm256_cmpeq_epi8(block, _mm256_set1_epi8(ch));
+}
+
+KAINJOW_MUSTACHE_AVX2_TARGET inline __m256i bytes_in_range(__m256i block, char lo, char hi) {
+    return _mm256_cmpeq_epi8(_mm256_min_epu8(_mm256_max_epu8(block, _mm256_set1_epi8(lo)), _mm256_set1_epi8(hi)), block);
+}
+
+KAINJOW_MUSTACHE_AVX2_TARGET inline __m256i bytes_below(__m256i block, char ch) {
+    return _mm256_cmpeq_epi8(_mm256_min_epu8(block, _mm256_set1_epi8(static_cast<char>(ch - 1))), block);
+}
+
+KAINJOW_MUSTACHE_AVX2_TARGET inline __m256i bytes_not(__m256i block) {
+    return _mm256_xor_si256(block, _mm256_set1_epi8(-1));
+}
+
+inline bool cpu_has_avx2() {
+#if defined(__AVX2__)
+    return true;
+#else
+    static const bool has_avx2 = __builtin_cpu_supports("avx2") != 0;
+    return has_avx2;
+#endif
+}
+
+#endif // KAINJOW_MUSTACHE_AVX2
+
+// Characters replaced by html_escape()
+class html_special {
+public:
+    static bool test(std::uint32_t ch) {
+        return ch == '&' || ch == '<' || ch == '>' || ch == '\"' || ch == '\'';
+    }
+    static std::size_t growth(std::uint32_t ch, std::size_t) {
+        // entity length minus the replaced character
+        return ch == '<' || ch == '>' ? 3 : ch == '&' ? 4 : 5;
+    }
+#if defined(KAINJOW_MUSTACHE_SSE2)
+    static __m128i match(__m128i block) {
+        return _mm_or_si128(_mm_or_si128(bytes_equal(block, '&'), bytes_equal(block, '<')),
+            _mm_or_si128(_mm_or_si128(bytes_equal(block, '>'), bytes_equal(block, '\"')), bytes_equal(block, '\'')));
+    }
+#endif
+#if defined(KAINJOW_MUSTACHE_AVX2)
+    KAINJOW_MUSTACHE_AVX2_TARGET static __m256i match(__m256i block) {
+        return _mm256_or_si256(_mm256_or_si256(bytes_equal(block, '&'), bytes_equal(block, '<')),
+            _mm256_or_si256(_mm256_or_si256(bytes_equal(block, '>'), bytes_equal(block, '\"')), bytes_equal(block, '\'')));
+    }
+#endif
+};
+
+// Characters replaced by xml_attribute_escape(). Tabs and line breaks are
+// replaced too, as attribute value normalization would turn them into spaces.
+class xml_attribute_special {
+public:
+    static bool test(std::uint32_t ch) {
+        return html_special::test(ch) || ch == '\t' || ch == '\n' || ch == '\r';
+    }
+    static std::size_t growth(std::uint32_t ch, std::size_t unit_size) {
+        return ch == '\t' ? 3 : ch == '\n' || ch == '\r' ? 4 : html_special::growth(ch, unit_size);
+    }
+#if defined(KAINJOW_MUSTACHE_SSE2)
+    static __m128i match(__m128i block) {
+        return _mm_or_si128(html_special::match(block),
+            _mm_or_si128(_mm_or_si128(bytes_equal(block, '\t'), bytes_equal(block, '\n')), bytes_equal(block, '\r')));
+    }
+#endif
+#if defined(KAINJOW_MUSTACHE_AVX2)
+    KAINJOW_MUSTACHE_AVX2_TARGET static __m256i match(__m256i block) {
+        return _mm256_or_si256(html_special::match(block),
+            _mm256_or_si256(_mm256_or_si256(bytes_equal(block, '\t'), bytes_equal(block, '\n')), bytes_equal(block, '\r')));
+    }
+#endif
+};
+
+// Characters replaced by json_escape(): quotes, backslashes and control
+// characters.
+class json_special {
+public:
+    static bool test(std::uint32_t ch) {
+        return ch < 0x20 || ch == '\"' || ch == '\\';
+    }
+    static std::size_t growth(std::uint32_t ch, std::size_t) {
+        return ch < 0x20 && ch != '\b' && ch != '\f' && ch != '\n' && ch != '\r' && ch != '\t' ? 5 : 1;
+    }
+#if defined(KAINJOW_MUSTACHE_SSE2)
+    static __m128i match(__m128i block) {
+        return _mm_or_si128(bytes_below(block, 0x20), _mm_or_si128(bytes_equal(block, '\"'), bytes_equal(block, '\\')));
+    }
+#endif
+#if defined(KAINJOW_MUSTACHE_AVX2)
+    KAINJOW_MUSTACHE_AVX2_TARGET static __m256i match(__m256i block) {
+        return _mm256_or_si256(bytes_below(block, 0x20), _mm256_or_si256(bytes_equal(block, '\"'), bytes_equal(block, '\\')));
+    }
+#endif
+};
+
+// Characters replaced by json_ascii_escape(): as json_special, and anything
+// outside of ASCII.
+class json_ascii_special {
+public:
+    static bool test(std::uint32_t ch) {
+        return ch >= 0x80 || json_special::test(ch);
+    }
+    static std::size_t growth(std::uint32_t ch, std::size_t unit_size) {
+        return ch >= 0x10000 ? 11 : ch >= 0x80 ? 5 : json_special::growth(ch, unit_size);
+    }
+#if defined(KAINJOW_MUSTACHE_SSE2)
+    static __m128i match(__m128i block) {
+        return _mm_or_si128(json_special::match(block), _mm_cmplt_epi8(block, _mm_setzero_si128()));
+    }
+#endif
+#if defined(KAINJOW_MUSTACHE_AVX2)
+    KAINJOW_MUSTACHE_AVX2_TARGET static __m256i match(__m256i block) {
+        return _mm256_or_si256(json_special::match(block), _mm256_cmpgt_epi8(_mm256_setzero_si256(), block));
+    }
+#endif
+};
+
+// Characters replaced by url_escape(): everything but the unreserved
+// characters of RFC 3986.
+class url_special {
+public:
+    static bool test(std::uint32_t ch) {
+        return !((ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z') || (ch >= '0' && ch <= '9') || ch == '-' || ch == '.' || ch == '_' || ch == '~');
+    }
+    static std::size_t growth(std::uint32_t ch, std::size_t unit_size) {
+        // each byte of a narrow string becomes %XX, wide characters become
+        // their UTF-8 bytes at three characters each
+        return unit_size == 1 || ch < 0x80 ? 2 : ch < 0x800 ? 5 : 11;
+    }
+#if defined(KAINJOW_MUSTACHE_SSE2)
+    static __m128i match(__m128i block) {
+        return bytes_not(_mm_or_si128(
+            _mm_or_si128(bytes_in_range(block, 'a', 'z'), _mm_or_si128(bytes_in_range(block, 'A', 'Z'), bytes_in_range(block, '0', '9'))),
+            _mm_or_si128(_mm_or_si128(bytes_equal(block, '-'), bytes_equal(block, '.')), _mm_or_si128(bytes_equal(block, '_'), bytes_equal(block, '~')))));
+    }
+#endif
+#if defined(KAINJOW_MUSTACHE_AVX2)
+    KAINJOW_MUSTACHE_AVX2_TARGET static __m256i match(__m256i block) {
+        return bytes_not(_mm256_or_si256(
+            _mm256_or_si256(bytes_in_range(block, 'a', 'z'), _mm256_or_si256(bytes_in_range(block, 'A', 'Z'), bytes_in_range(block, '0', '9'))),
+            _mm256_or_si256(_mm256_or_si256(bytes_equal(block, '-'), bytes_equal(block, '.')), _mm256_or_si256(bytes_equal(block, '_'), bytes_equal(block, '~')))));
+    }
+#endif
+};
+
+// Characters that make shell_escape() quote its argument
+class shell_special {
+public:
+    static bool test(std::uint32_t ch) {
+        return !((ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z') || (ch >= '0' && ch <= '9') ||
+            ch == '_' || ch == '@' || ch == '%' || ch == '+' || ch == '=' || ch == ':' || ch == ',' || ch == '.' || ch == '/' || ch == '-');
+    }
+    static std::size_t growth(std::uint32_t, std::size_t) {
+        return 0;
+    }
+#if defined(KAINJOW_MUSTACHE_SSE2)
+    static __m128i match(__m128i block) {
+        // '+' ',' '-' '.' '/' and '0' to ':' are contiguous
+        return bytes_not(_mm_or_si128(
+            _mm_or_si128(bytes_in_range(block, 'a', 'z'), _mm_or_si128(bytes_in_range(block, 'A', 'Z'), bytes_in_range(block, '+', ':'))),
+            _mm_or_si128(_mm_or_si128(bytes_equal(block, '_'), bytes_equal(block, '@')), _mm_or_si128(bytes_equal(block, '%'), bytes_equal(block, '=')))));
+    }
+#endif
+#if defined(KAINJOW_MUSTACHE_AVX2)
+    KAINJOW_MUSTACHE_AVX2_TARGET static __m256i match(__m256i block) {
+        return bytes_not(_mm256_or_si256(
+            _mm256_or_si256(bytes_in_range(block, 'a', 'z'), _mm256_or_si256(bytes_in_range(block, 'A', 'Z'), bytes_in_range(block, '+', ':'))),
+            _mm256_or_si256(_mm256_or_si256(bytes_equal(block, '_'), bytes_equal(block, '@')), _mm256_or_si256(bytes_equal(block, '%'), bytes_equal(block, '=')))));
+    }
+#endif
+};
+
+// Single quotes, replaced inside the quotes added by shell_escape()
+class shell_quote_special {
+public:
+    static bool test(std::uint32_t ch) {
+        return ch == '\'';
+    }
+    static std::size_t growth(std::uint32_t, std::size_t) {
+        // '\''
+        return 3;
+    }
+#if defined(KAINJOW_MUSTACHE_SSE2)
+    static __m128i match(__m128i block) {
+        return bytes_equal(block, '\'');
+    }
+#endif
+#if defined(KAINJOW_MUSTACHE_AVX2)
+    KAINJOW_MUSTACHE_AVX2_TARGET static __m256i match(__m256i block) {
+        return bytes_equal(block, '\'');
+    }
+#endif
+};
+
+template <typename char_class, typename char_type>
+const char_type* find_first(const char_type* first, const char_type* last) {
+    while (first != last && !char_class::test(code_unit(*first))) {
+        ++first;
+    }
+    return first;
+}
+
+#if defined(KAINJOW_MUSTACHE_SSE2)
+
+template <typename char_class>
+const char* find_first_sse2(const char* first, const char* last) {
+    while (last - first >= 16) {
+        const __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(first));
+        const unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(char_class::match(block)));
+        if (mask != 0) {
+            return first + first_set_bit(mask);
+        }
+        first += 16;
+    }
+    return find_first<char_class, char>(first, last);
+}
+
+#endif // KAINJOW_MUSTACHE_SSE2
+
+#if defined(KAINJOW_MUSTACHE_AVX2)
+
+template <typename char_class>
+KAINJOW_MUSTACHE_AVX2_TARGET const char* find_first_avx2(const char* first, const char* last) {
+    while (last - first >= 32) {
+        const __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(first));
+        const unsigned mask = static_cast<unsigned>(_mm256_movemask_epi8(char_class::match(block)));
+        if (mask != 0) {
+            return first + first_set_bit(mask);
+        }
+        first += 32;
+    }
+    return find_first_sse2<char_class>(first, last);
+}
+
+#endif // KAINJOW_MUSTACHE_AVX2
+
+template <typename char_class>
+const char* find_first(const char* first, const char* last) {
+#if defined(KAINJOW_MUSTACHE_AVX2)
+    if (cpu_has_avx2()) {
+        return find_first_avx2<char_class>(first, last);
+    }
+#endif
+#if defined(KAINJOW_MUSTACHE_SSE2)
+    return find_first_sse2<char_class>(first, last);
+#else
+    return find_first<char_class, char>(first, last);
+#endif
+}
+
+// Finds the next character of char_class after a replaced one. Escaped
+// characters tend to be close together, so the next few characters are
+// checked one at a time before scanning blocks.
+template <typename char_class, typename char_type>
+const char_type* find_next(const char_type* first, const char_type* last) {
+    const char_type* const near_last = last - first > 16 ? first + 16 : last;
+    first = find_first<char_class, char_type>(first, near_last);
+    return first != near_last ? first : find_first<char_class>(first, last);
+}
+
+#if defined(KAINJOW_MUSTACHE_SSE2)
+
+template <typename char_class>
+const char* find_next(const char* first, const char* last) {
+    if (last - first >= 16) {
+        const __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(first));
+        const unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(char_class::match(block)));
+        return mask != 0 ? first + first_set_bit(mask) : find_first<char_class>(first + 16, last);
+    }
+    return find_first<char_class, char>(first, last);
+}
+
+#endif // KAINJOW_MUSTACHE_SSE2
+
+// Appends s to out with each character of char_class replaced. The output
+// is sized up front from char_class::growth(), given the code unit and its
+// size in bytes, which must not be less than the replacement length minus
+// one. replace writes the replacement of the character at it to dest and
+// returns the position after the characters it replaced.
+template <typename char_class, typename string_type, typename replace_type>
+void escape_runs(const string_type& s, string_type& out, const replace_type& replace) {
+    using char_type = typename string_type::value_type;
+    const char_type* const first = s.data();
+    const char_type* const last = first + s.size();
+    const char_type* special = find_first<char_class>(first, last);
+    if (special == last) {
+        out.append(s);
+        return;
+    }
+    std::size_t growth = 0;
+    for (const char_type* it = special; it != last; it = find_next<char_class>(it + 1, last)) {
+        growth += char_class::growth(code_unit(*it), sizeof(char_type));
+    }
+    const std::size_t out_size = out.size();
+    out.resize(out_size + s.size() + growth);
+    char_type* const dest_first = &out[0];
+    char_type* dest = dest_first + out_size;
+    const char_type* run = first;
+    while (special != last) {
+        dest = std::copy(run, special, dest);
+        run = replace(dest, special, last);
+        special = find_next<char_class>(run, last);
+    }
+    dest = std::copy(run, last, dest);
+    out.resize(static_cast<std::size_t>(dest - dest_first));
+}
+
+// Decodes the code point at it and advances it past it. Single byte strings
+// are read as UTF-8, two byte strings as UTF-16 and wider strings as UTF-32.
+// Invalid code units decode to U+FFFD one at a time.
+template <typename char_type>
+std::uint32_t decode_code_point(const char_type*& it, const char_type* last) {
+    const std::uint32_t lead = code_unit(*it++);
+    if (sizeof(char_type) == 2) {
+        if (lead >= 0xD800 && lead <= 0xDBFF && it != last && code_unit(*it) >= 0xDC00 && code_unit(*it) <= 0xDFFF) {
+            return 0x10000 + ((lead - 0xD800) << 10) + (code_unit(*it++) - 0xDC00);
+        }
+        return lead >= 0xD800 && lead <= 0xDFFF ? 0xFFFD : lead;
+    }
+    if (sizeof(char_type) > 2 || lead < 0x80) {
+        return lead <= 0x10FFFF && (lead < 0xD800 || lead > 0xDFFF) ? lead : 0xFFFD;
+    }
+    const int length = lead >= 0xF5 ? 0 : lead >= 0xF0 ? 3 : lead >= 0xE0 ? 2 : lead >= 0xC0 ? 1 : 0;
+    std::uint32_t cp = lead & (0x3F >> length);
+    const char_type* next = it;
+    for (int i = 0; i < length; ++i, ++next) {
+        if (next == last || (code_unit(*next) & 0xC0) != 0x80) {
+            return 0xFFFD;
+        }
+        cp = (cp << 6) | (code_unit(*next) & 0x3F);
+    }
+    static const std::uint32_t minimum[] = {0x80, 0x80, 0x800, 0x10000};
+    if (length == 0 || cp < minimum[length] || cp > 0x10FFFF || (cp >= 0xD800 && cp <= 0xDFFF)) {
+        return 0xFFFD;
+    }
+    it = next;
+    return cp;
+}
+
+template <typename char_type>
+void put_ascii(char_type*& dest, const char* str) {
+    while (*str) {
+        *dest++ = static_cast<char_type>(*str++);
+    }
+}
+
+template <typename char_type>
+void put_hex(char_type*& dest, std::uint32_t value, int digits, const char* hex_digits) {
+    for (int shift = (digits - 1) * 4; shift >= 0; shift -= 4) {
+        *dest++ = static_cast<char_type>(hex_digits[(value >> shift) & 0xF]);
+    }
+}
+
+template <typename char_type>
+const char_type* put_html_entity(char_type*& dest, const char_type* it, const char_type*) {
+    switch (*it) {
+        case '&':
+            put_ascii(dest, "&amp;");
+            break;
+        case '<':
+            put_ascii(dest, "&lt;");
+            break;
+        case '>':
+            put_ascii(dest, "&gt;");
+            break;
+        case '\"':
+            put_ascii(dest, "&quot;");
+            break;
+        case '\'':
+            put_ascii(dest, "&apos;");
+            break;
+        case '\t':
+            put_ascii(dest, "&#9;");
+            break;
+        case '\n':
+            put_ascii(dest, "&#10;");
+            break;
+        case '\r':
+            put_ascii(dest, "&#13;");
+            break;
+        default:
+            break;
+    }
+    return it + 1;
+}
+
+template <typename char_type>
+const char_type* put_json_escape(char_type*& dest, const char_type* it, const char_type* last) {
+    static const char* const hex_digits = "0123456789abcdef";
+    switch (code_unit(*it)) {
+        case '\"':
+            put_ascii(dest, "\\\"");
+            break;
+        case '\\':
+            put_ascii(dest, "\\\\");
+            break;
+        case '\b':
+            put_ascii(dest, "\\b");
+            break;
+        case '\f':
+            put_ascii(dest, "\\f");
+            break;
+        case '\n':
+            put_ascii(dest, "\\n");
+            break;
+        case '\r':
+            put_ascii(dest, "\\r");
+            break;
+        case '\t':
+            put_ascii(dest, "\\t");
+            break;
+        default: {
+            std::uint32_t cp = decode_code_point(it, last);
+            if (cp >= 0x10000) {
+                cp -= 0x10000;
+                put_ascii(dest, "\\u");
+                put_hex(dest, 0xD800 + (cp >> 10), 4, hex_digits);
+                cp = 0xDC00 + (cp & 0x3FF);
+            }
+            put_ascii(dest, "\\u");
+            put_hex(dest, cp, 4, hex_digits);
+            return it;
+        }
+    }
+    return it + 1;
+}
+
+template <typename char_type>
+const char_type* put_url_escape(char_type*& dest, const char_type* it, const char_type* last) {
+    static const char* const hex_digits = "0123456789ABCDEF";
+    if (sizeof(char_type) == 1) {
+        *dest++ = '%';
+        put_hex(dest, code_unit(*it), 2, hex_digits);
+        return it + 1;
     }
-    auto rit = s.rbegin();
-    while (rit.base() != it && std::isspace(*rit)) {
-        rit++;
+    // encode wide characters as UTF-8
+    const std::uint32_t cp = decode_code_point(it, last);
+    const int length = cp < 0x80 ? 1 : cp < 0x800 ? 2 : cp < 0x10000 ? 3 : 4;
+    static const std::uint32_t lead_bits[] = {0, 0, 0xC0, 0xE0, 0xF0};
+    for (int i = 0; i < length; ++i) {
+        const int shift = (length - 1 - i) * 6;
+        *dest++ = '%';
+        put_hex(dest, i == 0 ? (lead_bits[length] | (cp >> shift)) : (0x80 | ((cp >> shift) & 0x3F)), 2, hex_digits);
     }
-    return {it, rit.base()};
+    return it;
+}
+
+template <typename char_type>
+const char_type* put_shell_quote(char_type*& dest, const char_type* it, const char_type*) {
+    put_ascii(dest, "'\\''");
+    return it + 1;
+}
+
+// Appends the HTML escaped form of s to out.
+template <typename string_type>
+void html_escape_append(const string_type& s, string_type& out) {
+    escape_runs<html_special>(s, out, put_html_entity<typename string_type::value_type>);
 }
 
 template <typename string_type>
 string_type html_escape(const string_type& s) {
     string_type ret;
-    ret.reserve(s.size()*2);
-    for (const auto ch : s) {
-        switch (ch) {
-            case '&':
-                ret.append({'&','a','m','p',';'});
-                break;
-            case '<':
-                ret.append({'&','l','t',';'});
-                break;
-            case '>':
-                ret.append({'&','g','t',';'});
-                break;
-            case '\"':
-                ret.append({'&','q','u','o','t',';'});
-                break;
-            case '\'':
-                ret.append({'&','a','p','o','s',';'});
-                break;
-            default:
-                ret.append(1, ch);
-                break;
-        }
+    html_escape_append(s, ret);
+    return ret;
+}
+
+// Appends s to out escaped for an XML attribute value in single or double
+// quotes.
+template <typename string_type>
+void xml_attribute_escape_append(const string_type& s, string_type& out) {
+    escape_runs<xml_attribute_special>(s, out, put_html_entity<typename string_type::value_type>);
+}
+
+template <typename string_type>
+string_type xml_attribute_escape(const string_type& s) {
+    string_type ret;
+    xml_attribute_escape_append(s, ret);
+    return ret;
+}
+
+// Appends s to out escaped for a JSON string, without the quotes. Characters
+// outside of ASCII are copied as is.
+template <typename string_type>
+void json_escape_append(const string_type& s, string_type& out) {
+    escape_runs<json_special>(s, out, put_json_escape<typename string_type::value_type>);
+}
+
+template <typename string_type>
+string_type json_escape(const string_type& s) {
+    string_type ret;
+    json_escape_append(s, ret);
+    return ret;
+}
+
+// As json_escape_append(), but characters outside of ASCII are written as
+// \uXXXX escapes, using surrogate pairs above U+FFFF.
+template <typename string_type>
+void json_ascii_escape_append(const string_type& s, string_type& out) {
+    escape_runs<json_ascii_special>(s, out, put_json_escape<typename string_type::value_type>);
+}
+
+template <typename string_type>
+string_type json_ascii_escape(const string_type& s) {
+    string_type ret;
+    json_ascii_escape_append(s, ret);
+    return ret;
+}
+
+// Appends s to out percent-encoded for a URL component. All but the
+// unreserved characters of RFC 3986 are encoded. Wide strings are encoded as
+// UTF-8 first.
+template <typename string_type>
+void url_escape_append(const string_type& s, string_type& out) {
+    escape_runs<url_special>(s, out, put_url_escape<typename string_type::value_type>);
+}
+
+template <typename string_type>
+string_type url_escape(const string_type& s) {
+    string_type ret;
+    url_escape_append(s, ret);
+    return ret;
+}
+
+// Appends s to out as a single POSIX shell word. Strings of only safe
+// characters are copied as is, others are single quoted.
+template <typename string_type>
+void shell_escape_append(const string_type& s, string_type& out) {
+    if (!s.empty() && find_first<shell_special>(s.data(), s.data() + s.size()) == s.data() + s.size()) {
+        out.append(s);
+        return;
     }
+    out.reserve(out.size() + s.size() + 2);
+    out.append(1, '\'');
+    escape_runs<shell_quote_special>(s, out, put_shell_quote<typename string_type::value_type>);
+    out.append(1, '\'');
+}
+
+template <typename string_type>
+string_type shell_escape(const string_type& s) {
+    string_type ret;
+    shell_escape_append(s, ret);
     return ret;
 }
 
@@ -95,6 +712,22 @@ std::vector<string_type> split(const string_type& s, typename string_type::value
     return elems;
 }
 
+// FNV-1a over the code units of s
+template <typename string_type>
+std::size_t hash_string(const string_type& s) {
+    const bool wide = sizeof(std::size_t) >= 8;
+    const std::size_t prime = wide ? static_cast<std::size_t>(1099511628211ULL) : 16777619;
+    std::size_t hash = wide ? static_cast<std::size_t>(14695981039346656037ULL) : 2166136261U;
+    for (const auto ch : s) {
+        hash = (hash ^ static_cast<std::size_t>(ch)) * prime;
+    }
+    return hash;
+}
+
+inline std::size_t hash_combine(std::size_t seed, std::size_t value) {
+    return seed ^ (value + 0x9e3779b9 + (seed << 6) + (seed >> 2));
+}
+
 template <typename string_type>
 class basic_renderer {
 public:
@@ -240,8 +873,8 @@ public:
     basic_data(bool b) : type_{b ? type::bool_true : type::bool_false} {
     }
 
-    // Copying
-    basic_data(const basic_data& dat) : type_(dat.type_) {
+    // Copying. Escaped forms are not copied, the copy caches its own.
+    basic_data(const basic_data& dat) : type_(dat.type_), safe_(dat.safe_), cache_escaped_(dat.cache_escaped_) {
         if (dat.obj_) {
             obj_.reset(new basic_object<string_type>(*dat.obj_));
         } else if (dat.str_) {
@@ -256,7 +889,8 @@ public:
     }
 
     // Move
-    basic_data(basic_data&& dat) : type_{dat.type_} {
+    basic_data(basic_data&& dat) : type_{dat.type_}, safe_(dat.safe_), cache_escaped_(dat.cache_escaped_) {
+        escaped_.store(dat.escaped_.exchange(nullptr));
         if (dat.obj_) {
             obj_ = std::move(dat.obj_);
         } else if (dat.str_) {
@@ -277,6 +911,10 @@ public:
             list_.reset();
             partial_.reset();
             lambda_.reset();
+            clear_escaped();
+            escaped_.store(dat.escaped_.exchange(nullptr));
+            safe_ = dat.safe_;
+            cache_escaped_ = dat.cache_escaped_;
             if (dat.obj_) {
                 obj_ = std::move(dat.obj_);
             } else if (dat.str_) {
@@ -294,6 +932,10 @@ public:
         return *this;
     }
 
+    ~basic_data() {
+        clear_escaped();
+    }
+
     // Type info
     bool is_object() const {
         return type_ == type::object;
@@ -342,6 +984,11 @@ public:
             obj_->insert(std::pair<string_type,basic_data>{name, var});
         }
     }
+    void erase(const string_type& name) {
+        if (is_object()) {
+            obj_->erase(name);
+        }
+    }
     const basic_data* get(const string_type& name) const {
         if (!is_object()) {
             return nullptr;
@@ -378,34 +1025,184 @@ public:
         return *str_;
     }
 
-    basic_data& operator[] (const string_type& key) {
-        return (*obj_)[key];
+    // Safe strings are rendered without escaping, for values that are
+    // already escaped or cannot contain special characters.
+    bool is_safe() const {
+        return safe_;
+    }
+    void set_safe(bool safe) {
+        safe_ = safe;
     }
 
-    const basic_partial<string_type>& partial_value() const {
-        return (*partial_);
+    // Keeps the escaped form of the string after it is first rendered, one
+    // per escape function, for long-lived values rendered many times. Only
+    // escape functions selected with set_escape(), including the default
+    // HTML escaping, are cached.
+    bool caches_escaped() const {
+        return cache_escaped_;
+    }
+    void set_cache_escaped(bool cache) {
+        cache_escaped_ = cache;
     }
 
-    const basic_lambda<string_type>& lambda_value() const {
-        return lambda_->type1_value();
+    // Returns the string escaped with escape_fn, computing it once. Safe to
+    // call from several threads rendering the same data.
+    using escape_function = void (*)(const string_type&, string_type&);
+    const string_type& escaped_string_value(escape_function escape_fn) const {
+        std::unique_ptr<escaped_string> entry;
+        escaped_string* head = escaped_.load(std::memory_order_acquire);
+        for (;;) {
+            for (const escaped_string* it = head; it != nullptr; it = it->next) {
+                if (it->escape_fn == escape_fn) {
+                    return it->value;
+                }
+            }
+            if (!entry) {
+                entry.reset(new escaped_string);
+                entry->escape_fn = escape_fn;
+                escape_fn(*str_, entry->value);
+            }
+            entry->next = head;
+            if (escaped_.compare_exchange_weak(head, entry.get(), std::memory_order_acq_rel, std::memory_order_acquire)) {
+                return entry.release()->value;
+            }
+        }
     }
 
-    const basic_lambda2<string_type>& lambda2_value() const {
-        return lambda_->type2_value();
+    // Structural hash: values of the same type and contents hash equally,
+    // however they were built. Object members are combined regardless of
+    // their order. Partials and lambdas only hash their type.
+    std::size_t hash() const {
+        const std::size_t seed = hash_combine(0, static_cast<std::size_t>(type_));
+        switch (type_) {
+            case type::object: {
+                std::size_t members = 0;
+                for (const auto& member : *obj_) {
+                    members += hash_combine(hash_string(member.first), member.second.hash());
+                }
+                return hash_combine(seed, members);
+            }
+            case type::string:
+                return hash_combine(hash_combine(seed, hash_string(*str_)), safe_ ? 1 : 0);
+            case type::list: {
+                std::size_t items = seed;
+                for (const auto& item : *list_) {
+                    items = hash_combine(items, item.hash());
+                }
+                return hash_combine(items, list_->size());
+            }
+            default:
+                return seed;
+        }
     }
 
-private:
-    type type_;
-    std::unique_ptr<basic_object<string_type>> obj_;
-    std::unique_ptr<string_type> str_;
-    std::unique_ptr<basic_list<string_type>> list_;
-    std::unique_ptr<basic_partial<string_type>> partial_;
-    std::unique_ptr<basic_lambda_t<string_type>> lambda_;
-};
+    // Structural equality, the counterpart of hash(): partials and lambdas
+    // only compare their type.
+    bool equals(const basic_data& other) const {
+        if (type_ != other.type_) {
+            return false;
+        }
+        switch (type_) {
+            case type::object: {
+                if (obj_->size() != other.obj_->size()) {
+                    return false;
+                }
+                for (const auto& member : *obj_) {
+                    const auto it = other.obj_->find(member.first);
+                    if (it == other.obj_->end() || !member.second.equals(it->second)) {
+                        return false;
+                    }
+                }
+                return true;
+            }
+            case type::string:
+                return safe_ == other.safe_ && *str_ == *other.str_;
+            case type::list: {
+                if (list_->size() != other.list_->size()) {
+                    return false;
+                }
+                for (std::size_t i = 0; i < list_->size(); ++i) {
+                    if (!(*list_)[i].equals((*other.list_)[i])) {
+                        return false;
+                    }
+                }
+                return true;
+            }
+            default:
+                return true;
+        }
+    }
 
-template <typename string_type>
-class delimiter_set {
-public:
+    // Whether this value, or any value it contains, is a lambda, or also a
+    // partial function when partials is set
+    bool contains_lambda(bool partials = false) const {
+        switch (type_) {
+            case type::object:
+                for (const auto& member : *obj_) {
+                    if (member.second.contains_lambda(partials)) {
+                        return true;
+                    }
+                }
+                return false;
+            case type::list:
+                for (const auto& item : *list_) {
+                    if (item.contains_lambda(partials)) {
+                        return true;
+                    }
+                }
+                return false;
+            default:
+                return is_lambda() || is_lambda2() || (partials && is_partial());
+        }
+    }
+
+    basic_data& operator[] (const string_type& key) {
+        return (*obj_)[key];
+    }
+
+    const basic_partial<string_type>& partial_value() const {
+        return (*partial_);
+    }
+
+    const basic_lambda<string_type>& lambda_value() const {
+        return lambda_->type1_value();
+    }
+
+    const basic_lambda2<string_type>& lambda2_value() const {
+        return lambda_->type2_value();
+    }
+
+private:
+    type type_;
+    std::unique_ptr<basic_object<string_type>> obj_;
+    std::unique_ptr<string_type> str_;
+    std::unique_ptr<basic_list<string_type>> list_;
+    std::unique_ptr<basic_partial<string_type>> partial_;
+    std::unique_ptr<basic_lambda_t<string_type>> lambda_;
+    bool safe_ = false;
+    bool cache_escaped_ = false;
+
+    class escaped_string {
+    public:
+        escape_function escape_fn;
+        string_type value;
+        escaped_string* next;
+    };
+    mutable std::atomic<escaped_string*> escaped_{nullptr};
+
+    void clear_escaped() {
+        escaped_string* entry = escaped_.exchange(nullptr);
+        while (entry) {
+            escaped_string* next = entry->next;
+            delete entry;
+            entry = next;
+        }
+    }
+};
+
+template <typename string_type>
+class delimiter_set {
+public:
     string_type begin;
     string_type end;
     delimiter_set()
@@ -498,6 +1295,9 @@ public:
 
 private:
     std::vector<const basic_data<string_type>*> items_;
+
+    template <typename StringType2>
+    friend class basic_mustache;
 };
 
 template <typename string_type>
@@ -505,8 +1305,16 @@ class line_buffer_state {
 public:
     string_type data;
     bool contained_section_tag = false;
+    // set when the start of the line was passed on before its end, which
+    // only happens once it is not blank
+    bool streamed = false;
+    // number of lines ended so far
+    std::size_t lines = 0;
 
     bool is_empty_or_contains_only_whitespace() const {
+        if (streamed) {
+            return false;
+        }
         for (const auto ch : data) {
             // don't look at newlines
             if (ch != ' ' && ch != '\t') {
@@ -519,7 +1327,172 @@ public:
     void clear() {
         data.clear();
         contained_section_tag = false;
+        streamed = false;
+        ++lines;
+    }
+
+    // Whether the rest of the line renders the same from both states
+    bool same_state(const line_buffer_state& other) const {
+        return data == other.data && contained_section_tag == other.contained_section_tag && streamed == other.streamed;
+    }
+};
+
+// Output of basic_mustache::render_vectored(): segments referring to the
+// literal text of the template and the strings of the data where possible,
+// and to a scratch area for everything else, like escaped values, so they
+// can be handed to writev() as they are. The segments stay valid until this
+// object is rendered to again or destroyed, as long as the template and the
+// data are not changed or destroyed.
+template <typename string_type>
+class basic_vectored_output {
+public:
+    using value_type = typename string_type::value_type;
+    using size_type = typename string_type::size_type;
+
+    class segment {
+    public:
+        const value_type* data;
+        size_type size;
+    };
+
+    const std::vector<segment>& segments() const {
+        return segments_;
+    }
+
+    // Number of characters of all segments
+    size_type size() const {
+        size_type size = 0;
+        for (const auto& seg : segments_) {
+            size += seg.size;
+        }
+        return size;
+    }
+
+    // Number of characters that were copied to the scratch area
+    size_type scratch_size() const {
+        return scratch_.size();
+    }
+
+    string_type str() const {
+        string_type str;
+        str.reserve(size());
+        for (const auto& seg : segments_) {
+            str.append(seg.data, seg.size);
+        }
+        return str;
+    }
+
+private:
+    // The scratch area is referred to by offset until rendering is done,
+    // since it moves as it grows.
+    class piece {
+    public:
+        const value_type* data;
+        size_type offset;
+        size_type size;
+    };
+
+    void clear() {
+        pieces_.clear();
+        line_.clear();
+        scratch_.clear();
+        line_scratch_ = 0;
+        segments_.clear();
+        retained_.clear();
+    }
+
+    // Adds text that outlives the output to the current line
+    void append_ref(const value_type* data, size_type size) {
+        if (size > 0) {
+            line_.push_back({data, 0, size});
+        }
+    }
+
+    void append_copy(const string_type& str) {
+        const size_type offset = scratch_.size();
+        scratch_.append(str);
+        append_scratch(offset);
+    }
+
+    // Adds what was appended to the scratch area since offset
+    void append_scratch(size_type offset) {
+        if (scratch_.size() > offset) {
+            line_.push_back({nullptr, offset, scratch_.size() - offset});
+        }
+    }
+
+    bool line_is_blank() const {
+        for (const auto& p : line_) {
+            const value_type* data = p.data ? p.data : scratch_.data() + p.offset;
+            for (size_type i = 0; i < p.size; ++i) {
+                if (data[i] != ' ' && data[i] != '\t') {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+
+    // Moves the current line to the output, or drops it
+    void end_line(bool output) {
+        if (output) {
+            pieces_.insert(pieces_.end(), line_.begin(), line_.end());
+        } else {
+            scratch_.resize(line_scratch_);
+        }
+        line_.clear();
+        line_scratch_ = scratch_.size();
+    }
+
+    // Adds text that outlives the output after the current line
+    void output_ref(const value_type* data, size_type size) {
+        if (size > 0) {
+            pieces_.push_back({data, 0, size});
+        }
     }
+
+    // Turns the pieces into segments, joining adjacent ones
+    void finish() {
+        for (const auto& p : pieces_) {
+            const value_type* data = p.data ? p.data : scratch_.data() + p.offset;
+            if (!segments_.empty() && segments_.back().data + segments_.back().size == data) {
+                segments_.back().size += p.size;
+            } else {
+                segments_.push_back({data, p.size});
+            }
+        }
+        pieces_.clear();
+    }
+
+    std::vector<piece> pieces_;
+    std::vector<piece> line_;
+    string_type scratch_;
+    size_type line_scratch_ = 0;
+    std::vector<segment> segments_;
+    // partials whose text is referred to
+    std::vector<std::shared_ptr<const void>> retained_;
+
+    template <typename StringType2>
+    friend class basic_mustache;
+};
+
+// Result of basic_mustache::measure(): the size of the output and the
+// results of the lambdas and partial functions it called, which
+// basic_mustache::render_measured() reuses so its output has exactly that
+// size.
+template <typename string_type>
+class basic_measurement {
+public:
+    std::size_t size() const {
+        return size_;
+    }
+
+private:
+    std::size_t size_ = 0;
+    std::vector<string_type> results_;
+
+    template <typename StringType2>
+    friend class basic_mustache;
 };
 
 template <typename string_type>
@@ -528,6 +1501,32 @@ public:
     basic_context<string_type>& ctx;
     delimiter_set<string_type> delim_set;
     line_buffer_state<string_type> line_buffer;
+    // sections and partials being rendered, see basic_mustache::max_depth()
+    std::size_t render_depth = 0;
+    // set by basic_mustache::render_vectored(), which renders lines into it
+    // instead of line_buffer.data
+    basic_vectored_output<string_type>* vectored = nullptr;
+    // results of top-level lambdas and partial functions recorded by
+    // basic_mustache::measure(), and replayed in the same order by
+    // basic_mustache::render_measured()
+    std::vector<string_type>* recorded_results = nullptr;
+    const std::vector<string_type>* replayed_results = nullptr;
+    std::size_t replayed_result = 0;
+    // flush hint set by basic_mustache::render() with a flush handler
+    const std::function<void()>* flush = nullptr;
+    bool prefix_flushed = false;
+    // pass on the start of a line as soon as it is not blank, instead of
+    // keeping the whole line until it ends
+    bool stream_lines = false;
+#if defined(KAINJOW_MUSTACHE_THREADS)
+    // set while the items of a list are rendered in parallel, lists inside
+    // them are rendered serially
+    bool parallel_list = false;
+    // whether the data holds lambdas or partial functions, checked once per
+    // render by the first parallel list. Values found later are part of it.
+    bool lambdas_checked = false;
+    bool has_lambdas = false;
+#endif // KAINJOW_MUSTACHE_THREADS
 
     context_internal(basic_context<string_type>& a_ctx)
         : ctx(a_ctx)
@@ -545,6 +1544,9 @@ enum class tag_type {
     comment,
     partial,
     set_delimiter,
+    // Left by basic_mustache::specialize() where a section tag was folded
+    // away, so the line is still treated as a standalone section line.
+    section_placeholder,
 };
 
 template <typename string_type>
@@ -579,6 +1581,19 @@ private:
     context_internal<string_type>& ctx_;
 };
 
+template <typename string_type>
+class lazy_section;
+
+// A section whose output is cached by basic_mustache::set_fragment_cache().
+// Its body reads names, the values of which are part of the cache key.
+template <typename string_type>
+class fragment_section {
+public:
+    std::size_t id = 0;
+    string_type name;
+    std::vector<string_type> names;
+};
+
 template <typename string_type>
 class component {
 private:
@@ -589,6 +1604,18 @@ public:
     mstch_tag<string_type> tag;
     std::vector<component> children;
     string_size_type position = string_type::npos;
+    // Set for sections parsed with parse_options::lazy_sections. The section
+    // has no children; its body is parsed the first time it is needed.
+    std::shared_ptr<lazy_section<string_type>> lazy;
+    // Set on sections rendered through a fragment cache
+    std::shared_ptr<const fragment_section<string_type>> fragment;
+    // Line breaks in text merged by merge_text(): the first is
+    // [first_newline, first_line_end) and the last ends at lines_end. npos
+    // when the text has no line breaks, or they are not line boundaries, as
+    // in the text of a variable.
+    string_size_type first_newline = string_type::npos;
+    string_size_type first_line_end = string_type::npos;
+    string_size_type lines_end = string_type::npos;
 
     enum class walk_control {
         walk, // "continue" is reserved :/
@@ -613,6 +1640,30 @@ public:
         return is_text() && !is_newline() && text.size() == 1 && (text[0] == ' ' || text[0] == '\t');
     }
 
+    bool has_line_breaks() const {
+        return first_newline != string_type::npos;
+    }
+
+    // Appends the text of another text component, keeping track of the
+    // line breaks of both.
+    void append_text(const component& comp) {
+        string_size_type first = comp.first_newline;
+        string_size_type first_end = comp.first_line_end;
+        string_size_type end = comp.lines_end;
+        if (!comp.has_line_breaks() && comp.is_newline()) {
+            first = 0;
+            first_end = end = comp.text.size();
+        }
+        if (first != string_type::npos) {
+            if (!has_line_breaks()) {
+                first_newline = text.size() + first;
+                first_line_end = text.size() + first_end;
+            }
+            lines_end = text.size() + end;
+        }
+        text.append(comp.text);
+    }
+
     void walk_children(const walk_callback& callback) {
         for (auto& child : children) {
             if (child.walk(callback) != walk_control::walk) {
@@ -639,17 +1690,59 @@ private:
     }
 };
 
+// Merges each run of adjacent text components, which the parser emits for
+// every line break and whitespace character, into a single component.
+template <typename string_type>
+void merge_text(component<string_type>& comp) {
+    std::vector<component<string_type>> children;
+    children.reserve(comp.children.size());
+    for (auto& child : comp.children) {
+        if (child.is_text() && !children.empty() && children.back().is_text()) {
+            children.back().append_text(child);
+        } else if (child.is_text()) {
+            children.push_back(component<string_type>{{}, child.position});
+            children.back().append_text(child);
+        } else {
+            merge_text(child);
+            children.push_back(std::move(child));
+        }
+    }
+    comp.children = std::move(children);
+}
+
+class parse_options {
+public:
+    // Only match the delimiters of section bodies when loading a template,
+    // and parse each body the first time the section is rendered. Templates
+    // with large, rarely rendered sections load faster and use less memory.
+    bool lazy_sections = false;
+};
+
 template <typename string_type>
 class parser {
 public:
-    parser(const string_type& input, context_internal<string_type>& ctx, component<string_type>& root_component, string_type& error_message)
+    parser(const string_type& input, context_internal<string_type>& ctx, component<string_type>& root_component, string_type& error_message, const parse_options& options = parse_options{})
     {
-        parse(input, ctx, root_component, error_message);
+        const delimiter_set<string_type> delim_set{ctx.delim_set};
+        parse(input, ctx, root_component, error_message, options);
+        if (options.lazy_sections && error_message == skim_error()) {
+            // Report the same error as a full parse would
+            root_component = component<string_type>{};
+            error_message.clear();
+            ctx.delim_set = delim_set;
+            parse(input, ctx, root_component, error_message, parse_options{});
+        }
     }
 
 private:
-    void parse(const string_type& input, context_internal<string_type>& ctx, component<string_type>& root_component, string_type& error_message) const {
-        using string_size_type = typename string_type::size_type;
+    using string_size_type = typename string_type::size_type;
+
+    static const string_type& skim_error() {
+        static const string_type error(1, '\0');
+        return error;
+    }
+
+    void parse(const string_type& input, context_internal<string_type>& ctx, component<string_type>& root_component, string_type& error_message, const parse_options& options) const {
         using streamstring = std::basic_ostringstream<typename string_type::value_type>;
 
         const string_type brace_delimiter_end_unescaped(3, '}');
@@ -662,7 +1755,13 @@ private:
         string_type current_text;
         string_size_type current_text_position = -1;
 
-        current_text.reserve(input_size);
+        // While skimming a lazy section body, tags are only checked and
+        // matched; skimmed_sections holds the sections opened inside it.
+        bool skimming = false;
+        delimiter_set<string_type> skim_delim_set;
+        std::vector<string_type> skimmed_sections;
+
+        current_text.reserve(options.lazy_sections ? 0 : input_size);
 
         const auto process_current_text = [&current_text, &current_text_position, &sections]() {
             if (!current_text.empty()) {
@@ -689,6 +1788,8 @@ private:
 
                 // Tag start delimiter
                 parse_tag = true;
+            } else if (skimming) {
+                input_position++;
             } else {
                 bool parsed_whitespace = false;
                 for (const auto& whitespace_text : whitespace) {
@@ -737,10 +1838,12 @@ private:
             }
 
             // Parse tag
-            const string_type tag_contents{trim(string_type{input, tag_contents_location, tag_location_end - tag_contents_location})};
+            string_size_type contents_first{tag_contents_location};
+            string_size_type contents_last{tag_location_end};
+            trim(input, contents_first, contents_last);
             component<string_type> comp;
-            if (!tag_contents.empty() && tag_contents[0] == '=') {
-                if (!parse_set_delimiter_tag(tag_contents, ctx.delim_set)) {
+            if (contents_first != contents_last && input[contents_first] == '=') {
+                if (!parse_set_delimiter_tag(input, contents_first, contents_last, ctx.delim_set)) {
                     streamstring ss;
                     ss << "Invalid set delimiter tag at " << tag_location_start;
                     error_message.assign(ss.str());
@@ -751,18 +1854,48 @@ private:
                 comp.tag.delim_set.reset(new delimiter_set<string_type>(ctx.delim_set));
             }
             if (comp.tag.type != tag_type::set_delimiter) {
-                parse_tag_contents(tag_is_unescaped_var, tag_contents, comp.tag);
+                parse_tag_contents(tag_is_unescaped_var, input, contents_first, contents_last, comp.tag);
             }
             comp.position = tag_location_start;
-            sections.back()->children.push_back(comp);
 
             // Start next search after this tag
             input_position = tag_location_end + current_tag_delimiter_end_size;
 
+            if (skimming) {
+                if (comp.tag.is_section_begin()) {
+                    skimmed_sections.push_back(comp.tag.name);
+                } else if (comp.tag.is_section_end() && !skimmed_sections.empty()) {
+                    if (skimmed_sections.back() != comp.tag.name) {
+                        error_message.assign(skim_error());
+                        return;
+                    }
+                    skimmed_sections.pop_back();
+                } else if (comp.tag.is_section_end()) {
+                    // End of the lazy section: keep its body as text
+                    component<string_type>& section = *sections.back();
+                    if (section.tag.name != comp.tag.name) {
+                        error_message.assign(skim_error());
+                        return;
+                    }
+                    section.tag.section_text.reset(new string_type(input.substr(section_starts.back(), tag_location_start - section_starts.back())));
+                    section.lazy = std::make_shared<lazy_section<string_type>>(section.tag.section_text, skim_delim_set);
+                    sections.pop_back();
+                    section_starts.pop_back();
+                    skimming = false;
+                }
+                continue;
+            }
+
+            sections.back()->children.push_back(comp);
+
             // Push or pop sections
             if (comp.tag.is_section_begin()) {
                 sections.push_back(&sections.back()->children.back());
                 section_starts.push_back(input_position);
+                if (options.lazy_sections) {
+                    skimming = true;
+                    skim_delim_set = ctx.delim_set;
+                }
             } else if (comp.tag.is_section_end()) {
                 if (sections.size() == 1) {
                     streamstring ss;
@@ -783,6 +1916,10 @@ private:
             if (!comp.tag.is_section_begin()) {
                 return component<string_type>::walk_control::walk;
             }
+            if (comp.lazy) {
+                // body was checked while skimming
+                return component<string_type>::walk_control::skip;
+            }
             if (comp.children.empty() || !comp.children.back().tag.is_section_end() || comp.children.back().tag.name != comp.tag.name) {
                 streamstring ss;
                 ss << "Unclosed section \"" << comp.tag.name << "\" at " << comp.position;
@@ -797,50 +1934,55 @@ private:
         }
     }
 
-    bool is_set_delimiter_valid(const string_type& delimiter) const {
+    // Tags are parsed as ranges of the input, so the only allocation is for
+    // the tag name or delimiters.
+    bool is_set_delimiter_valid(const string_type& input, string_size_type first, string_size_type last) const {
         // "Custom delimiters may not contain whitespace or the equals sign."
-        for (const auto ch : delimiter) {
-            if (ch == '=' || std::isspace(ch)) {
+        for (; first != last; ++first) {
+            if (input[first] == '=' || is_space(input[first])) {
                 return false;
             }
         }
         return true;
     }
 
-    bool parse_set_delimiter_tag(const string_type& contents, delimiter_set<string_type>& delimiter_set) const {
+    bool parse_set_delimiter_tag(const string_type& input, string_size_type first, string_size_type last, delimiter_set<string_type>& delimiter_set) const {
         // Smallest legal tag is "=X X="
-        if (contents.size() < 5) {
+        if (last - first < 5) {
             return false;
         }
-        if (contents.back() != '=') {
+        if (input[last - 1] != '=') {
             return false;
         }
-        const auto contents_substr = trim(contents.substr(1, contents.size() - 2));
-        const auto spacepos = contents_substr.find(' ');
-        if (spacepos == string_type::npos) {
+        ++first;
+        --last;
+        trim(input, first, last);
+        string_size_type space = first;
+        while (space != last && input[space] != ' ') {
+            ++space;
+        }
+        if (space == last) {
             return false;
         }
-        const auto nonspace = contents_substr.find_first_not_of(' ', spacepos + 1);
-        assert(nonspace != string_type::npos);
-        const string_type begin = contents_substr.substr(0, spacepos);
-        const string_type end = contents_substr.substr(nonspace, contents_substr.size() - nonspace);
-        if (!is_set_delimiter_valid(begin) || !is_set_delimiter_valid(end)) {
+        string_size_type nonspace = space + 1;
+        while (input[nonspace] == ' ') {
+            ++nonspace;
+        }
+        if (!is_set_delimiter_valid(input, first, space) || !is_set_delimiter_valid(input, nonspace, last)) {
             return false;
         }
-        delimiter_set.begin = begin;
-        delimiter_set.end = end;
+        delimiter_set.begin.assign(input, first, space - first);
+        delimiter_set.end.assign(input, nonspace, last - nonspace);
         return true;
     }
 
-    void parse_tag_contents(bool is_unescaped_var, const string_type& contents, mstch_tag<string_type>& tag) const {
+    void parse_tag_contents(bool is_unescaped_var, const string_type& input, string_size_type first, string_size_type last, mstch_tag<string_type>& tag) const {
         if (is_unescaped_var) {
             tag.type = tag_type::unescaped_variable;
-            tag.name = contents;
-        } else if (contents.empty()) {
+        } else if (first == last) {
             tag.type = tag_type::variable;
-            tag.name.clear();
         } else {
-            switch (contents.at(0)) {
+            switch (input[first]) {
                 case '#':
                     tag.type = tag_type::section_begin;
                     break;
@@ -863,308 +2005,4402 @@ private:
                     tag.type = tag_type::variable;
                     break;
             }
-            if (tag.type == tag_type::variable) {
-                tag.name = contents;
-            } else {
-                string_type name{contents};
-                name.erase(name.begin());
-                tag.name = trim(name);
+            if (tag.type != tag_type::variable) {
+                ++first;
+                trim(input, first, last);
             }
         }
+        tag.name.assign(input, first, last - first);
     }
 };
 
-template <typename StringType>
-class basic_mustache {
+template <typename string_type>
+class lazy_section {
 public:
-    using string_type = StringType;
+    lazy_section(const std::shared_ptr<string_type>& text, const delimiter_set<string_type>& delim_set)
+        : text_(text)
+        , delim_set_(delim_set)
+    {}
 
-    basic_mustache(const string_type& input)
-        : basic_mustache() {
-        context<string_type> ctx;
-        context_internal<string_type> context{ctx};
-        parser<string_type> parser{input, context, root_component_, error_message_};
+    // Parses the body on first use. Safe to call from several threads.
+    component<string_type>& body() {
+        std::call_once(once_, [this] {
+            context<string_type> ctx;
+            context_internal<string_type> context{ctx};
+            context.delim_set = delim_set_;
+            parse_options options;
+            options.lazy_sections = true;
+            parser<string_type>{*text_, context, body_, error_message_, options};
+            merge_text(body_);
+        });
+        return body_;
     }
 
-    bool is_valid() const {
-        return error_message_.empty();
+    // The error found when parsing the body, empty when it parsed
+    const string_type& error_message() {
+        body();
+        return error_message_;
     }
 
-    const string_type& error_message() const {
-        return error_message_;
+private:
+    std::shared_ptr<string_type> text_;
+    delimiter_set<string_type> delim_set_;
+    std::once_flag once_;
+    component<string_type> body_;
+    string_type error_message_;
+};
+
+// A path of the data a template can read, see basic_mustache::dependencies().
+// Names in sections can be found in the value of any enclosing section or in
+// the top-level data, so each of those paths is included.
+template <typename string_type>
+class basic_dependency {
+public:
+    string_type path;
+    // rendered by a variable tag, or by {{.}} in its section. A lambda at
+    // this path is called for its value.
+    bool rendered = false;
+    // tested or iterated by a section. A lambda at this path is called with
+    // the section text.
+    bool section = false;
+    bool inverted = false;
+
+    // Only the truthiness of the value, or whether a list is empty, is used
+    bool is_condition() const {
+        return !rendered;
     }
+};
 
-    using escape_handler = std::function<string_type(const string_type&)>;
-    void set_custom_escape(const escape_handler& escape_fn) {
-        escape_ = escape_fn;
+// Everything a template can read from its data
+template <typename string_type>
+class basic_dependencies {
+public:
+    using dependency = basic_dependency<string_type>;
+
+    // Paths in order of first use
+    std::vector<dependency> paths;
+    // Names of partials, which can read anything
+    std::vector<string_type> partials;
+    // {{.}} outside of sections renders the whole data
+    bool reads_root = false;
+
+    const dependency* find(const string_type& path) const {
+        for (const auto& dep : paths) {
+            if (dep.path == path) {
+                return &dep;
+            }
+        }
+        return nullptr;
     }
 
-    template <typename stream_type>
-    stream_type& render(const basic_data<string_type>& data, stream_type& stream) {
-        render(data, [&stream](const string_type& str) {
-            stream << str;
-        });
-        return stream;
+    // Whether changing the value at path can change the output. Values
+    // read by lambdas when they are called are not known.
+    bool depends_on(const string_type& path) const {
+        if (reads_root || !partials.empty()) {
+            return true;
+        }
+        for (const auto& dep : paths) {
+            if (is_prefix(dep.path, path) || is_prefix(path, dep.path)) {
+                return true;
+            }
+        }
+        return false;
     }
 
-    string_type render(const basic_data<string_type>& data) {
-        std::basic_ostringstream<typename string_type::value_type> ss;
-        return render(data, ss).str();
+    // Adds the paths read by comp and its section body
+    void add(const component<string_type>& comp) {
+        const mstch_tag<string_type>& tag{comp.tag};
+        const bool dot = tag.name.size() == 1 && tag.name[0] == '.';
+        switch (tag.type) {
+            case tag_type::variable:
+            case tag_type::unescaped_variable:
+                if (dot && scopes_.empty()) {
+                    reads_root = true;
+                } else if (dot) {
+                    for (const auto& path : scopes_.back()) {
+                        record(path).rendered = true;
+                    }
+                } else {
+                    for (const auto& path : candidates(tag.name)) {
+                        record(path).rendered = true;
+                    }
+                }
+                break;
+            case tag_type::section_begin:
+            case tag_type::section_begin_inverted: {
+                enter(comp);
+                const component<string_type>& body = comp.lazy ? comp.lazy->body() : comp;
+                for (const auto& child : body.children) {
+                    add(child);
+                }
+                leave();
+                break;
+            }
+            case tag_type::partial:
+                if (std::find(partials.begin(), partials.end(), tag.name) == partials.end()) {
+                    partials.push_back(tag.name);
+                }
+                break;
+            default:
+                break;
+        }
     }
 
-    template <typename stream_type>
-    stream_type& render(basic_context<string_type>& ctx, stream_type& stream) {
-        context_internal<string_type> context{ctx};
-        render([&stream](const string_type& str) {
-            stream << str;
-        }, context);
-        return stream;
+    // Adds the paths the section comp itself reads, and makes the paths
+    // added until leave() relative to it, as for the children of its body
+    void enter(const component<string_type>& comp) {
+        const mstch_tag<string_type>& tag{comp.tag};
+        std::vector<string_type> scope;
+        if (tag.name.size() == 1 && tag.name[0] == '.') {
+            if (!scopes_.empty()) {
+                scope = scopes_.back();
+            }
+        } else {
+            scope = candidates(tag.name);
+        }
+        for (const auto& path : scope) {
+            dependency& dep = record(path);
+            if (tag.type == tag_type::section_begin) {
+                dep.section = true;
+            } else {
+                dep.inverted = true;
+            }
+        }
+        scopes_.push_back(scope);
     }
 
-    string_type render(basic_context<string_type>& ctx) {
-        std::basic_ostringstream<typename string_type::value_type> ss;
-        return render(ctx, ss).str();
+    void leave() {
+        scopes_.pop_back();
     }
 
-    using render_handler = std::function<void(const string_type&)>;
-    void render(const basic_data<string_type>& data, const render_handler& handler) {
-        if (!is_valid()) {
-            return;
+    // Whether changing the value at path replaces one of the values read,
+    // rather than only something inside of them
+    bool replaces(const string_type& path) const {
+        if (reads_root || !partials.empty()) {
+            return true;
         }
-        context<string_type> ctx{&data};
-        context_internal<string_type> context{ctx};
-        render(handler, context);
+        for (const auto& dep : paths) {
+            if (is_prefix(path, dep.path)) {
+                return true;
+            }
+        }
+        return false;
     }
 
 private:
-    using string_size_type = typename string_type::size_type;
+    // Paths of enclosing sections, the innermost last
+    std::vector<std::vector<string_type>> scopes_;
 
-    basic_mustache()
-        : escape_(html_escape<string_type>)
-    {
+    std::vector<string_type> candidates(const string_type& name) const {
+        std::vector<string_type> paths{name};
+        for (const auto& scope : scopes_) {
+            for (const auto& path : scope) {
+                const string_type candidate{path + string_type(1, '.') + name};
+                if (std::find(paths.begin(), paths.end(), candidate) == paths.end()) {
+                    paths.push_back(candidate);
+                }
+            }
+        }
+        return paths;
     }
 
-    basic_mustache(const string_type& input, context_internal<string_type>& ctx)
-        : basic_mustache() {
-        parser<string_type> parser{input, ctx, root_component_, error_message_};
+    dependency& record(const string_type& path) {
+        for (auto& dep : paths) {
+            if (dep.path == path) {
+                return dep;
+            }
+        }
+        paths.push_back({});
+        paths.back().path = path;
+        return paths.back();
+    }
+
+    // Whether prefix names path or one of its ancestors
+    static bool is_prefix(const string_type& prefix, const string_type& path) {
+        return path.compare(0, prefix.size(), prefix) == 0 && (path.size() == prefix.size() || path[prefix.size()] == '.');
+    }
+};
+
+// Size-bounded LRU cache of rendered section output, which can be shared by
+// templates and threads. Entries are looked up by the section, the escape
+// function and a structural hash of the data the section reads, and keep a
+// copy of that data, which a hit must equal. See
+// basic_mustache::set_fragment_cache().
+template <typename string_type>
+class basic_fragment_cache {
+public:
+    using escape_function = void (*)(const string_type&, string_type&);
+
+    // The inputs of a section's output. values are the section value and
+    // the values of the names its body reads, null when missing. line is
+    // the text before the section when it is blank, as it decides whether
+    // the first line is standalone.
+    class key {
+    public:
+        std::size_t section;
+        escape_function escape_fn;
+        std::size_t hash;
+        bool blank_line = false;
+        string_type line;
+        std::vector<const basic_data<string_type>*> values;
+    };
+
+    // Output of a section, and the partial line it leaves in the line
+    // buffer. When the section starts on a line that has text, that text is
+    // left out: it comes before the output if the section ends the line,
+    // otherwise before the partial line.
+    class fragment {
+    public:
+        string_type output;
+        string_type line;
+        bool contained_section_tag = false;
+        bool ends_line = false;
+    };
+
+    // max_size is the number of characters kept, output and lines together
+    explicit basic_fragment_cache(std::size_t max_size = 1024 * 1024)
+        : max_size_(max_size)
+    {}
+
+    basic_fragment_cache(const basic_fragment_cache&) = delete;
+    basic_fragment_cache& operator= (const basic_fragment_cache&) = delete;
+
+    std::size_t max_size() const {
+        return max_size_;
+    }
+
+    std::size_t size() const {
+        std::lock_guard<std::mutex> lock{mutex_};
+        return size_;
+    }
+
+    std::size_t hits() const {
+        std::lock_guard<std::mutex> lock{mutex_};
+        return hits_;
+    }
+
+    std::size_t misses() const {
+        std::lock_guard<std::mutex> lock{mutex_};
+        return misses_;
+    }
+
+    void clear() {
+        std::lock_guard<std::mutex> lock{mutex_};
+        entries_.clear();
+        index_.clear();
+        size_ = 0;
+    }
+
+    // Drops the output of all sections with the given name, for when it
+    // depends on something outside of the data, like a partial changing.
+    void erase_section(const string_type& name) {
+        std::lock_guard<std::mutex> lock{mutex_};
+        for (auto it = entries_.begin(); it != entries_.end();) {
+            if (it->name == name) {
+                it = erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    // Returns the output rendered from inputs equal to those of k. Entries
+    // of the same hash but other inputs are misses.
+    std::shared_ptr<const fragment> find(const key& k) {
+        std::lock_guard<std::mutex> lock{mutex_};
+        const auto it = index_.find(slot_of(k));
+        if (it == index_.end() || !it->second->matches(k)) {
+            ++misses_;
+            return nullptr;
+        }
+        ++hits_;
+        entries_.splice(entries_.begin(), entries_, it->second);
+        return it->second->value;
+    }
+
+    void insert(const key& k, const string_type& name, const std::shared_ptr<const fragment>& value) {
+        const std::size_t size = value->output.size() + value->line.size();
+        if (size > max_size_) {
+            return;
+        }
+        entry e{slot_of(k), name, value, size, k.blank_line, k.line, {}};
+        e.values.reserve(k.values.size());
+        for (const basic_data<string_type>* v : k.values) {
+            e.values.emplace_back(v ? new basic_data<string_type>(*v) : nullptr);
+        }
+        std::lock_guard<std::mutex> lock{mutex_};
+        const auto it = index_.find(e.s);
+        if (it != index_.end()) {
+            erase(it->second);
+        }
+        while (!entries_.empty() && size_ + size > max_size_) {
+            erase(--entries_.end());
+        }
+        entries_.push_front(std::move(e));
+        index_[entries_.front().s] = entries_.begin();
+        size_ += size;
+    }
+
+    // Identifies a section for as long as the process runs, so entries of a
+    // destroyed template are never returned for another one.
+    static std::size_t next_section_id() {
+        static std::atomic<std::size_t> id{0};
+        return ++id;
+    }
+
+private:
+    // The hashed part of a key, one entry each
+    class slot {
+    public:
+        std::size_t section;
+        escape_function escape_fn;
+        std::size_t hash;
+
+        bool operator== (const slot& other) const {
+            return section == other.section && escape_fn == other.escape_fn && hash == other.hash;
+        }
+    };
+
+    class slot_hash {
+    public:
+        std::size_t operator() (const slot& s) const {
+            return hash_combine(s.hash, s.section);
+        }
+    };
+
+    class entry {
+    public:
+        slot s;
+        string_type name;
+        std::shared_ptr<const fragment> value;
+        std::size_t size;
+        bool blank_line;
+        string_type line;
+        std::vector<std::unique_ptr<const basic_data<string_type>>> values;
+
+        bool matches(const key& k) const {
+            if (blank_line != k.blank_line || line != k.line || values.size() != k.values.size()) {
+                return false;
+            }
+            for (std::size_t i = 0; i < values.size(); ++i) {
+                if (!values[i] || !k.values[i] ? values[i] || k.values[i] : !values[i]->equals(*k.values[i])) {
+                    return false;
+                }
+            }
+            return true;
+        }
+    };
+
+    static slot slot_of(const key& k) {
+        return {k.section, k.escape_fn, k.hash};
+    }
+
+    using entry_list = std::list<entry>;
+
+    typename entry_list::iterator erase(typename entry_list::iterator it) {
+        size_ -= it->size;
+        index_.erase(it->s);
+        return entries_.erase(it);
+    }
+
+    std::size_t max_size_;
+    mutable std::mutex mutex_;
+    entry_list entries_;
+    std::unordered_map<slot, typename entry_list::iterator, slot_hash> index_;
+    std::size_t size_ = 0;
+    std::size_t hits_ = 0;
+    std::size_t misses_ = 0;
+};
+
+#if defined(KAINJOW_MUSTACHE_THREADS)
+// Threads kept for the parallel lists of a template, see
+// basic_mustache::set_parallel(). Several renders can run on it at once.
+class thread_pool {
+public:
+    explicit thread_pool(std::size_t threads) {
+        threads_.reserve(threads);
+        for (std::size_t i = 0; i < threads; ++i) {
+            threads_.emplace_back([this]() {
+                work();
+            });
+        }
+    }
+
+    ~thread_pool() {
+        {
+            std::lock_guard<std::mutex> lock{mutex_};
+            stopping_ = true;
+        }
+        ready_.notify_all();
+        for (auto& thread : threads_) {
+            thread.join();
+        }
+    }
+
+    thread_pool(const thread_pool&) = delete;
+    thread_pool& operator=(const thread_pool&) = delete;
+
+    std::size_t size() const {
+        return threads_.size();
+    }
+
+    // Runs task on the calling thread and on up to helpers pool threads,
+    // and returns once all of them are done. Helpers that have not started
+    // when the calling thread is done are dropped, so a busy pool does not
+    // hold the caller back.
+    void run(const std::function<void()>& task, std::size_t helpers) {
+        batch b{&task};
+        helpers = std::min(helpers, threads_.size());
+        if (helpers > 0) {
+            {
+                std::lock_guard<std::mutex> lock{mutex_};
+                queue_.insert(queue_.end(), helpers, &b);
+            }
+            ready_.notify_all();
+        }
+        task();
+        if (helpers > 0) {
+            std::unique_lock<std::mutex> lock{mutex_};
+            queue_.erase(std::remove(queue_.begin(), queue_.end(), &b), queue_.end());
+            done_.wait(lock, [&b]() {
+                return b.running == 0;
+            });
+        }
+    }
+
+private:
+    class batch {
+    public:
+        explicit batch(const std::function<void()>* a_task)
+            : task(a_task)
+        {}
+
+        const std::function<void()>* task;
+        std::size_t running = 0;
+    };
+
+    void work() {
+        std::unique_lock<std::mutex> lock{mutex_};
+        for (;;) {
+            ready_.wait(lock, [this]() {
+                return stopping_ || !queue_.empty();
+            });
+            if (queue_.empty()) {
+                return;
+            }
+            batch* b = queue_.front();
+            queue_.pop_front();
+            ++b->running;
+            lock.unlock();
+            (*b->task)();
+            lock.lock();
+            if (--b->running == 0) {
+                done_.notify_all();
+            }
+        }
+    }
+
+    std::mutex mutex_;
+    std::condition_variable ready_;
+    std::condition_variable done_;
+    std::deque<batch*> queue_;
+    bool stopping_ = false;
+    std::vector<std::thread> threads_;
+};
+#endif // KAINJOW_MUSTACHE_THREADS
+
+template <typename StringType>
+class basic_mustache {
+public:
+    using string_type = StringType;
+
+    basic_mustache(const string_type& input)
+        : basic_mustache() {
+        context<string_type> ctx;
+        context_internal<string_type> context{ctx};
+        parser<string_type> parser{input, context, root_component_, error_message_};
+        merge_text(root_component_);
+    }
+
+    basic_mustache(const string_type& input, const parse_options& options)
+        : basic_mustache() {
+        options_ = options;
+        context<string_type> ctx;
+        context_internal<string_type> context{ctx};
+        parser<string_type> parser{input, context, root_component_, error_message_, options_};
+        merge_text(root_component_);
+    }
+
+    bool is_valid() const {
+        return error_message_.empty();
+    }
+
+    const string_type& error_message() const {
+        return error_message_;
+    }
+
+    using escape_handler = std::function<string_type(const string_type&)>;
+    void set_custom_escape(const escape_handler& escape_fn) {
+        escape_fn_ = nullptr;
+        escape_ = [escape_fn](const string_type& s, string_type& out) {
+            out.append(escape_fn(s));
+        };
+    }
+
+    // Escape function that appends the escaped form of its first argument to
+    // the second, so escaped values are written without a temporary string.
+    using escape_append_handler = std::function<void(const string_type&, string_type&)>;
+    void set_custom_escape_append(const escape_append_handler& escape_fn) {
+        escape_fn_ = nullptr;
+        escape_ = escape_fn;
+    }
+
+    // Selects an escape function that is called directly, such as
+    // json_escape_append<std::string>.
+    using escape_function = void (*)(const string_type&, string_type&);
+    void set_escape(escape_function escape_fn) {
+        escape_fn_ = escape_fn;
+        escape_ = nullptr;
+    }
+
+    // Maximum number of nested sections and partials, including those of
+    // templates rendered by lambdas and of compiled and bundled templates.
+    // Rendering fails with an error instead of going deeper, which stops
+    // runaway recursive partials.
+    void set_max_depth(std::size_t max_depth) {
+        max_depth_ = max_depth;
+    }
+
+    std::size_t max_depth() const {
+        return max_depth_;
+    }
+
+#if defined(KAINJOW_MUSTACHE_THREADS)
+    // Renders lists of at least min_items items on up to threads threads,
+    // in chunks of items whose output is concatenated in order. 0 threads
+    // uses all cores, 1 renders serially. The threads are started here and
+    // kept in a pool shared by copies of the template. Lists inside a list
+    // rendered in parallel are rendered serially, as are lists when the data
+    // holds lambdas or partial functions, unless lambdas_thread_safe is
+    // set, and when rendering with a custom basic_context, through the
+    // fragment cache, vectored, measured or with a flush handler. Lambdas
+    // must not throw when rendered in parallel.
+    void set_parallel(std::size_t threads, std::size_t min_items = 1024, bool lambdas_thread_safe = false) {
+        if (threads == 0) {
+            threads = std::max(std::thread::hardware_concurrency(), 1U);
+        }
+        if (threads != parallel_threads_) {
+            thread_pool_ = threads > 1 ? std::make_shared<thread_pool>(threads - 1) : nullptr;
+        }
+        parallel_threads_ = threads;
+        parallel_min_items_ = std::max(min_items, static_cast<std::size_t>(2));
+        parallel_lambdas_ = lambdas_thread_safe;
+    }
+
+    std::size_t parallel_threads() const {
+        return parallel_threads_;
+    }
+#endif // KAINJOW_MUSTACHE_THREADS
+
+    // Caches the output of sections, keyed by the section value, the values
+    // of the names the section body reads and the line the section starts
+    // on. Only the named sections are cached, or all of them when no names
+    // are given. Sections with partials or set delimiter tags, sections
+    // reading lambdas and templates using a custom escape handler are always
+    // rendered. Pass nullptr to stop caching.
+    //
+    // Entries keep a copy of the values they were rendered from, and a hit
+    // must equal them, so a hash collision costs a render but never returns
+    // the output of other data. The cache cannot see anything else the
+    // output depends on: call erase_section() when that changes.
+    using fragment_cache_type = basic_fragment_cache<string_type>;
+    void set_fragment_cache(const std::shared_ptr<fragment_cache_type>& cache, const std::vector<string_type>& sections = {}) {
+        fragment_cache_ = cache;
+        if (is_valid()) {
+            assign_fragments(root_component_, sections);
+        }
+    }
+
+    const std::shared_ptr<fragment_cache_type>& fragment_cache() const {
+        return fragment_cache_;
+    }
+
+    // Returns the paths of the data the template can read, and the partials
+    // it uses. Parses lazy section bodies.
+    basic_dependencies<string_type> dependencies() const {
+        basic_dependencies<string_type> deps;
+        for (const auto& child : root_component_.children) {
+            deps.add(child);
+        }
+        return deps;
+    }
+
+    template <typename stream_type>
+    stream_type& render(const basic_data<string_type>& data, stream_type& stream) {
+        render(data, [&stream](const string_type& str) {
+            stream << str;
+        });
+        return stream;
+    }
+
+    string_type render(const basic_data<string_type>& data) {
+        std::basic_ostringstream<typename string_type::value_type> ss;
+        return render(data, ss).str();
+    }
+
+    template <typename stream_type>
+    stream_type& render(basic_context<string_type>& ctx, stream_type& stream) {
+        context_internal<string_type> context{ctx};
+        render([&stream](const string_type& str) {
+            stream << str;
+        }, context);
+        return stream;
+    }
+
+    string_type render(basic_context<string_type>& ctx) {
+        std::basic_ostringstream<typename string_type::value_type> ss;
+        return render(ctx, ss).str();
+    }
+
+    // Passes the output to handler as it is rendered: a line is passed on in
+    // pieces once it is not blank, so output without line breaks is not
+    // collected whole.
+    using render_handler = std::function<void(const string_type&)>;
+    void render(const basic_data<string_type>& data, const render_handler& handler) {
+        if (!is_valid()) {
+            return;
+        }
+        context<string_type> ctx{&data};
+        context_internal<string_type> context{ctx};
+        context.stream_lines = true;
+        render(handler, context);
+    }
+
+    // Like render(data, handler), but also calls flush when the output passed
+    // to handler so far can be sent before rendering continues: at the end of
+    // the static prefix, and before lambdas and partial functions, which may
+    // be slow to produce their data. The line so far is passed on first
+    // unless it is blank, as it may still turn out to be a standalone tag
+    // line. flush is only called after new output.
+    using flush_handler = std::function<void()>;
+    void render(const basic_data<string_type>& data, const render_handler& handler, const flush_handler& flush) {
+        if (!is_valid()) {
+            return;
+        }
+        bool pending = false;
+        bool* p = &pending;
+        const render_handler* h = &handler;
+        const render_handler tracking_handler = [p, h](const string_type& str) {
+            *p = true;
+            (*h)(str);
+        };
+        const flush_handler flush_point = [p, &flush]() {
+            if (*p) {
+                *p = false;
+                flush();
+            }
+        };
+        context<string_type> ctx{&data};
+        context_internal<string_type> context{ctx};
+        context.flush = &flush_point;
+        context.stream_lines = true;
+        render(tracking_handler, context);
+    }
+
+    // Returns the text before the first tag, which every render starts with,
+    // so it can be sent before the data is ready. The start of the line of
+    // the first tag is left out if it is blank, as that line may be a
+    // standalone tag line. Returns the whole template if it has no tags.
+    string_type static_prefix() const {
+        string_type prefix;
+        if (!is_valid()) {
+            return prefix;
+        }
+        for (const auto& child : root_component_.children) {
+            if (!child.is_text()) {
+                const auto newline = prefix.find_last_of('\n');
+                const auto line = newline == string_type::npos ? 0 : newline + 1;
+                line_buffer_state<string_type> line_buffer;
+                line_buffer.data.assign(prefix, line, string_type::npos);
+                if (line_buffer.is_empty_or_contains_only_whitespace()) {
+                    prefix.resize(line);
+                }
+                return prefix;
+            }
+            prefix.append(child.text);
+        }
+        return prefix;
+    }
+
+    // Renders into buf like snprintf(): at most cap - 1 characters are
+    // written, followed by a null character if cap is not 0. Returns the size
+    // of the whole output, so a result of cap or more means it was truncated.
+    using value_type = typename string_type::value_type;
+    std::size_t render_to(const basic_data<string_type>& data, value_type* buf, std::size_t cap) {
+        class buffer_writer {
+        public:
+            value_type* buf;
+            std::size_t cap;
+            std::size_t size;
+        };
+        buffer_writer writer{buf, cap > 0 ? cap - 1 : 0, 0};
+        // captures a single pointer so std::function does not allocate
+        buffer_writer* w = &writer;
+        render(data, [w](const string_type& str) {
+            if (w->size < w->cap) {
+                const std::size_t count = std::min(str.size(), w->cap - w->size);
+                std::copy(str.data(), str.data() + count, w->buf + w->size);
+            }
+            w->size += str.size();
+        });
+        if (cap > 0) {
+            buf[std::min(writer.size, writer.cap)] = value_type{};
+        }
+        return writer.size;
+    }
+
+    // Runs the render without keeping its output and returns its size. The
+    // results of lambdas and partial functions are kept for
+    // render_measured().
+    using measurement = basic_measurement<string_type>;
+    measurement measure(const basic_data<string_type>& data) {
+        measurement m;
+        if (!is_valid()) {
+            return m;
+        }
+        context<string_type> ctx{&data};
+        context_internal<string_type> context{ctx};
+        context.recorded_results = &m.results_;
+        std::size_t* size = &m.size_;
+        render([size](const string_type& str) {
+            *size += str.size();
+        }, context);
+        return m;
+    }
+
+    // Renders data measured by measure() into a string reserved once, reusing
+    // the results of lambdas and partial functions instead of calling them
+    // again.
+    string_type render_measured(const basic_data<string_type>& data, const measurement& m) {
+        string_type output;
+        if (!is_valid()) {
+            return output;
+        }
+        output.reserve(m.size());
+        context<string_type> ctx{&data};
+        context_internal<string_type> context{ctx};
+        context.replayed_results = &m.results_;
+        string_type* out = &output;
+        render([out](const string_type& str) {
+            out->append(str);
+        }, context);
+        return output;
+    }
+
+    // Renders without copying literal text or unescaped data strings to the
+    // output, see basic_vectored_output. Fragment caching is not used.
+    using vectored_output = basic_vectored_output<string_type>;
+    void render_vectored(const basic_data<string_type>& data, vectored_output& out) {
+        out.clear();
+        if (!is_valid()) {
+            return;
+        }
+        context<string_type> ctx{&data};
+        context_internal<string_type> context{ctx};
+        context.vectored = &out;
+        const render_handler handler;
+        render(handler, context);
+        out.finish();
+    }
+
+    // Returns a copy of this template with everything that only depends on
+    // constants evaluated: variables become escaped text and sections whose
+    // value is known are kept or removed. The constants are stored with the
+    // result and take precedence over the data it is rendered with, so the
+    // output is the same as rendering this template with both. Set a custom
+    // escape function before specializing, it is applied to folded values.
+    basic_mustache specialize(const basic_data<string_type>& constants) const {
+        basic_mustache tmpl{*this};
+        // cached output would not account for the constants
+        tmpl.fragment_cache_ = nullptr;
+        if (!is_valid()) {
+            return tmpl;
+        }
+        tmpl.constants_.push_back(std::make_shared<const basic_data<string_type>>(constants));
+        std::vector<const basic_data<string_type>*> scope;
+        for (const auto& layer : tmpl.constants_) {
+            scope.push_back(layer.get());
+        }
+        tmpl.root_component_.children.clear();
+        specialize_children(root_component_, scope, tmpl.root_component_.children);
+        return tmpl;
+    }
+
+private:
+    using string_size_type = typename string_type::size_type;
+    using constant_scope = std::vector<const basic_data<string_type>*>;
+
+    // Marks the sections of comp that are rendered through the fragment
+    // cache. Parses lazy section bodies to find the names they read.
+    void assign_fragments(component<string_type>& comp, const std::vector<string_type>& sections) {
+        for (auto& child : comp.children) {
+            if (!child.tag.is_section_begin()) {
+                continue;
+            }
+            component<string_type>& body = child.lazy ? child.lazy->body() : child;
+            child.fragment = nullptr;
+            if (fragment_cache_ && (sections.empty() || std::find(sections.begin(), sections.end(), child.tag.name) != sections.end())) {
+                const std::shared_ptr<fragment_section<string_type>> section{std::make_shared<fragment_section<string_type>>()};
+                if (fragment_names(body, section->names)) {
+                    section->id = basic_fragment_cache<string_type>::next_section_id();
+                    section->name = child.tag.name;
+                    child.fragment = section;
+                }
+            }
+            assign_fragments(body, sections);
+        }
+    }
+
+    // Collects the names read by the tags of comp. Returns false when its
+    // output depends on more than their values.
+    static bool fragment_names(const component<string_type>& comp, std::vector<string_type>& names) {
+        for (const auto& child : comp.children) {
+            const mstch_tag<string_type>& tag{child.tag};
+            switch (tag.type) {
+                case tag_type::variable:
+                case tag_type::unescaped_variable:
+                case tag_type::section_begin:
+                case tag_type::section_begin_inverted:
+                    if (std::find(names.begin(), names.end(), tag.name) == names.end()) {
+                        names.push_back(tag.name);
+                    }
+                    break;
+                case tag_type::partial:
+                case tag_type::set_delimiter:
+                    return false;
+                default:
+                    break;
+            }
+            const component<string_type>& body = child.lazy ? child.lazy->body() : child;
+            if (!fragment_names(body, names)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Looks a name up the way context::get() would if only the constant
+    // items were on the stack. The innermost item is last.
+    static const basic_data<string_type>* find_constant(const string_type& name, const constant_scope& scope) {
+        if (name.size() == 1 && name.at(0) == '.') {
+            return scope.back();
+        }
+        const auto names = name.find('.') == string_type::npos ? std::vector<string_type>{name} : split(name, '.');
+        for (auto it = scope.rbegin(); it != scope.rend(); ++it) {
+            const basic_data<string_type>* var = *it;
+            for (const auto& n : names) {
+                var = var->get(n);
+                if (!var) {
+                    break;
+                }
+            }
+            if (var) {
+                return var;
+            }
+        }
+        return nullptr;
+    }
+
+    static void append_specialized(std::vector<component<string_type>>& out, const component<string_type>& comp) {
+        if (comp.is_text() && !out.empty() && out.back().is_text()) {
+            out.back().append_text(comp);
+        } else {
+            out.push_back(comp);
+        }
+    }
+
+    // Appends the specialized children of parent to out. Returns false if
+    // anything left in out still depends on the render-time data.
+    bool specialize_children(const component<string_type>& parent, constant_scope& scope, std::vector<component<string_type>>& out) const {
+        const component<string_type>& body = parent.lazy ? parent.lazy->body() : parent;
+        bool constant = true;
+        for (const auto& comp : body.children) {
+            if (comp.is_text()) {
+                append_specialized(out, comp);
+                continue;
+            }
+            const mstch_tag<string_type>& tag{comp.tag};
+            const basic_data<string_type>* var = nullptr;
+            switch (tag.type) {
+                case tag_type::variable:
+                case tag_type::unescaped_variable:
+                    var = find_constant(tag.name, scope);
+                    if (!var || var->is_lambda() || var->is_lambda2()) {
+                        out.push_back(comp);
+                        constant = false;
+                    } else if (var->is_string()) {
+                        component<string_type> text{{}, comp.position};
+                        if (tag.type == tag_type::variable) {
+                            escape_string(*var, text.text);
+                        } else {
+                            text.text = var->string_value();
+                        }
+                        if (text.is_newline()) {
+                            // would be rendered as a line break, keep the tag
+                            out.push_back(comp);
+                        } else if (!text.text.empty()) {
+                            append_specialized(out, text);
+                        }
+                    }
+                    break;
+                case tag_type::section_begin:
+                    var = find_constant(tag.name, scope);
+                    if (!var || var->is_lambda() || var->is_lambda2()) {
+                        out.push_back(comp);
+                        constant = false;
+                    } else if (!var->is_false() && !var->is_empty_list()) {
+                        if (!specialize_section(comp, var, scope, out)) {
+                            constant = false;
+                        }
+                    }
+                    break;
+                case tag_type::section_begin_inverted:
+                    var = find_constant(tag.name, scope);
+                    if (!var) {
+                        out.push_back(comp);
+                        constant = false;
+                    } else if (var->is_false() || var->is_empty_list()) {
+                        if (!specialize_section(comp, var, scope, out)) {
+                            constant = false;
+                        }
+                    }
+                    break;
+                case tag_type::partial:
+                    out.push_back(comp);
+                    constant = false;
+                    break;
+                case tag_type::set_delimiter:
+                case tag_type::section_placeholder:
+                    out.push_back(comp);
+                    break;
+                default:
+                    break;
+            }
+        }
+        return constant;
+    }
+
+    // Inlines a section that renders with a known value, like
+    // render_section() would. Items that are objects would shadow names for
+    // the tags left in the body, and tags left that read the item itself
+    // would read the enclosing value instead, so in both cases the section
+    // is kept unless the whole body could be evaluated.
+    bool specialize_section(const component<string_type>& comp, const basic_data<string_type>* var, constant_scope& scope, std::vector<component<string_type>>& out) const {
+        if (comp.lazy && !comp.lazy->error_message().empty()) {
+            // fails when rendered
+            out.push_back(comp);
+            return false;
+        }
+        component<string_type> placeholder;
+        placeholder.tag.type = tag_type::section_placeholder;
+        placeholder.position = comp.position;
+
+        std::vector<const basic_data<string_type>*> items;
+        if (var->is_non_empty_list()) {
+            for (const auto& item : var->list_value()) {
+                items.push_back(&item);
+            }
+        } else {
+            items.push_back(var);
+        }
+
+        std::vector<component<string_type>> inlined;
+        bool constant = true;
+        bool shadows = false;
+        bool reads_item = false;
+        for (const auto item : items) {
+            inlined.push_back(placeholder);
+            scope.push_back(item);
+            const std::size_t first = inlined.size();
+            constant = specialize_children(comp, scope, inlined) && constant;
+            for (std::size_t i = first; i < inlined.size() && !reads_item; ++i) {
+                reads_item = reads_top(inlined[i], scope);
+            }
+            scope.pop_back();
+            inlined.push_back(placeholder);
+            shadows = shadows || item->is_non_empty_object();
+        }
+        if ((shadows || reads_item) && !constant) {
+            out.push_back(comp);
+            return false;
+        }
+        for (const auto& inlined_comp : inlined) {
+            append_specialized(out, inlined_comp);
+        }
+        return constant;
+    }
+
+    // Whether a tag left in a specialized body may read the top of the
+    // context: {{.}} anywhere in it, or a partial or lambda, which can
+    // render one.
+    bool reads_top(const component<string_type>& comp, const constant_scope& scope) const {
+        const mstch_tag<string_type>& tag{comp.tag};
+        if (tag.type == tag_type::partial || (tag.name.size() == 1 && tag.name.at(0) == '.')) {
+            return true;
+        }
+        if (tag.type == tag_type::variable || tag.type == tag_type::unescaped_variable || tag.type == tag_type::section_begin) {
+            const basic_data<string_type>* var = find_constant(tag.name, scope);
+            if (var && (var->is_lambda() || var->is_lambda2())) {
+                return true;
+            }
+        }
+        const component<string_type>& body = comp.lazy ? comp.lazy->body() : comp;
+        for (const auto& child : body.children) {
+            if (reads_top(child, scope)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    basic_mustache()
+        : escape_fn_(html_escape_append<string_type>)
+    {
+    }
+
+    basic_mustache(const string_type& input, context_internal<string_type>& ctx)
+        : basic_mustache() {
+        parser<string_type> parser{input, ctx, root_component_, error_message_};
+        merge_text(root_component_);
+    }
+
+    string_type render(context_internal<string_type>& ctx) {
+        std::basic_ostringstream<typename string_type::value_type> ss;
+        render([&ss](const string_type& str) {
+            ss << str;
+        }, ctx);
+        return ss.str();
+    }
+
+    void render(const render_handler& handler, context_internal<string_type>& ctx, bool root_renderer = true) {
+        render_range(handler, ctx, 0, root_component_.children.size());
+        // process the last line, but only for the top-level renderer
+        if (root_renderer) {
+            render_current_line(handler, ctx, nullptr);
+        }
+    }
+
+    // Renders the top-level components [first, last), leaving the last line
+    // in the line buffer.
+    bool render_range(const render_handler& handler, context_internal<string_type>& ctx, std::size_t first, std::size_t last) {
+        push_constants(ctx);
+        const bool rendered = render_body(handler, ctx, root_component_, first, last);
+        end_render(ctx);
+        return rendered;
+    }
+
+    // Renders the children [first, last) of body, which is the template root
+    // or the body of a section whose value ctx already holds.
+    bool render_body(const render_handler& handler, context_internal<string_type>& ctx, component<string_type>& body, std::size_t first, std::size_t last) {
+        render_stack stack;
+        begin_frames(ctx, stack, body, first, last);
+        if (stack.caching) {
+            const render_handler capture_handler = [&handler, &stack](const string_type& str) {
+                stack.capture(str);
+                handler(str);
+            };
+            while (render_step(capture_handler, ctx, stack)) {
+            }
+        } else {
+            while (render_step(handler, ctx, stack)) {
+            }
+        }
+        return !stack.failed;
+    }
+
+    void render_current_line(const render_handler& handler, context_internal<string_type>& ctx, const string_type* newline) const {
+        if (ctx.vectored) {
+            const bool output = !ctx.line_buffer.contained_section_tag || !ctx.vectored->line_is_blank();
+            ctx.vectored->end_line(output);
+            if (output && newline) {
+                ctx.vectored->output_ref(newline->data(), newline->size());
+            }
+            ctx.line_buffer.clear();
+            return;
+        }
+        // We're at the end of a line, so check the line buffer state to see
+        // if the line had tags in it, and also if the line is now empty or
+        // contains whitespace only. if this situation is true, skip the line.
+        bool output = true;
+        if (ctx.line_buffer.contained_section_tag && ctx.line_buffer.is_empty_or_contains_only_whitespace()) {
+            output = false;
+        }
+        if (output) {
+            handler(ctx.line_buffer.data);
+            if (newline) {
+                handler(*newline);
+            }
+        }
+        ctx.line_buffer.clear();
+    }
+
+    void escape_value(const string_type& s, string_type& out) const {
+        if (escape_fn_) {
+            escape_fn_(s, out);
+        } else {
+            escape_(s, out);
+        }
+    }
+
+    void escape_string(const basic_data<string_type>& var, string_type& out) const {
+        if (var.is_safe()) {
+            out.append(var.string_value());
+        } else if (escape_fn_ && var.caches_escaped()) {
+            out.append(var.escaped_string_value(escape_fn_));
+        } else {
+            escape_value(var.string_value(), out);
+        }
+    }
+
+    // Renders merged text. Only the line ending at the first line break can
+    // hold tags, the following lines are complete and always rendered.
+    void render_text_lines(const render_handler& handler, context_internal<string_type>& ctx, const component<string_type>& comp) const {
+        const string_type& text = comp.text;
+        line_buffer_state<string_type>& line_buffer = ctx.line_buffer;
+        if (ctx.vectored) {
+            basic_vectored_output<string_type>& out = *ctx.vectored;
+            out.append_ref(text.data(), comp.first_newline);
+            if (line_buffer.contained_section_tag && out.line_is_blank()) {
+                out.end_line(false);
+                out.output_ref(text.data() + comp.first_line_end, comp.lines_end - comp.first_line_end);
+            } else {
+                out.end_line(true);
+                out.output_ref(text.data() + comp.first_newline, comp.lines_end - comp.first_newline);
+            }
+            line_buffer.clear();
+            out.append_ref(text.data() + comp.lines_end, text.size() - comp.lines_end);
+            return;
+        }
+        line_buffer.data.append(text, 0, comp.first_newline);
+        if (line_buffer.contained_section_tag && line_buffer.is_empty_or_contains_only_whitespace()) {
+            line_buffer.data.assign(text, comp.first_line_end, comp.lines_end - comp.first_line_end);
+        } else {
+            line_buffer.data.append(text, comp.first_newline, comp.lines_end - comp.first_newline);
+        }
+        if (!line_buffer.data.empty()) {
+            handler(line_buffer.data);
+        }
+        line_buffer.clear();
+        line_buffer.data.append(text, comp.lines_end, string_type::npos);
+    }
+
+    void render_result(context_internal<string_type>& ctx, const string_type& text) const {
+        if (ctx.vectored) {
+            ctx.vectored->append_copy(text);
+        } else {
+            ctx.line_buffer.data.append(text);
+        }
+    }
+
+    // Renders text that outlives the render, like template literals and
+    // data strings, which vectored output refers to instead of copying.
+    void render_literal(context_internal<string_type>& ctx, const string_type& text) const {
+        if (ctx.vectored) {
+            ctx.vectored->append_ref(text.data(), text.size());
+        } else {
+            ctx.line_buffer.data.append(text);
+        }
+    }
+
+    void render_escaped(context_internal<string_type>& ctx, const basic_data<string_type>& var) const {
+        if (!ctx.vectored) {
+            escape_string(var, ctx.line_buffer.data);
+        } else if (var.is_safe()) {
+            render_literal(ctx, var.string_value());
+        } else if (escape_fn_ && var.caches_escaped()) {
+            render_literal(ctx, var.escaped_string_value(escape_fn_));
+        } else {
+            // values without anything to escape are referred to as well
+            string_type& scratch = ctx.vectored->scratch_;
+            const string_type& value = var.string_value();
+            const auto offset = scratch.size();
+            escape_value(value, scratch);
+            if (scratch.compare(offset, string_type::npos, value) == 0) {
+                scratch.resize(offset);
+                render_literal(ctx, value);
+            } else {
+                ctx.vectored->append_scratch(offset);
+            }
+        }
+    }
+
+    using fragment_key = typename basic_fragment_cache<string_type>::key;
+    using fragment = typename basic_fragment_cache<string_type>::fragment;
+
+    // One level of the render stack: the children of the template root, a
+    // section body or a partial, and the list being iterated by a section.
+    class render_frame {
+    public:
+        render_frame(component<string_type>* a_body, bool a_section, bool a_pushed, const basic_list<string_type>* a_list, const std::shared_ptr<basic_mustache>& a_partial)
+            : body(a_body)
+            , section(a_section)
+            , pushed(a_pushed)
+            , list(a_list)
+            , partial(a_partial)
+            , end(a_body->children.size())
+        {}
+
+        component<string_type>* body;
+        std::size_t next = 0;
+        bool section;
+        bool pushed;
+        const basic_list<string_type>* list;
+        std::size_t item = 0;
+        // keeps a partial's components alive while they are rendered
+        std::shared_ptr<basic_mustache> partial;
+        std::size_t end;
+        // set while the output of a cached section is captured
+        const fragment_section<string_type>* fragment = nullptr;
+        fragment_key key{};
+        std::size_t capture_begin = 0;
+        std::size_t lines = 0;
+        std::size_t line_size = 0;
+        bool line_blank = false;
+    };
+
+    class render_stack {
+    public:
+        std::vector<render_frame> frames;
+        bool failed = false;
+        // Set when sections are rendered through the fragment cache. Output
+        // passed to the handler is kept while sections are being captured,
+        // the handler must call capture() when caching is set.
+        bool caching = false;
+        std::size_t capturing = 0;
+        string_type captured;
+
+        void capture(const string_type& str) {
+            if (capturing > 0) {
+                captured.append(str);
+            }
+        }
+    };
+
+    // Rendering runs on an explicit stack instead of recursing into sections
+    // and partials, so deeply nested data cannot overflow the thread stack,
+    // and it can be suspended between steps. Sections and partials count
+    // towards max_depth(), which is shared by templates rendered from
+    // lambdas and partials through ctx.
+    void begin_render(context_internal<string_type>& ctx, render_stack& stack, std::size_t first, std::size_t last) {
+        push_constants(ctx);
+        begin_frames(ctx, stack, root_component_, first, last);
+    }
+
+    // Constants of a specialized template take precedence over the data.
+    // end_render() pops them.
+    void push_constants(context_internal<string_type>& ctx) const {
+        for (const auto& constants : constants_) {
+            ctx.ctx.push(constants.get());
+        }
+    }
+
+    void begin_frames(context_internal<string_type>& ctx, render_stack& stack, component<string_type>& body, std::size_t first, std::size_t last) const {
+        stack.frames.reserve(16);
+        stack.frames.emplace_back(&body, false, false, nullptr, nullptr);
+        stack.frames.back().next = first;
+        stack.frames.back().end = last;
+        stack.caching = fragment_cache_ && escape_fn_ && !ctx.vectored;
+    }
+
+    // Renders the next component, or moves on to the next list item or out
+    // of a finished section. Returns false when rendering is done or failed.
+    bool render_step(const render_handler& handler, context_internal<string_type>& ctx, render_stack& stack) {
+        std::vector<render_frame>& frames = stack.frames;
+        if (frames.empty()) {
+            return false;
+        }
+        render_frame& frame = frames.back();
+        if (frame.next < frame.end) {
+            if (!render_component(handler, ctx, frame.body->children[frame.next++], stack)) {
+                while (!frames.empty()) {
+                    pop_frame(ctx, stack, false);
+                }
+                stack.failed = true;
+            }
+        } else if (!next_section_item(ctx, frame)) {
+            pop_frame(ctx, stack, true);
+        }
+        // captured sections keep their lines whole
+        if (ctx.stream_lines && stack.capturing == 0 && !stack.failed) {
+            stream_line(handler, ctx);
+        }
+        return !frames.empty();
+    }
+
+    // Passes on the current line so far once it holds anything but
+    // whitespace, when it can no longer be a standalone tag line
+    void stream_line(const render_handler& handler, context_internal<string_type>& ctx) const {
+        line_buffer_state<string_type>& line_buffer = ctx.line_buffer;
+        if (!ctx.vectored && !line_buffer.data.empty() && !line_buffer.is_empty_or_contains_only_whitespace()) {
+            handler(line_buffer.data);
+            line_buffer.data.clear();
+            line_buffer.streamed = true;
+        }
+    }
+
+    void end_render(context_internal<string_type>& ctx) {
+        for (std::size_t i = 0; i < constants_.size(); ++i) {
+            ctx.ctx.pop();
+        }
+    }
+
+    bool render_component(const render_handler& handler, context_internal<string_type>& ctx, component<string_type>& comp, render_stack& stack) {
+        if (comp.is_text()) {
+            if (comp.has_line_breaks()) {
+                render_text_lines(handler, ctx, comp);
+            } else if (comp.is_newline()) {
+                render_current_line(handler, ctx, &comp.text);
+            } else {
+                render_literal(ctx, comp.text);
+            }
+            return true;
+        }
+
+        // the static prefix ends at the first tag
+        if (ctx.flush && !ctx.prefix_flushed) {
+            ctx.prefix_flushed = true;
+            flush_point(ctx);
+        }
+
+        const mstch_tag<string_type>& tag{comp.tag};
+        const basic_data<string_type>* var = nullptr;
+        switch (tag.type) {
+            case tag_type::variable:
+            case tag_type::unescaped_variable:
+                if ((var = ctx.ctx.get(tag.name)) != nullptr) {
+                    if (var->is_lambda()) {
+                        flush_point(ctx);
+                    }
+                    return render_variable(handler, var, ctx, tag.type == tag_type::variable);
+                }
+                break;
+            case tag_type::section_begin:
+                if ((var = ctx.ctx.get(tag.name)) != nullptr) {
+                    if (var->is_lambda() || var->is_lambda2()) {
+                        flush_point(ctx);
+                        return render_lambda(handler, var, ctx, render_lambda_escape::optional, *comp.tag.section_text, true);
+                    } else if (!var->is_false() && !var->is_empty_list()) {
+                        return push_section(handler, ctx, comp, var, stack);
+                    }
+                }
+                break;
+            case tag_type::section_begin_inverted:
+                if ((var = ctx.ctx.get(tag.name)) == nullptr || var->is_false() || var->is_empty_list()) {
+                    return push_section(handler, ctx, comp, var, stack);
+                }
+                break;
+            case tag_type::partial:
+                return push_partial(ctx, tag.name, stack);
+            case tag_type::set_delimiter:
+                ctx.delim_set = *comp.tag.delim_set;
+                break;
+            case tag_type::section_placeholder:
+                ctx.line_buffer.contained_section_tag = true;
+                break;
+            default:
+                break;
+        }
+        return true;
+    }
+
+    // Lets the caller send the output so far before something that may be
+    // slow, like a lambda or partial function
+    void flush_point(context_internal<string_type>& ctx) const {
+        if (ctx.flush) {
+            (*ctx.flush)();
+        }
+    }
+
+    // The body of a section, parsed first when it is lazy. Returns null and
+    // makes the template invalid when a lazy body does not parse.
+    component<string_type>* section_body(component<string_type>& comp) {
+        if (!comp.lazy) {
+            return &comp;
+        }
+        component<string_type>& body = comp.lazy->body();
+        if (!comp.lazy->error_message().empty()) {
+            error_message_ = comp.lazy->error_message();
+            return nullptr;
+        }
+        return &body;
+    }
+
+    bool enter_render_depth(context_internal<string_type>& ctx) {
+        if (ctx.render_depth >= max_depth_) {
+            using streamstring = std::basic_ostringstream<typename string_type::value_type>;
+            streamstring ss;
+            ss << "Render depth exceeds the maximum of " << max_depth_;
+            error_message_ = ss.str();
+            return false;
+        }
+        ++ctx.render_depth;
+        return true;
+    }
+
+    // Starts rendering a section body like render_section() does: once per
+    // list item, once for a truthy value, or once without pushing a context
+    // for inverted sections. Cached sections are emitted from the fragment
+    // cache when it holds their output.
+    bool push_section(const render_handler& handler, context_internal<string_type>& ctx, component<string_type>& comp, const basic_data<string_type>* var, render_stack& stack) {
+        // account for the section begin tag
+        ctx.line_buffer.contained_section_tag = true;
+
+        fragment_key key{};
+        const bool cached = stack.caching && comp.fragment && make_fragment_key(ctx, *comp.fragment, var, key);
+        if (cached) {
+            const std::shared_ptr<const fragment> hit{fragment_cache_->find(key)};
+            if (hit) {
+                line_buffer_state<string_type>& line_buffer = ctx.line_buffer;
+                if (hit->ends_line) {
+                    if (!line_buffer.is_empty_or_contains_only_whitespace()) {
+                        handler(line_buffer.data);
+                    }
+                    if (!hit->output.empty()) {
+                        handler(hit->output);
+                    }
+                    line_buffer.clear();
+                    line_buffer.data = hit->line;
+                } else {
+                    line_buffer.data.append(hit->line);
+                }
+                line_buffer.contained_section_tag = hit->contained_section_tag;
+                return true;
+            }
+        }
+
+        component<string_type>* const section_body = this->section_body(comp);
+        if (!section_body || !enter_render_depth(ctx)) {
+            return false;
+        }
+        component<string_type>& body = *section_body;
+        const basic_list<string_type>* list = var && var->is_non_empty_list() ? &var->list_value() : nullptr;
+#if defined(KAINJOW_MUSTACHE_THREADS)
+        if (list && !cached && renders_in_parallel(ctx, *list, stack)) {
+            const bool rendered = render_parallel(handler, ctx, body, *list);
+            // account for the section end tag
+            ctx.line_buffer.contained_section_tag = true;
+            --ctx.render_depth;
+            return rendered;
+        }
+#endif
+        const basic_data<string_type>* item = list ? &list->front() : var;
+        if (item) {
+            ctx.ctx.push(item);
+        }
+        stack.frames.emplace_back(&body, true, item != nullptr, list, nullptr);
+        if (cached) {
+            render_frame& frame = stack.frames.back();
+            frame.fragment = comp.fragment.get();
+            frame.key = key;
+            frame.capture_begin = stack.captured.size();
+            frame.lines = ctx.line_buffer.lines;
+            frame.line_size = ctx.line_buffer.data.size();
+            frame.line_blank = ctx.line_buffer.is_empty_or_contains_only_whitespace();
+            ++stack.capturing;
+        }
+        return true;
+    }
+
+#if defined(KAINJOW_MUSTACHE_THREADS)
+    // Lists inside a list rendered in parallel are rendered serially, the
+    // outer list is where splitting pays off. So are lists too short to
+    // fill more than one chunk.
+    bool renders_in_parallel(context_internal<string_type>& ctx, const basic_list<string_type>& list, const render_stack& stack) const {
+        if (!thread_pool_ || ctx.parallel_list || list.size() < parallel_min_items_ || list.size() <= min_chunk_items + 1 ||
+            stack.capturing > 0 || ctx.vectored || ctx.recorded_results || ctx.replayed_results || ctx.flush) {
+            return false;
+        }
+        const context<string_type>* items = dynamic_cast<const context<string_type>*>(&ctx.ctx);
+        if (!items) {
+            return false;
+        }
+        if (!parallel_lambdas_ && !ctx.lambdas_checked) {
+            // the list was found in this data
+            ctx.lambdas_checked = true;
+            for (const auto& item : items->items_) {
+                if (item->contains_lambda(true)) {
+                    ctx.has_lambdas = true;
+                    break;
+                }
+            }
+        }
+        return parallel_lambdas_ || !ctx.has_lambdas;
+    }
+
+    // Renders the items [first, last) of a list section through ctx
+    bool render_items(const render_handler& handler, context_internal<string_type>& ctx, component<string_type>& body, const basic_list<string_type>& list, std::size_t first, std::size_t last) {
+        render_stack stack;
+        const bool parallel_list = ctx.parallel_list;
+        ctx.parallel_list = true;
+        for (std::size_t index = first; index < last && !stack.failed; ++index) {
+            // account for the section end and the next section begin tag
+            ctx.line_buffer.contained_section_tag = true;
+            ctx.ctx.push(&list[index]);
+            stack.frames.emplace_back(&body, false, false, nullptr, nullptr);
+            while (render_step(handler, ctx, stack)) {
+            }
+            ctx.ctx.pop();
+        }
+        ctx.parallel_list = parallel_list;
+        return !stack.failed;
+    }
+
+    // Renders the first item, then the others in chunks on the thread pool,
+    // each with its own copy of the context stack and a template copy for
+    // errors. Chunks start from the line and delimiter state after the first
+    // item, which is the state between items of most templates. Chunks that
+    // turn out to start from a different state are rendered again serially.
+    bool render_parallel(const render_handler& handler, context_internal<string_type>& ctx, component<string_type>& body, const basic_list<string_type>& list) {
+        if (!render_items(handler, ctx, body, list, 0, 1)) {
+            return false;
+        }
+        class chunk {
+        public:
+            std::size_t first;
+            std::size_t last;
+            string_type output;
+            line_buffer_state<string_type> line_buffer;
+            delimiter_set<string_type> delim_set;
+            bool rendered = false;
+            string_type error_message;
+        };
+        const std::size_t count = list.size() - 1;
+        const std::size_t chunk_size = std::max(count / (parallel_threads_ * 4), static_cast<std::size_t>(min_chunk_items));
+        std::vector<chunk> chunks;
+        for (std::size_t first = 1; first < list.size(); first += chunk_size) {
+            chunk c;
+            c.first = first;
+            c.last = std::min(first + chunk_size, list.size());
+            chunks.push_back(std::move(c));
+        }
+        const line_buffer_state<string_type> start_line{ctx.line_buffer};
+        const delimiter_set<string_type> start_delim{ctx.delim_set};
+        const std::vector<const basic_data<string_type>*>& items = static_cast<context<string_type>&>(ctx.ctx).items_;
+        std::atomic<std::size_t> next{0};
+        const std::function<void()> work = [&]() {
+            basic_mustache tmpl;
+            tmpl.escape_ = escape_;
+            tmpl.escape_fn_ = escape_fn_;
+            tmpl.max_depth_ = max_depth_;
+            tmpl.options_ = options_;
+            for (std::size_t index = next++; index < chunks.size(); index = next++) {
+                chunk& c = chunks[index];
+                context<string_type> chunk_ctx;
+                for (auto it = items.rbegin(); it != items.rend(); ++it) {
+                    chunk_ctx.push(*it);
+                }
+                context_internal<string_type> context{chunk_ctx};
+                context.line_buffer = start_line;
+                context.delim_set = start_delim;
+                context.render_depth = ctx.render_depth;
+                string_type* output = &c.output;
+                c.rendered = tmpl.render_items([output](const string_type& str) {
+                    output->append(str);
+                }, context, body, list, c.first, c.last);
+                c.line_buffer = context.line_buffer;
+                c.delim_set = context.delim_set;
+                if (!c.rendered) {
+                    c.error_message = tmpl.error_message_;
+                    tmpl.error_message_.clear();
+                }
+            }
+        };
+        thread_pool_->run(work, std::min(parallel_threads_, chunks.size()) - 1);
+        for (auto& c : chunks) {
+            const bool same_start = ctx.line_buffer.same_state(start_line) &&
+                ctx.delim_set.begin == start_delim.begin &&
+                ctx.delim_set.end == start_delim.end;
+            if (!same_start) {
+                if (!render_items(handler, ctx, body, list, c.first, c.last)) {
+                    return false;
+                }
+                continue;
+            }
+            if (!c.rendered) {
+                error_message_ = c.error_message;
+                return false;
+            }
+            if (!c.output.empty()) {
+                handler(c.output);
+            }
+            const std::size_t lines = ctx.line_buffer.lines + (c.line_buffer.lines - start_line.lines);
+            ctx.line_buffer = c.line_buffer;
+            ctx.line_buffer.lines = lines;
+            ctx.delim_set = c.delim_set;
+        }
+        return true;
+    }
+#endif // KAINJOW_MUSTACHE_THREADS
+
+    // The key of a cached section hashes the section value and the values
+    // of the names its body reads as seen from the section. Names found in
+    // the section value are hashed with it, so looking them up from the
+    // outer context is enough. {{.}} reads the section value too, unless
+    // there is none: an inverted section over a missing name leaves the
+    // enclosing value on top, which is hashed then. Sections reading
+    // lambdas are not cached.
+    // Whether the first line is standalone depends on the text before the
+    // section only if it is blank, then it is part of the key. Otherwise
+    // that text is kept out of the fragment.
+    // The key keeps pointers to the values, which the cache compares with
+    // its copies on a hit.
+    bool make_fragment_key(context_internal<string_type>& ctx, const fragment_section<string_type>& section, const basic_data<string_type>* var, fragment_key& key) const {
+        const line_buffer_state<string_type>& line_buffer = ctx.line_buffer;
+        key.blank_line = line_buffer.is_empty_or_contains_only_whitespace();
+        key.line = key.blank_line ? line_buffer.data : string_type{};
+        std::size_t hash = key.blank_line ? hash_string(line_buffer.data) : 0x5bd1e995;
+        key.values.clear();
+        key.values.reserve(section.names.size() + 1);
+        if (var && var->contains_lambda()) {
+            return false;
+        }
+        hash = hash_combine(hash, var ? var->hash() : 0);
+        key.values.push_back(var);
+        for (const auto& name : section.names) {
+            const bool top = name.size() == 1 && name.at(0) == '.';
+            if (top && var) {
+                continue;
+            }
+            const basic_data<string_type>* value = ctx.ctx.get(name);
+            if (value && value->contains_lambda()) {
+                return false;
+            }
+            hash = hash_combine(hash, value ? value->hash() : 0);
+            key.values.push_back(value);
+        }
+        key.section = section.id;
+        key.escape_fn = escape_fn_;
+        key.hash = hash;
+        return true;
+    }
+
+    // Returns the template text of a partial. Results of partial functions
+    // are recorded and replayed like lambda results, see measure().
+    string_type partial_text(context_internal<string_type>& ctx, const basic_data<string_type>& var) const {
+        if (!var.is_partial()) {
+            return var.string_value();
+        }
+        if (ctx.replayed_results && ctx.replayed_result < ctx.replayed_results->size()) {
+            return (*ctx.replayed_results)[ctx.replayed_result++];
+        }
+        string_type result{var.partial_value()()};
+        if (ctx.recorded_results) {
+            ctx.recorded_results->push_back(result);
+        }
+        return result;
+    }
+
+    bool push_partial(context_internal<string_type>& ctx, const string_type& name, render_stack& stack) {
+        const basic_data<string_type>* var = ctx.ctx.get_partial(name);
+        if (var == nullptr || !(var->is_partial() || var->is_string())) {
+            return true;
+        }
+        if (var->is_partial()) {
+            flush_point(ctx);
+        }
+        const string_type partial_result{partial_text(ctx, *var)};
+        const std::shared_ptr<basic_mustache> tmpl{std::make_shared<basic_mustache>(partial_result, options_)};
+        if (!tmpl->is_valid()) {
+            error_message_ = tmpl->error_message();
+            return false;
+        }
+        if (!enter_render_depth(ctx)) {
+            return false;
+        }
+        if (ctx.vectored) {
+            ctx.vectored->retained_.push_back(tmpl);
+        }
+        stack.frames.emplace_back(&tmpl->root_component_, false, false, nullptr, tmpl);
+        return true;
+    }
+
+    // Moves a finished section frame to its next list item. Returns false
+    // when the frame is done.
+    bool next_section_item(context_internal<string_type>& ctx, render_frame& frame) const {
+        if (!frame.list || frame.item + 1 == frame.list->size()) {
+            return false;
+        }
+        // account for the section end and the next section begin tag
+        ctx.line_buffer.contained_section_tag = true;
+        ctx.ctx.pop();
+        ctx.ctx.push(&(*frame.list)[++frame.item]);
+        frame.next = 0;
+        return true;
+    }
+
+    // Pops the top frame. Completed sections that were captured are stored
+    // in the fragment cache.
+    void pop_frame(context_internal<string_type>& ctx, render_stack& stack, bool completed) const {
+        const render_frame& frame = stack.frames.back();
+        if (frame.section) {
+            // ctx may have been cleared. account for the section end tag
+            ctx.line_buffer.contained_section_tag = true;
+        }
+        if (frame.fragment) {
+            if (completed) {
+                // text before the section that is not blank is always output
+                // first when the line ends
+                const std::shared_ptr<fragment> value{std::make_shared<fragment>()};
+                value->ends_line = ctx.line_buffer.lines != frame.lines;
+                if (value->ends_line) {
+                    value->output.assign(stack.captured, frame.capture_begin + (frame.line_blank ? 0 : frame.line_size), string_type::npos);
+                    value->line = ctx.line_buffer.data;
+                } else {
+                    value->line.assign(ctx.line_buffer.data, frame.line_size, string_type::npos);
+                }
+                value->contained_section_tag = ctx.line_buffer.contained_section_tag;
+                fragment_cache_->insert(frame.key, frame.fragment->name, value);
+            }
+            if (--stack.capturing == 0) {
+                stack.captured.clear();
+            }
+        }
+        if (frame.pushed) {
+            ctx.ctx.pop();
+        }
+        if (stack.frames.size() > 1) {
+            --ctx.render_depth;
+        }
+        stack.frames.pop_back();
+    }
+
+    enum class render_lambda_escape {
+        escape,
+        unescape,
+        optional,
+    };
+
+    bool render_lambda(const render_handler& handler, const basic_data<string_type>* var, context_internal<string_type>& ctx, render_lambda_escape escape, const string_type& text, bool parse_with_same_context) {
+        const typename basic_renderer<string_type>::type2 render2 = [this, &ctx, parse_with_same_context, escape](const string_type& text, bool escaped) {
+            const auto process_template = [this, &ctx, escape, escaped](basic_mustache& tmpl) -> string_type {
+                if (!tmpl.is_valid()) {
+                    error_message_ = tmpl.error_message();
+                    return {};
+                }
+                // lambdas that render themselves recurse like partials do
+                if (!enter_render_depth(ctx)) {
+                    return {};
+                }
+                // templates of lambdas render to a string
+                basic_vectored_output<string_type>* vectored = ctx.vectored;
+                const bool stream_lines = ctx.stream_lines;
+                ctx.vectored = nullptr;
+                ctx.stream_lines = false;
+                const string_type str{tmpl.render(ctx)};
+                ctx.vectored = vectored;
+                ctx.stream_lines = stream_lines;
+                --ctx.render_depth;
+                if (!tmpl.is_valid()) {
+                    error_message_ = tmpl.error_message();
+                    return {};
+                }
+                bool do_escape = false;
+                switch (escape) {
+                    case render_lambda_escape::escape:
+                        do_escape = true;
+                        break;
+                    case render_lambda_escape::unescape:
+                        do_escape = false;
+                        break;
+                    case render_lambda_escape::optional:
+                        do_escape = escaped;
+                        break;
+                }
+                if (!do_escape) {
+                    return str;
+                }
+                string_type escaped_str;
+                escape_value(str, escaped_str);
+                return escaped_str;
+            };
+            if (parse_with_same_context) {
+                basic_mustache tmpl{text, ctx};
+                tmpl.escape_ = escape_;
+                tmpl.escape_fn_ = escape_fn_;
+                tmpl.max_depth_ = max_depth_;
+                return process_template(tmpl);
+            }
+            basic_mustache tmpl{text};
+            tmpl.escape_ = escape_;
+            tmpl.escape_fn_ = escape_fn_;
+            tmpl.max_depth_ = max_depth_;
+            return process_template(tmpl);
+        };
+        const typename basic_renderer<string_type>::type1 render = [&render2](const string_type& text) {
+            return render2(text, false);
+        };
+        const bool replay = ctx.replayed_results && ctx.replayed_result < ctx.replayed_results->size();
+        // lambdas called by this one are not recorded
+        std::vector<string_type>* recorded = ctx.recorded_results;
+        ctx.recorded_results = nullptr;
+        string_type result;
+        if (var->is_lambda2()) {
+            if (replay) {
+                result = (*ctx.replayed_results)[ctx.replayed_result++];
+            } else {
+                const basic_renderer<string_type> renderer{render, render2};
+                result = var->lambda2_value()(text, renderer);
+            }
+        } else {
+            render_current_line(handler, ctx, nullptr);
+            if (replay) {
+                result = (*ctx.replayed_results)[ctx.replayed_result++];
+            } else {
+                result = render(var->lambda_value()(text));
+            }
+        }
+        ctx.recorded_results = recorded;
+        if (recorded) {
+            recorded->push_back(result);
+        }
+        render_result(ctx, result);
+        return error_message_.empty();
+    }
+
+    bool render_variable(const render_handler& handler, const basic_data<string_type>* var, context_internal<string_type>& ctx, bool escaped) {
+        if (var->is_string()) {
+            if (escaped) {
+                render_escaped(ctx, *var);
+            } else {
+                render_literal(ctx, var->string_value());
+            }
+        } else if (var->is_lambda()) {
+            const render_lambda_escape escape_opt = escaped ? render_lambda_escape::escape : render_lambda_escape::unescape;
+            return render_lambda(handler, var, ctx, escape_opt, {}, false);
+        } else if (var->is_lambda2()) {
+            using streamstring = std::basic_ostringstream<typename string_type::value_type>;
+            streamstring ss;
+            ss << "Lambda with render argument is not allowed for regular variables";
+            error_message_ = ss.str();
+            return false;
+        }
+        return true;
+    }
+
+    bool render_partial(const render_handler& handler, context_internal<string_type>& ctx, const string_type& name) {
+        const basic_data<string_type>* var = ctx.ctx.get_partial(name);
+        if (var == nullptr || !(var->is_partial() || var->is_string())) {
+            return true;
+        }
+        const string_type partial_result{partial_text(ctx, *var)};
+        basic_mustache tmpl{partial_result, options_};
+        tmpl.escape_ = escape_;
+        tmpl.escape_fn_ = escape_fn_;
+        tmpl.max_depth_ = max_depth_;
+        if (!tmpl.is_valid()) {
+            error_message_ = tmpl.error_message();
+            return false;
+        }
+        if (!enter_render_depth(ctx)) {
+            return false;
+        }
+        tmpl.render(handler, ctx, false);
+        --ctx.render_depth;
+        if (!tmpl.is_valid()) {
+            error_message_ = tmpl.error_message();
+        }
+        return tmpl.is_valid();
+    }
+
+    // Renders a section body once per list item, once for a truthy value, or
+    // once without pushing a context for inverted sections. The body returns
+    // false to stop iterating. Returns false when the section is nested
+    // deeper than max_depth().
+    template <typename body_type>
+    bool render_section(context_internal<string_type>& ctx, const basic_data<string_type>* var, const body_type& body) {
+        if (!enter_render_depth(ctx)) {
+            return false;
+        }
+        if (var && var->is_non_empty_list()) {
+            for (const auto& item : var->list_value()) {
+                // account for the section begin tag
+                ctx.line_buffer.contained_section_tag = true;
+
+                const context_pusher<string_type> ctxpusher{ctx, &item};
+                const bool keep_going = body();
+
+                // ctx may have been cleared. account for the section end tag
+                ctx.line_buffer.contained_section_tag = true;
+
+                if (!keep_going) {
+                    break;
+                }
+            }
+        } else if (var) {
+            // account for the section begin tag
+            ctx.line_buffer.contained_section_tag = true;
+
+            const context_pusher<string_type> ctxpusher{ctx, var};
+            body();
+
+            // ctx may have been cleared. account for the section end tag
+            ctx.line_buffer.contained_section_tag = true;
+        } else {
+            // account for the section begin tag
+            ctx.line_buffer.contained_section_tag = true;
+
+            body();
+
+            // ctx may have been cleared. account for the section end tag
+            ctx.line_buffer.contained_section_tag = true;
+        }
+        --ctx.render_depth;
+        return true;
+    }
+
+private:
+    string_type error_message_;
+    component<string_type> root_component_;
+    escape_append_handler escape_;
+    escape_function escape_fn_;
+    std::size_t max_depth_ = 1000;
+#if defined(KAINJOW_MUSTACHE_THREADS)
+    std::size_t parallel_threads_ = 1;
+    std::size_t parallel_min_items_ = 1024;
+    bool parallel_lambdas_ = false;
+    // shared by copies of the template
+    std::shared_ptr<thread_pool> thread_pool_;
+    static constexpr std::size_t min_chunk_items = 64;
+#endif
+    parse_options options_;
+    std::shared_ptr<basic_fragment_cache<string_type>> fragment_cache_;
+    std::vector<std::shared_ptr<const basic_data<string_type>>> constants_;
+
+    template <typename StringType2>
+    friend class basic_compiled_renderer;
+    template <typename StringType2>
+    friend class basic_compiled_template;
+    template <typename StringType2>
+    friend class basic_incremental_render;
+    template <typename StringType2>
+    friend class basic_chunked_render;
+#if defined(KAINJOW_MUSTACHE_THREADS)
+    template <typename StringType2>
+    friend class basic_async_render;
+#endif
+};
+
+// Sets the value at a path of object members separated by dots, creating
+// missing objects on the way. Returns false when the path goes through a
+// value that is not an object.
+template <typename string_type>
+bool set_data_path(basic_data<string_type>& data, const string_type& path, const basic_data<string_type>& value) {
+    const std::vector<string_type> names{split(path, '.')};
+    if (names.empty()) {
+        return false;
+    }
+    basic_data<string_type>* parent = &data;
+    for (std::size_t i = 0; i + 1 < names.size(); ++i) {
+        if (!parent->is_object()) {
+            return false;
+        }
+        if (!parent->get(names[i])) {
+            parent->set(names[i], basic_data<string_type>{});
+        }
+        parent = &(*parent)[names[i]];
+    }
+    if (!parent->is_object()) {
+        return false;
+    }
+    parent->set(names.back(), value);
+    return true;
+}
+
+// The shallowest path at which set_data_path() creates or replaces a value
+template <typename string_type>
+string_type replaced_data_path(const basic_data<string_type>& data, const string_type& path) {
+    const std::vector<string_type> names{split(path, '.')};
+    const basic_data<string_type>* value = &data;
+    string_type replaced;
+    for (std::size_t i = 0; i < names.size() && value; ++i) {
+        if (i > 0) {
+            replaced.push_back('.');
+        }
+        replaced.append(names[i]);
+        value = value->is_object() ? value->get(names[i]) : nullptr;
+    }
+    return replaced;
+}
+
+// Keeps the output of a template rendered with a copy of some data, split
+// in segments, and renders again only the segments whose dependencies
+// include the parts of the data that were changed with set() or remove().
+// There is one segment per top-level component, and a section whose value
+// is an object is split further, one segment per component of its body,
+// for as long as its value is not replaced. Paths name object members
+// separated by dots, like tags do; list items cannot be addressed, set the
+// whole list instead. Segments with partials or reading {{.}} at the top
+// level are rendered on every change, and lambdas are only called again
+// when a path they are found at changes.
+template <typename string_type>
+class basic_incremental_render {
+public:
+    using size_type = typename string_type::size_type;
+
+    // Replaces length characters at offset of the previous output
+    class edit {
+    public:
+        size_type offset;
+        size_type length;
+        string_type text;
+    };
+
+    basic_incremental_render(const basic_mustache<string_type>& tmpl, const basic_data<string_type>& data)
+        : tmpl_(tmpl)
+        , data_(data)
+    {
+        if (!tmpl_.is_valid()) {
+            return;
+        }
+        const basic_dependencies<string_type> scope;
+        for (const auto& child : tmpl_.root_component_.children) {
+            segments_.push_back(make_segment(child, scope));
+        }
+        update();
+    }
+
+    bool is_valid() const {
+        return tmpl_.is_valid();
+    }
+
+    const string_type& error_message() const {
+        return tmpl_.error_message();
+    }
+
+    const string_type& output() const {
+        return output_;
+    }
+
+    const basic_data<string_type>& data() const {
+        return data_;
+    }
+
+    // Number of top-level segments
+    std::size_t segment_count() const {
+        return segments_.size();
+    }
+
+    // Paths of the data read by a top-level segment
+    const basic_dependencies<string_type>& segment_dependencies(std::size_t index) const {
+        return segments_[index].dependencies;
+    }
+
+    // Sets the value at path, creating missing objects on the way. Returns
+    // false when the path goes through a value that is not an object.
+    bool set(const string_type& path, const basic_data<string_type>& value) {
+        const string_type replaced{replaced_data_path(data_, path)};
+        if (!set_data_path(data_, path, value)) {
+            return false;
+        }
+        changed(segments_, replaced);
+        return true;
+    }
+
+    // Removes the value at path. Returns false when there is none.
+    bool remove(const string_type& path) {
+        const std::vector<string_type> names{split(path, '.')};
+        if (names.empty()) {
+            return false;
+        }
+        basic_data<string_type>* parent = &data_;
+        for (std::size_t i = 0; i + 1 < names.size(); ++i) {
+            if (!parent->get(names[i])) {
+                return false;
+            }
+            parent = &(*parent)[names[i]];
+        }
+        if (!parent->get(names.back())) {
+            return false;
+        }
+        parent->erase(names.back());
+        changed(segments_, path);
+        return true;
+    }
+
+    // Renders the segments affected by the changes since the last update,
+    // and the following ones as long as they start on a different line
+    // state. Returns the edits to the previous output, in increasing offset
+    // order.
+    std::vector<edit> update() {
+        std::vector<edit> edits;
+        if (!tmpl_.is_valid()) {
+            return edits;
+        }
+        context<string_type> ctx{&data_};
+        context_internal<string_type> context{ctx};
+        tmpl_.push_constants(context);
+        size_type offset = 0;
+        for (std::size_t index = 0; index < segments_.size(); ++index) {
+            if (!update_segment(segments_[index], tmpl_.root_component_, index, context, offset, edits)) {
+                return edits;
+            }
+        }
+        tmpl_.end_render(context);
+        string_type tail;
+        tmpl_.render_current_line([&tail](const string_type& str) {
+            tail.append(str);
+        }, context, nullptr);
+        if (tail != tail_) {
+            edits.push_back({offset, tail_.size(), tail});
+            tail_.swap(tail);
+        }
+        for (auto it = edits.rbegin(); it != edits.rend(); ++it) {
+            output_.replace(it->offset, it->length, it->text);
+        }
+        return edits;
+    }
+
+private:
+    class segment {
+    public:
+        // paths read by the component, and by the tag of a section alone
+        basic_dependencies<string_type> dependencies;
+        basic_dependencies<string_type> section;
+        bool dirty = false;
+        // set when a segment of the body of a split section is dirty
+        bool body_dirty = false;
+        // whether the segment is a section rendered as the segments of its
+        // body, in children
+        bool split = false;
+        std::vector<segment> children;
+        // output of a segment that is not split
+        string_type output;
+        size_type size = 0;
+        line_buffer_state<string_type> line_buffer;
+        delimiter_set<string_type> delim_set;
+        line_buffer_state<string_type> end_line_buffer;
+        delimiter_set<string_type> end_delim_set;
+    };
+
+    // scope holds the sections comp is in
+    static segment make_segment(const component<string_type>& comp, const basic_dependencies<string_type>& scope) {
+        segment seg;
+        seg.dependencies = scope;
+        seg.dependencies.add(comp);
+        if (comp.tag.type == tag_type::section_begin) {
+            seg.section = scope;
+            seg.section.enter(comp);
+        }
+        seg.dirty = true;
+        return seg;
+    }
+
+    // Marks the segments affected by a change at path. A split section is
+    // only rendered in full when its value is replaced. Returns whether any
+    // segment was marked.
+    static bool changed(std::vector<segment>& segments, const string_type& path) {
+        bool marked = false;
+        for (auto& seg : segments) {
+            if (seg.dirty || !seg.dependencies.depends_on(path)) {
+                continue;
+            }
+            if (!seg.split || seg.section.replaces(path)) {
+                seg.dirty = true;
+                marked = true;
+            } else if (changed(seg.children, path)) {
+                seg.body_dirty = true;
+                marked = true;
+            }
+        }
+        return marked;
+    }
+
+    // The value of a section that is rendered as the segments of its body
+    static const basic_data<string_type>* split_value(const component<string_type>& comp, context_internal<string_type>& ctx) {
+        if (comp.tag.type != tag_type::section_begin) {
+            return nullptr;
+        }
+        const basic_data<string_type>* value = ctx.ctx.get(comp.tag.name);
+        return value && value->is_object() ? value : nullptr;
+    }
+
+    // Renders the component at index of body unless its segment is
+    // unaffected and starts on the same line state. offset is the position
+    // of the segment in the previous output.
+    bool update_segment(segment& seg, component<string_type>& body, std::size_t index, context_internal<string_type>& ctx, size_type& offset, std::vector<edit>& edits) {
+        if (!seg.dirty && !seg.body_dirty && same_state(seg, ctx)) {
+            ctx.line_buffer = seg.end_line_buffer;
+            ctx.delim_set = seg.end_delim_set;
+            offset += seg.size;
+            return true;
+        }
+        component<string_type>& comp = body.children[index];
+        const basic_data<string_type>* value = seg.split && !seg.dirty ? split_value(comp, ctx) : nullptr;
+        if (!value) {
+            string_type previous;
+            append_output(seg, previous);
+            string_type output;
+            const bool rendered = render_segment(seg, body, index, ctx, output);
+            if (output != previous) {
+                edits.push_back({offset, previous.size(), std::move(output)});
+            }
+            offset += previous.size();
+            return rendered;
+        }
+        seg.line_buffer = ctx.line_buffer;
+        seg.delim_set = ctx.delim_set;
+        component<string_type>* const section_body = tmpl_.section_body(comp);
+        if (!section_body || !enter_section(ctx, value)) {
+            return false;
+        }
+        seg.size = 0;
+        for (std::size_t i = 0; i < seg.children.size(); ++i) {
+            if (!update_segment(seg.children[i], *section_body, i, ctx, offset, edits)) {
+                return false;
+            }
+            seg.size += seg.children[i].size;
+        }
+        leave_section(ctx);
+        seg.end_line_buffer = ctx.line_buffer;
+        seg.end_delim_set = ctx.delim_set;
+        seg.body_dirty = false;
+        return true;
+    }
+
+    // Renders the component at index of body in full, appending its output
+    // to out
+    bool render_segment(segment& seg, component<string_type>& body, std::size_t index, context_internal<string_type>& ctx, string_type& out) {
+        seg.line_buffer = ctx.line_buffer;
+        seg.delim_set = ctx.delim_set;
+        seg.dirty = false;
+        seg.body_dirty = false;
+        component<string_type>& comp = body.children[index];
+        const basic_data<string_type>* value = split_value(comp, ctx);
+        seg.split = value != nullptr;
+        seg.output.clear();
+        seg.size = 0;
+        if (!seg.split) {
+            seg.children.clear();
+            string_type& output = seg.output;
+            const bool rendered = tmpl_.render_body([&output](const string_type& str) {
+                output.append(str);
+            }, ctx, body, index, index + 1);
+            out.append(output);
+            seg.size = output.size();
+            seg.end_line_buffer = ctx.line_buffer;
+            seg.end_delim_set = ctx.delim_set;
+            return rendered;
+        }
+        component<string_type>* const section_body = tmpl_.section_body(comp);
+        if (!section_body) {
+            return false;
+        }
+        if (seg.children.size() != section_body->children.size()) {
+            basic_dependencies<string_type> scope{seg.section};
+            scope.paths.clear();
+            seg.children.clear();
+            for (const auto& child : section_body->children) {
+                seg.children.push_back(make_segment(child, scope));
+            }
+        }
+        if (!enter_section(ctx, value)) {
+            return false;
+        }
+        for (std::size_t i = 0; i < seg.children.size(); ++i) {
+            if (!render_segment(seg.children[i], *section_body, i, ctx, out)) {
+                return false;
+            }
+            seg.size += seg.children[i].size;
+        }
+        leave_section(ctx);
+        seg.end_line_buffer = ctx.line_buffer;
+        seg.end_delim_set = ctx.delim_set;
+        return true;
+    }
+
+    // As push_section() and pop_frame() do for a section value
+    bool enter_section(context_internal<string_type>& ctx, const basic_data<string_type>* value) {
+        // account for the section begin tag
+        ctx.line_buffer.contained_section_tag = true;
+        if (!tmpl_.enter_render_depth(ctx)) {
+            return false;
+        }
+        ctx.ctx.push(value);
+        return true;
+    }
+
+    static void leave_section(context_internal<string_type>& ctx) {
+        ctx.ctx.pop();
+        --ctx.render_depth;
+        // account for the section end tag
+        ctx.line_buffer.contained_section_tag = true;
+    }
+
+    static void append_output(const segment& seg, string_type& out) {
+        if (!seg.split) {
+            out.append(seg.output);
+            return;
+        }
+        for (const auto& child : seg.children) {
+            append_output(child, out);
+        }
+    }
+
+    static bool same_state(const segment& seg, const context_internal<string_type>& ctx) {
+        return seg.line_buffer.same_state(ctx.line_buffer) &&
+            seg.delim_set.begin == ctx.delim_set.begin &&
+            seg.delim_set.end == ctx.delim_set.end;
+    }
+
+    basic_mustache<string_type> tmpl_;
+    basic_data<string_type> data_;
+    std::vector<segment> segments_;
+    string_type tail_;
+    string_type output_;
+};
+
+#if defined(KAINJOW_MUSTACHE_THREADS)
+// Renders a template with some of its data given as futures, so the
+// latencies of several slow backends overlap with each other and with the
+// render. Like basic_incremental_render, the template is split in one part
+// per top-level component, and a section whose value is an object that no
+// pending value replaces is split in one part per component of its body.
+// Parts that do not read a pending value are rendered as soon as poll() is
+// called and kept, and output is passed on strictly in order as the parts
+// before them complete. A part rendered ahead of a pending one assumes it
+// starts on a new line, and is rendered again if it did not. Values read by
+// lambdas when they are called are not known, so they should not be
+// pending.
+template <typename string_type>
+class basic_async_render {
+public:
+    using future_type = std::shared_future<basic_data<string_type>>;
+    using render_handler = typename basic_mustache<string_type>::render_handler;
+
+    basic_async_render(const basic_mustache<string_type>& tmpl, const basic_data<string_type>& data)
+        : tmpl_(tmpl)
+        , data_(data)
+    {
+        if (!tmpl_.is_valid()) {
+            finished_ = true;
+            return;
+        }
+        const basic_dependencies<string_type> scope;
+        for (std::size_t index = 0; index < tmpl_.root_component_.children.size(); ++index) {
+            parts_.push_back(make_part(tmpl_.root_component_.children[index], {index}, scope));
+        }
+    }
+
+    bool is_valid() const {
+        return tmpl_.is_valid();
+    }
+
+    const string_type& error_message() const {
+        return tmpl_.error_message();
+    }
+
+    // Sets the value at path, like basic_incremental_render::set(), to the
+    // result of future once it is ready. Returns false when the path is
+    // empty.
+    bool set_future(const string_type& path, const future_type& future) {
+        if (path.empty()) {
+            return false;
+        }
+        futures_.push_back({path, future});
+        return true;
+    }
+
+    // Number of futures that are not ready yet
+    std::size_t pending() const {
+        return futures_.size();
+    }
+
+    // Whether all output has been passed on
+    bool done() const {
+        return finished_;
+    }
+
+    // Stores the results of the futures that are ready, renders the parts
+    // that do not read pending values, and passes the output that is
+    // complete to handler. Does not block. Returns done().
+    bool poll(const render_handler& handler) {
+        if (finished_) {
+            return true;
+        }
+        resolve_ready();
+        line_buffer_state<string_type> line_buffer{line_buffer_};
+        delimiter_set<string_type> delim_set{delim_set_};
+        bool in_order = true;
+        for (std::size_t index = next_; index < parts_.size(); ++index) {
+            if (!expand(index)) {
+                finished_ = true;
+                return true;
+            }
+            part& p = parts_[index];
+            if (blocked(p)) {
+                // assume the next part starts on a new line
+                in_order = false;
+                line_buffer = line_buffer_state<string_type>{};
+                continue;
+            }
+            if (!p.rendered || !same_state(p, line_buffer, delim_set)) {
+                if (!render_part(index, line_buffer, delim_set)) {
+                    finished_ = true;
+                    return true;
+                }
+            }
+            line_buffer = p.end_line_buffer;
+            delim_set = p.end_delim_set;
+            if (in_order) {
+                if (!p.output.empty()) {
+                    handler(p.output);
+                }
+                string_type().swap(p.output);
+                line_buffer_ = line_buffer;
+                delim_set_ = delim_set;
+                ++next_;
+            }
+        }
+        if (next_ == parts_.size()) {
+            context<string_type> ctx{&data_};
+            context_internal<string_type> context{ctx};
+            context.line_buffer = line_buffer_;
+            tmpl_.render_current_line(handler, context, nullptr);
+            finished_ = true;
+        }
+        return finished_;
+    }
+
+    // Polls until done, waiting for the futures that hold back the output
+    void wait(const render_handler& handler) {
+        while (!poll(handler)) {
+            const future_type* first = first_blocking();
+            if (!first) {
+                break;
+            }
+            first->wait();
+        }
+    }
+
+private:
+    class part {
+    public:
+        // indices of the component from the template root, through the
+        // bodies of the sections it is in
+        std::vector<std::size_t> path;
+        // paths read by the component, and by the tag of a section alone
+        basic_dependencies<string_type> dependencies;
+        basic_dependencies<string_type> section;
+        bool is_section = false;
+        // stands for the begin or end tag of a section split in parts
+        bool tag_only = false;
+        bool rendered = false;
+        string_type output;
+        line_buffer_state<string_type> line_buffer;
+        delimiter_set<string_type> delim_set;
+        line_buffer_state<string_type> end_line_buffer;
+        delimiter_set<string_type> end_delim_set;
+    };
+
+    class pending_value {
+    public:
+        string_type path;
+        future_type future;
+    };
+
+    void resolve_ready() {
+        for (auto it = futures_.begin(); it != futures_.end();) {
+            if (it->future.wait_for(std::chrono::seconds(0)) == std::future_status::ready) {
+                set_data_path(data_, it->path, it->future.get());
+                it = futures_.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    bool blocked(const part& p) const {
+        for (const auto& value : futures_) {
+            if (p.dependencies.depends_on(value.path)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // The pending future read by the first part that is not output yet
+    const future_type* first_blocking() const {
+        for (std::size_t index = next_; index < parts_.size(); ++index) {
+            for (const auto& value : futures_) {
+                if (parts_[index].dependencies.depends_on(value.path)) {
+                    return &value.future;
+                }
+            }
+        }
+        return futures_.empty() ? nullptr : &futures_.front().future;
+    }
+
+    static bool same_state(const part& p, const line_buffer_state<string_type>& line_buffer, const delimiter_set<string_type>& delim_set) {
+        return p.line_buffer.same_state(line_buffer) &&
+            p.delim_set.begin == delim_set.begin &&
+            p.delim_set.end == delim_set.end;
+    }
+
+    // scope holds the sections comp is in
+    static part make_part(const component<string_type>& comp, const std::vector<std::size_t>& path, const basic_dependencies<string_type>& scope) {
+        part p;
+        p.path = path;
+        p.dependencies = scope;
+        p.dependencies.add(comp);
+        if (comp.tag.type == tag_type::section_begin) {
+            p.is_section = true;
+            p.section = scope;
+            p.section.enter(comp);
+        }
+        return p;
+    }
+
+    // Pushes the values of the first count sections of path to ctx, and
+    // returns the body of the last one, or the template root when count is
+    // 0. Returns nullptr when a value is not an object.
+    component<string_type>* enter_sections(const std::vector<std::size_t>& path, std::size_t count, context_internal<string_type>& ctx) {
+        tmpl_.push_constants(ctx);
+        component<string_type>* body = &tmpl_.root_component_;
+        for (std::size_t i = 0; i < count; ++i) {
+            component<string_type>& section = body->children[path[i]];
+            const basic_data<string_type>* value = ctx.ctx.get(section.tag.name);
+            if (!value || !value->is_object() || !tmpl_.enter_render_depth(ctx)) {
+                return nullptr;
+            }
+            ctx.ctx.push(value);
+            body = section.lazy ? &section.lazy->body() : &section;
+        }
+        return body;
+    }
+
+    // Splits the part at index when it is a section that is not rendered
+    // yet, whose value is an object that no pending value replaces: its
+    // begin tag, the components of its body and its end tag take its place.
+    // Returns false when rendering failed.
+    bool expand(std::size_t index) {
+        const part& p = parts_[index];
+        if (!p.is_section || p.rendered) {
+            return true;
+        }
+        for (const auto& value : futures_) {
+            if (p.section.replaces(replaced_data_path(data_, value.path))) {
+                return true;
+            }
+        }
+        context<string_type> ctx{&data_};
+        context_internal<string_type> context{ctx};
+        component<string_type>* body = enter_sections(p.path, p.path.size() - 1, context);
+        if (!body) {
+            return false;
+        }
+        component<string_type>& comp = body->children[p.path.back()];
+        const basic_data<string_type>* value = context.ctx.get(comp.tag.name);
+        // a lazy body that does not parse fails when the section is rendered
+        if (!value || !value->is_object() || (comp.lazy && !comp.lazy->error_message().empty())) {
+            return true;
+        }
+        component<string_type>& section_body = comp.lazy ? comp.lazy->body() : comp;
+        basic_dependencies<string_type> scope{p.section};
+        scope.paths.clear();
+        std::vector<part> parts;
+        parts.emplace_back();
+        parts.back().tag_only = true;
+        std::vector<std::size_t> path{p.path};
+        path.push_back(0);
+        for (std::size_t i = 0; i < section_body.children.size(); ++i) {
+            path.back() = i;
+            parts.push_back(make_part(section_body.children[i], path, scope));
+        }
+        parts.emplace_back();
+        parts.back().tag_only = true;
+        parts_.erase(parts_.begin() + static_cast<std::ptrdiff_t>(index));
+        parts_.insert(parts_.begin() + static_cast<std::ptrdiff_t>(index), std::make_move_iterator(parts.begin()), std::make_move_iterator(parts.end()));
+        return true;
+    }
+
+    bool render_part(std::size_t index, const line_buffer_state<string_type>& line_buffer, const delimiter_set<string_type>& delim_set) {
+        part& p = parts_[index];
+        p.line_buffer = line_buffer;
+        p.delim_set = delim_set;
+        p.output.clear();
+        p.rendered = true;
+        if (p.tag_only) {
+            p.end_line_buffer = line_buffer;
+            p.end_line_buffer.contained_section_tag = true;
+            p.end_delim_set = delim_set;
+            return true;
+        }
+        context<string_type> ctx{&data_};
+        context_internal<string_type> context{ctx};
+        context.line_buffer = line_buffer;
+        context.delim_set = delim_set;
+        component<string_type>* body = enter_sections(p.path, p.path.size() - 1, context);
+        if (!body) {
+            return false;
+        }
+        string_type* output = &p.output;
+        tmpl_.render_body([output](const string_type& str) {
+            output->append(str);
+        }, context, *body, p.path.back(), p.path.back() + 1);
+        p.end_line_buffer = context.line_buffer;
+        p.end_delim_set = context.delim_set;
+        return tmpl_.is_valid();
+    }
+
+    basic_mustache<string_type> tmpl_;
+    basic_data<string_type> data_;
+    std::vector<part> parts_;
+    std::list<pending_value> futures_;
+    // state after the parts that were output
+    std::size_t next_ = 0;
+    line_buffer_state<string_type> line_buffer_;
+    delimiter_set<string_type> delim_set_;
+    bool finished_ = false;
+};
+#endif // KAINJOW_MUSTACHE_THREADS
+
+// Renders a template a piece at a time, so output can be pulled as fast as
+// it is consumed. Each next_chunk() call continues where the previous one
+// stopped, keeping the render stack, list positions and the current line.
+// Only the output of the last step is kept between calls: the start of a
+// line is passed on as soon as it is not blank, so a long line is not
+// collected whole. The template and the data must outlive the renderer.
+template <typename string_type>
+class basic_chunked_render {
+public:
+    using value_type = typename string_type::value_type;
+    using size_type = typename string_type::size_type;
+
+    basic_chunked_render(basic_mustache<string_type>& tmpl, const basic_data<string_type>& data)
+        : tmpl_(tmpl)
+        , ctx_(&data)
+        , context_(ctx_)
+        , handler_([this](const string_type& str) {
+            if (stack_.caching) {
+                stack_.capture(str);
+            }
+            pending_.append(str);
+        })
+    {
+        if (tmpl_.is_valid()) {
+            context_.stream_lines = true;
+            tmpl_.begin_render(context_, stack_, 0, tmpl_.root_component_.children.size());
+        } else {
+            finished_ = true;
+        }
+    }
+
+    basic_chunked_render(const basic_chunked_render&) = delete;
+    basic_chunked_render& operator= (const basic_chunked_render&) = delete;
+
+    bool is_valid() const {
+        return tmpl_.is_valid();
+    }
+
+    const string_type& error_message() const {
+        return tmpl_.error_message();
+    }
+
+    // Whether all output has been returned
+    bool done() const {
+        return finished_ && pending_pos_ == pending_.size();
+    }
+
+    // Copies up to capacity characters of output to buffer and returns how
+    // many were copied, which is less than capacity only at the end.
+    size_type next_chunk(value_type* buffer, size_type capacity) {
+        size_type written = 0;
+        while (written < capacity) {
+            if (pending_pos_ == pending_.size()) {
+                if (finished_) {
+                    break;
+                }
+                pending_.clear();
+                pending_pos_ = 0;
+                step();
+                continue;
+            }
+            const size_type count = std::min(capacity - written, pending_.size() - pending_pos_);
+            std::copy(pending_.begin() + static_cast<std::ptrdiff_t>(pending_pos_), pending_.begin() + static_cast<std::ptrdiff_t>(pending_pos_ + count), buffer + written);
+            pending_pos_ += count;
+            written += count;
+        }
+        return written;
+    }
+
+    // Returns the next piece of output, empty at the end
+    string_type next_chunk() {
+        while (pending_pos_ == pending_.size() && !finished_) {
+            pending_.clear();
+            pending_pos_ = 0;
+            step();
+        }
+        string_type chunk{pending_, pending_pos_};
+        pending_pos_ = pending_.size();
+        return chunk;
+    }
+
+private:
+    using render_stack = typename basic_mustache<string_type>::render_stack;
+
+    void step() {
+        if (!tmpl_.render_step(handler_, context_, stack_)) {
+            tmpl_.end_render(context_);
+            tmpl_.render_current_line(handler_, context_, nullptr);
+            finished_ = true;
+        }
+    }
+
+    basic_mustache<string_type>& tmpl_;
+    context<string_type> ctx_;
+    context_internal<string_type> context_;
+    render_stack stack_;
+    typename basic_mustache<string_type>::render_handler handler_;
+    string_type pending_;
+    size_type pending_pos_ = 0;
+    bool finished_ = false;
+};
+
+// Interface used by code generated by mustache-compile. Each call corresponds
+// to one component of the parsed template and reuses the same render steps as
+// basic_mustache, so standalone lines, escaping, lambdas and partials behave
+// identically. Calls returning false mean rendering failed and must stop.
+template <typename string_type>
+class basic_compiled_renderer {
+public:
+    using value_type = typename string_type::value_type;
+    using size_type = typename string_type::size_type;
+
+    void text(const value_type* str, size_type len) {
+        ctx_.line_buffer.data.append(str, len);
+    }
+
+    void newline(const value_type* str, size_type len) {
+        newline_.assign(str, len);
+        tmpl_.render_current_line(handler_, ctx_, &newline_);
+    }
+
+    bool variable(const string_type& name, bool escaped) {
+        const basic_data<string_type>* var = ctx_.ctx.get(name);
+        return var == nullptr || tmpl_.render_variable(handler_, var, ctx_, escaped);
+    }
+
+    template <typename body_type>
+    bool section(const string_type& name, const string_type& section_text, const body_type& body) {
+        return section(name, section_text.data(), section_text.size(), body);
+    }
+
+    template <typename body_type>
+    bool section(const string_type& name, const value_type* section_text, size_type section_text_len, const body_type& body) {
+        const basic_data<string_type>* var = ctx_.ctx.get(name);
+        if (var == nullptr) {
+            return true;
+        }
+        if (var->is_lambda() || var->is_lambda2()) {
+            return tmpl_.render_lambda(handler_, var, ctx_, basic_mustache<string_type>::render_lambda_escape::optional, string_type(section_text, section_text_len), true);
+        }
+        if (!var->is_false() && !var->is_empty_list() && !tmpl_.render_section(ctx_, var, body)) {
+            return false;
+        }
+        return tmpl_.is_valid();
+    }
+
+    template <typename body_type>
+    bool inverted_section(const string_type& name, const body_type& body) {
+        const basic_data<string_type>* var = ctx_.ctx.get(name);
+        if ((var == nullptr || var->is_false() || var->is_empty_list()) && !tmpl_.render_section(ctx_, var, body)) {
+            return false;
+        }
+        return tmpl_.is_valid();
+    }
+
+    bool partial(const string_type& name) {
+        return tmpl_.render_partial(handler_, ctx_, name);
+    }
+
+    // Renders a partial resolved ahead of time, such as a template of the
+    // same bundle. It counts towards max_depth() like any other partial.
+    template <typename body_type>
+    bool resolved_partial(const body_type& body) {
+        if (!tmpl_.enter_render_depth(ctx_)) {
+            return false;
+        }
+        const bool rendered = body();
+        --ctx_.render_depth;
+        return rendered;
+    }
+
+    void set_delimiter(const string_type& begin, const string_type& end) {
+        ctx_.delim_set.begin = begin;
+        ctx_.delim_set.end = end;
+    }
+
+    void set_delimiter(const value_type* begin, size_type begin_len, const value_type* end, size_type end_len) {
+        ctx_.delim_set.begin.assign(begin, begin_len);
+        ctx_.delim_set.end.assign(end, end_len);
+    }
+
+    basic_compiled_renderer(const basic_compiled_renderer&) = delete;
+    basic_compiled_renderer& operator= (const basic_compiled_renderer&) = delete;
+
+private:
+    using render_handler = typename basic_mustache<string_type>::render_handler;
+
+    basic_compiled_renderer(basic_mustache<string_type>& tmpl, const render_handler& handler, context_internal<string_type>& ctx)
+        : tmpl_(tmpl)
+        , handler_(handler)
+        , ctx_(ctx)
+    {}
+
+    basic_mustache<string_type>& tmpl_;
+    const render_handler& handler_;
+    context_internal<string_type>& ctx_;
+    string_type newline_;
+
+    template <typename StringType2>
+    friend class basic_compiled_template;
+};
+
+// A template compiled ahead of time by mustache-compile. Offers the same
+// rendering interface as basic_mustache but never parses the template. It
+// only keeps the body and the render settings. The basic_mustache that
+// renders lambdas and partials lives on the stack for one render.
+template <typename StringType>
+class basic_compiled_template {
+public:
+    using string_type = StringType;
+    using renderer_type = basic_compiled_renderer<string_type>;
+    using body_function = std::function<bool(renderer_type&)>;
+
+    explicit basic_compiled_template(const body_function& body)
+        : body_(body)
+    {}
+
+    bool is_valid() const {
+        return error_message_.empty();
+    }
+
+    const string_type& error_message() const {
+        return error_message_;
+    }
+
+    using escape_handler = typename basic_mustache<string_type>::escape_handler;
+    void set_custom_escape(const escape_handler& escape_fn) {
+        escape_fn_ = nullptr;
+        escape_ = [escape_fn](const string_type& s, string_type& out) {
+            out.append(escape_fn(s));
+        };
+    }
+
+    using escape_append_handler = typename basic_mustache<string_type>::escape_append_handler;
+    void set_custom_escape_append(const escape_append_handler& escape_fn) {
+        escape_fn_ = nullptr;
+        escape_ = escape_fn;
+    }
+
+    using escape_function = typename basic_mustache<string_type>::escape_function;
+    void set_escape(escape_function escape_fn) {
+        escape_fn_ = escape_fn;
+        escape_ = nullptr;
+    }
+
+    // Sections and partials of the compiled body count towards it, see
+    // basic_mustache::set_max_depth()
+    void set_max_depth(std::size_t max_depth) {
+        max_depth_ = max_depth;
+    }
+
+    std::size_t max_depth() const {
+        return max_depth_;
+    }
+
+    template <typename stream_type>
+    stream_type& render(const basic_data<string_type>& data, stream_type& stream) {
+        render(data, [&stream](const string_type& str) {
+            stream << str;
+        });
+        return stream;
+    }
+
+    string_type render(const basic_data<string_type>& data) {
+        std::basic_ostringstream<typename string_type::value_type> ss;
+        return render(data, ss).str();
+    }
+
+    template <typename stream_type>
+    stream_type& render(basic_context<string_type>& ctx, stream_type& stream) {
+        context_internal<string_type> context{ctx};
+        render([&stream](const string_type& str) {
+            stream << str;
+        }, context);
+        return stream;
+    }
+
+    string_type render(basic_context<string_type>& ctx) {
+        std::basic_ostringstream<typename string_type::value_type> ss;
+        return render(ctx, ss).str();
+    }
+
+    using render_handler = typename basic_mustache<string_type>::render_handler;
+    void render(const basic_data<string_type>& data, const render_handler& handler) {
+        if (!is_valid()) {
+            return;
+        }
+        context<string_type> ctx{&data};
+        context_internal<string_type> context{ctx};
+        render(handler, context);
+    }
+
+private:
+    // A template that is not valid and renders nothing
+    basic_compiled_template(const body_function& body, const string_type& error_message)
+        : body_(body)
+        , error_message_(error_message)
+    {}
+
+    void render(const render_handler& handler, context_internal<string_type>& ctx) {
+        basic_mustache<string_type> runtime;
+        runtime.escape_ = escape_;
+        runtime.escape_fn_ = escape_fn_;
+        runtime.max_depth_ = max_depth_;
+        renderer_type renderer{runtime, handler, ctx};
+        body_(renderer);
+        runtime.render_current_line(handler, ctx, nullptr);
+        error_message_ = runtime.error_message_;
+    }
+
+    body_function body_;
+    string_type error_message_;
+    escape_append_handler escape_;
+    escape_function escape_fn_ = html_escape_append<string_type>;
+    std::size_t max_depth_ = 1000;
+
+    template <typename StringType2>
+    friend class basic_bundle;
+};
+
+enum class opcode : std::uint32_t {
+    text,
+    newline,
+    variable,
+    unescaped_variable,
+    section,
+    inverted_section,
+    partial,
+    set_delimiter,
+};
+
+// One step of a flattened template. Strings are [offset, offset + length)
+// ranges of a separate string pool, so a table can live in read-only memory.
+//   text, newline:             offset/length is the literal
+//   variables, partial:        offset/length is the name
+//   sections:                  offset/length is the name, extra_* is the raw
+//                              section text and the body is the instructions
+//                              up to (not including) end
+//   partial:                   extra_offset/extra_length is the range of
+//                              instructions of the resolved template, or
+//                              no_instruction when it is looked up in the data
+//   set_delimiter:             offset/length is the begin delimiter and
+//                              extra_* is the end delimiter
+struct instruction {
+    opcode op;
+    std::uint32_t offset;
+    std::uint32_t length;
+    std::uint32_t extra_offset;
+    std::uint32_t extra_length;
+    std::uint32_t end;
+
+    static const std::uint32_t no_instruction = 0xFFFFFFFF;
+};
+
+// Renders a flattened template through basic_compiled_renderer. Does not own
+// the instructions, the string pool or the names. names, when given, holds
+// one string per instruction with the name of each variable, section and
+// partial, so they are looked up without copying them out of the pool.
+template <typename string_type>
+class basic_instruction_table {
+public:
+    using value_type = typename string_type::value_type;
+
+    basic_instruction_table(const instruction* instructions, std::size_t size, const value_type* strings, const string_type* names = nullptr)
+        : instructions_(instructions)
+        , size_(size)
+        , strings_(strings)
+        , names_(names)
+    {}
+
+    std::size_t size() const {
+        return size_;
+    }
+
+    const instruction& operator[] (std::size_t index) const {
+        return instructions_[index];
+    }
+
+    bool run(basic_compiled_renderer<string_type>& renderer) const {
+        return run(renderer, 0, size_);
+    }
+
+    bool run(basic_compiled_renderer<string_type>& renderer, std::size_t first, std::size_t last) const {
+        for (std::size_t index = first; index < last; ++index) {
+            const instruction& ins = instructions_[index];
+            switch (ins.op) {
+                case opcode::text:
+                    renderer.text(strings_ + ins.offset, ins.length);
+                    break;
+                case opcode::newline:
+                    renderer.newline(strings_ + ins.offset, ins.length);
+                    break;
+                case opcode::variable:
+                case opcode::unescaped_variable: {
+                    string_type scratch;
+                    if (!renderer.variable(name(index, scratch), ins.op == opcode::variable)) {
+                        return false;
+                    }
+                    break;
+                }
+                case opcode::section:
+                case opcode::inverted_section: {
+                    const auto body = [this, &renderer, index, &ins]() {
+                        return run(renderer, index + 1, ins.end);
+                    };
+                    string_type scratch;
+                    const string_type& name = this->name(index, scratch);
+                    const bool ok = ins.op == opcode::section
+                        ? renderer.section(name, strings_ + ins.extra_offset, ins.extra_length, body)
+                        : renderer.inverted_section(name, body);
+                    if (!ok) {
+                        return false;
+                    }
+                    index = ins.end - 1;
+                    break;
+                }
+                case opcode::partial:
+                    if (ins.extra_offset != instruction::no_instruction) {
+                        const bool rendered = renderer.resolved_partial([this, &renderer, &ins]() {
+                            return run(renderer, ins.extra_offset, ins.extra_offset + ins.extra_length);
+                        });
+                        if (!rendered) {
+                            return false;
+                        }
+                    } else {
+                        string_type scratch;
+                        if (!renderer.partial(name(index, scratch))) {
+                            return false;
+                        }
+                    }
+                    break;
+                case opcode::set_delimiter:
+                    renderer.set_delimiter(strings_ + ins.offset, ins.length, strings_ + ins.extra_offset, ins.extra_length);
+                    break;
+            }
+        }
+        return true;
+    }
+
+private:
+    // The name of the index-th instruction, copied into scratch when there
+    // are no precomputed names
+    const string_type& name(std::size_t index, string_type& scratch) const {
+        if (names_) {
+            return names_[index];
+        }
+        scratch.assign(strings_ + instructions_[index].offset, instructions_[index].length);
+        return scratch;
+    }
+
+    const instruction* instructions_;
+    std::size_t size_;
+    const value_type* strings_;
+    const string_type* names_;
+};
+
+// Appends the instructions for the children of comp. Adjacent literal text
+// (including text separated only by comments) becomes a single instruction.
+template <typename string_type>
+void flatten_component(const component<string_type>& comp, std::vector<instruction>& instructions, string_type& strings) {
+    const auto add_string = [&strings](const string_type& str) {
+        const auto offset = static_cast<std::uint32_t>(strings.size());
+        strings.append(str);
+        return offset;
+    };
+    const auto add = [&instructions](opcode op, std::uint32_t offset, std::size_t length, std::uint32_t extra_offset, std::size_t extra_length) {
+        instructions.push_back(instruction{op, offset, static_cast<std::uint32_t>(length), extra_offset, static_cast<std::uint32_t>(extra_length), 0});
+    };
+    bool in_text = false;
+    for (const auto& child : comp.children) {
+        if (child.is_text() && !child.is_newline()) {
+            if (in_text) {
+                strings.append(child.text);
+                instructions.back().length += static_cast<std::uint32_t>(child.text.size());
+            } else {
+                add(opcode::text, add_string(child.text), child.text.size(), 0, 0);
+                in_text = true;
+            }
+            continue;
+        }
+        if (child.tag.type == tag_type::comment) {
+            continue;
+        }
+        in_text = false;
+        if (child.is_newline()) {
+            add(opcode::newline, add_string(child.text), child.text.size(), 0, 0);
+            continue;
+        }
+        const auto& tag = child.tag;
+        switch (tag.type) {
+            case tag_type::variable:
+            case tag_type::unescaped_variable:
+                add(tag.type == tag_type::variable ? opcode::variable : opcode::unescaped_variable, add_string(tag.name), tag.name.size(), 0, 0);
+                break;
+            case tag_type::section_begin:
+            case tag_type::section_begin_inverted: {
+                const std::size_t index = instructions.size();
+                const std::uint32_t name = add_string(tag.name);
+                const std::uint32_t text = tag.section_text ? add_string(*tag.section_text) : 0;
+                add(tag.type == tag_type::section_begin ? opcode::section : opcode::inverted_section, name, tag.name.size(), text, tag.section_text ? tag.section_text->size() : 0);
+                flatten_component(child, instructions, strings);
+                instructions[index].end = static_cast<std::uint32_t>(instructions.size());
+                break;
+            }
+            case tag_type::partial:
+                add(opcode::partial, add_string(tag.name), tag.name.size(), instruction::no_instruction, 0);
+                break;
+            case tag_type::set_delimiter: {
+                const std::uint32_t begin = add_string(tag.delim_set->begin);
+                const std::uint32_t end = add_string(tag.delim_set->end);
+                add(opcode::set_delimiter, begin, tag.delim_set->begin.size(), end, tag.delim_set->end.size());
+                break;
+            }
+            default:
+                break;
+        }
+    }
+}
+
+// Binary template bundle, version 1. All integers are 32-bit little endian.
+//
+//   header        magic "MSTB", version, character size in bytes, template
+//                 count, instruction count, string pool length in
+//                 characters, two reserved words
+//   templates     per template: name offset, name length, first instruction,
+//                 instruction count
+//   instructions  per instruction: the six fields of instruction
+//   strings       the string pool
+//
+// Instruction indices (section ends, resolved partials) are absolute, and a
+// partial naming another template of the bundle refers to its instructions.
+struct bundle_format {
+    static const std::uint32_t version = 1;
+    static const std::size_t header_words = 8;
+    static const std::size_t template_words = 4;
+    static const std::size_t instruction_words = 6;
+};
+
+// Builds a bundle from template sources, for example in a build step.
+template <typename StringType>
+class basic_bundle_writer {
+public:
+    using string_type = StringType;
+
+    // Parses the template. Returns false and sets error_message() if it is
+    // invalid.
+    bool add(const string_type& name, const string_type& input) {
+        component<string_type> root;
+        string_type error;
+        context<string_type> ctx;
+        context_internal<string_type> context{ctx};
+        parser<string_type>{input, context, root, error};
+        if (!error.empty()) {
+            error_message_ = error;
+            return false;
+        }
+        entry e;
+        e.name = name;
+        flatten_component(root, e.instructions, e.strings);
+        entries_.push_back(std::move(e));
+        return true;
+    }
+
+    const string_type& error_message() const {
+        return error_message_;
+    }
+
+    std::string serialize() const {
+        std::vector<std::uint32_t> templates;
+        std::vector<instruction> instructions;
+        string_type strings;
+        for (const auto& e : entries_) {
+            const auto base = static_cast<std::uint32_t>(instructions.size());
+            const auto string_base = static_cast<std::uint32_t>(strings.size());
+            templates.push_back(static_cast<std::uint32_t>(strings.size()));
+            templates.push_back(static_cast<std::uint32_t>(e.name.size()));
+            templates.push_back(base);
+            templates.push_back(static_cast<std::uint32_t>(e.instructions.size()));
+            strings.append(e.name);
+            const auto name_size = static_cast<std::uint32_t>(e.name.size());
+            strings.append(e.strings);
+            for (auto ins : e.instructions) {
+                ins.offset += string_base + name_size;
+                if (ins.op == opcode::partial) {
+                    resolve_partial(e.strings.substr(ins.offset - string_base - name_size, ins.length), ins);
+                } else if (ins.op == opcode::section || ins.op == opcode::inverted_section || ins.op == opcode::set_delimiter) {
+                    ins.extra_offset += string_base + name_size;
+                }
+                if (ins.end != 0) {
+                    ins.end += base;
+                }
+                instructions.push_back(ins);
+            }
+        }
+        std::string out;
+        const auto put = [&out](std::uint32_t value) {
+            for (int shift = 0; shift < 32; shift += 8) {
+                out.push_back(static_cast<char>((value >> shift) & 0xFF));
+            }
+        };
+        out.append("MSTB", 4);
+        put(bundle_format::version);
+        put(sizeof(typename string_type::value_type));
+        put(static_cast<std::uint32_t>(entries_.size()));
+        put(static_cast<std::uint32_t>(instructions.size()));
+        put(static_cast<std::uint32_t>(strings.size()));
+        put(0);
+        put(0);
+        for (const auto value : templates) {
+            put(value);
+        }
+        for (const auto& ins : instructions) {
+            put(static_cast<std::uint32_t>(ins.op));
+            put(ins.offset);
+            put(ins.length);
+            put(ins.extra_offset);
+            put(ins.extra_length);
+            put(ins.end);
+        }
+        for (const auto ch : strings) {
+            const auto value = static_cast<std::uint32_t>(ch);
+            for (std::size_t byte = 0; byte < sizeof(ch); ++byte) {
+                out.push_back(static_cast<char>((value >> (byte * 8)) & 0xFF));
+            }
+        }
+        while (out.size() % 4 != 0) {
+            out.push_back(0);
+        }
+        return out;
+    }
+
+private:
+    struct entry {
+        string_type name;
+        std::vector<instruction> instructions;
+        string_type strings;
+    };
+
+    void resolve_partial(const string_type& name, instruction& ins) const {
+        std::uint32_t base = 0;
+        for (const auto& e : entries_) {
+            if (e.name == name) {
+                ins.extra_offset = base;
+                ins.extra_length = static_cast<std::uint32_t>(e.instructions.size());
+                return;
+            }
+            base += static_cast<std::uint32_t>(e.instructions.size());
+        }
+    }
+
+    std::vector<entry> entries_;
+    string_type error_message_;
+};
+
+// Read-only view of a bundle written by basic_bundle_writer, typically a
+// memory-mapped file. Templates render straight from the mapped tables, so
+// opening a bundle costs the same regardless of how many templates it holds
+// and processes mapping the same file share its pages. The memory must stay
+// valid and 4-byte aligned for the lifetime of the view and of any template
+// obtained from it.
+template <typename StringType>
+class basic_bundle {
+public:
+    using string_type = StringType;
+    using value_type = typename string_type::value_type;
+    using size_type = std::size_t;
+    static const size_type npos = static_cast<size_type>(-1);
+
+    basic_bundle(const void* data, size_type size)
+        : words_(static_cast<const std::uint32_t*>(data))
+    {
+        error_message_ = validate(data, size);
+        if (!error_message_.empty()) {
+            words_ = nullptr;
+        }
+    }
+
+    bool is_valid() const {
+        return error_message_.empty();
+    }
+
+    const string_type& error_message() const {
+        return error_message_;
+    }
+
+    size_type size() const {
+        return words_ ? words_[3] : 0;
+    }
+
+    string_type name(size_type index) const {
+        const std::uint32_t* t = template_words(index);
+        return string_type(strings() + t[0], t[1]);
+    }
+
+    size_type find(const string_type& name) const {
+        for (size_type index = 0; index < size(); ++index) {
+            const std::uint32_t* t = template_words(index);
+            if (name.size() == t[1] && std::equal(name.begin(), name.end(), strings() + t[0])) {
+                return index;
+            }
+        }
+        return npos;
+    }
+
+    // Returns a template rendering the index-th entry of the bundle, or an
+    // invalid template when there is none.
+    basic_compiled_template<string_type> get(size_type index) const {
+        if (index >= size()) {
+            return missing_template(error("No template at this index in the bundle"));
+        }
+        const basic_instruction_table<string_type> table{instructions(), words_[4], strings()};
+        const std::uint32_t first = template_words(index)[2];
+        const std::uint32_t last = first + template_words(index)[3];
+        return basic_compiled_template<string_type>{[table, first, last](basic_compiled_renderer<string_type>& renderer) {
+            return table.run(renderer, first, last);
+        }};
+    }
+
+    basic_compiled_template<string_type> get(const string_type& name) const {
+        const size_type index = find(name);
+        if (index == npos) {
+            return missing_template(error("No template named \"") + name + error("\" in the bundle"));
+        }
+        return get(index);
+    }
+
+private:
+    const std::uint32_t* words_;
+    string_type error_message_;
+
+    const std::uint32_t* template_words(size_type index) const {
+        return words_ + bundle_format::header_words + index * bundle_format::template_words;
+    }
+
+    const instruction* instructions() const {
+        return reinterpret_cast<const instruction*>(template_words(size()));
+    }
+
+    const value_type* strings() const {
+        return reinterpret_cast<const value_type*>(instructions() + words_[4]);
+    }
+
+    static string_type error(const char* message) {
+        const std::string str{message};
+        return string_type(str.begin(), str.end());
+    }
+
+    static basic_compiled_template<string_type> missing_template(const string_type& error_message) {
+        return basic_compiled_template<string_type>{[](basic_compiled_renderer<string_type>&) {
+            return false;
+        }, error_message};
+    }
+
+    string_type validate(const void* data, size_type size) const {
+        static_assert(sizeof(instruction) == bundle_format::instruction_words * 4, "instruction must match the bundle layout");
+        const std::uint32_t one = 1;
+        if (*reinterpret_cast<const unsigned char*>(&one) != 1) {
+            return error("Bundles can only be read on little endian machines");
+        }
+        if (reinterpret_cast<std::uintptr_t>(data) % 4 != 0) {
+            return error("Bundle data is not aligned");
+        }
+        if (size < bundle_format::header_words * 4 || std::string(static_cast<const char*>(data), 4) != "MSTB") {
+            return error("Not a template bundle");
+        }
+        if (words_[1] != bundle_format::version) {
+            return error("Unsupported bundle version");
+        }
+        if (words_[2] != sizeof(value_type)) {
+            return error("Bundle character size does not match the string type");
+        }
+        const std::uint64_t templates = words_[3];
+        const std::uint64_t count = words_[4];
+        const std::uint64_t pool = words_[5];
+        const std::uint64_t expected = bundle_format::header_words * 4 + templates * bundle_format::template_words * 4 +
+            count * bundle_format::instruction_words * 4 + pool * sizeof(value_type);
+        if (size < expected) {
+            return error("Bundle is truncated");
+        }
+        const auto in_pool = [pool](std::uint64_t offset, std::uint64_t length) {
+            return offset + length <= pool;
+        };
+        for (size_type index = 0; index < templates; ++index) {
+            const std::uint32_t* t = template_words(index);
+            if (!in_pool(t[0], t[1]) || static_cast<std::uint64_t>(t[2]) + t[3] > count) {
+                return error("Bundle template table is corrupt");
+            }
+        }
+        const instruction* ins = instructions();
+        for (std::uint64_t index = 0; index < count; ++index) {
+            const instruction& i = ins[index];
+            bool ok = static_cast<std::uint32_t>(i.op) <= static_cast<std::uint32_t>(opcode::set_delimiter) && in_pool(i.offset, i.length);
+            switch (i.op) {
+                case opcode::section:
+                case opcode::inverted_section:
+                    ok = ok && in_pool(i.extra_offset, i.extra_length) && i.end > index && i.end <= count;
+                    break;
+                case opcode::set_delimiter:
+                    ok = ok && in_pool(i.extra_offset, i.extra_length);
+                    break;
+                case opcode::partial:
+                    ok = ok && (i.extra_offset == instruction::no_instruction || static_cast<std::uint64_t>(i.extra_offset) + i.extra_length <= count);
+                    break;
+                default:
+                    break;
+            }
+            if (!ok) {
+                return error("Bundle instruction table is corrupt");
+            }
+        }
+        return {};
+    }
+};
+
+template <typename StringType>
+const typename basic_bundle<StringType>::size_type basic_bundle<StringType>::npos;
+
+// Streaming XXH64 digest of rendered output, for ETags and checksums without
+// keeping the output or hashing it in a second pass. The output is hashed as
+// the bytes of its code units, so the value matches XXH64 of the body for
+// std::string.
+template <typename string_type>
+class basic_output_digest {
+public:
+    using value_type = typename string_type::value_type;
+    using render_handler = typename basic_mustache<string_type>::render_handler;
+
+    explicit basic_output_digest(std::uint64_t seed = 0) : seed_(seed) {
+        reset();
+    }
+
+    void reset() {
+        acc_[0] = seed_ + prime1 + prime2;
+        acc_[1] = seed_ + prime2;
+        acc_[2] = seed_;
+        acc_[3] = seed_ - prime1;
+        size_ = 0;
+        buffered_ = 0;
+    }
+
+    void update(const value_type* data, std::size_t count) {
+        const unsigned char* bytes = reinterpret_cast<const unsigned char*>(data);
+        std::size_t remaining = count * sizeof(value_type);
+        size_ += remaining;
+        if (buffered_ > 0) {
+            const std::size_t fill = std::min(remaining, stripe_size - buffered_);
+            std::memcpy(buffer_ + buffered_, bytes, fill);
+            buffered_ += fill;
+            bytes += fill;
+            remaining -= fill;
+            if (buffered_ < stripe_size) {
+                return;
+            }
+            consume(buffer_);
+            buffered_ = 0;
+        }
+        for (; remaining >= stripe_size; remaining -= stripe_size, bytes += stripe_size) {
+            consume(bytes);
+        }
+        std::memcpy(buffer_, bytes, remaining);
+        buffered_ = remaining;
+    }
+
+    void update(const string_type& str) {
+        update(str.data(), str.size());
+    }
+
+    // Digest of everything added since the last reset()
+    std::uint64_t value() const {
+        std::uint64_t hash;
+        if (size_ >= stripe_size) {
+            hash = rotl(acc_[0], 1) + rotl(acc_[1], 7) + rotl(acc_[2], 12) + rotl(acc_[3], 18);
+            for (const auto acc : acc_) {
+                hash = (hash ^ round(0, acc)) * prime1 + prime4;
+            }
+        } else {
+            hash = seed_ + prime5;
+        }
+        hash += size_;
+        const unsigned char* p = buffer_;
+        const unsigned char* end = buffer_ + buffered_;
+        for (; p + 8 <= end; p += 8) {
+            hash = rotl(hash ^ round(0, read64(p)), 27) * prime1 + prime4;
+        }
+        if (p + 4 <= end) {
+            hash = rotl(hash ^ (read32(p) * prime1), 23) * prime2 + prime3;
+            p += 4;
+        }
+        for (; p < end; ++p) {
+            hash = rotl(hash ^ (*p * prime5), 11) * prime1;
+        }
+        hash ^= hash >> 33;
+        hash *= prime2;
+        hash ^= hash >> 29;
+        hash *= prime3;
+        hash ^= hash >> 32;
+        return hash;
+    }
+
+    // value() as 16 lowercase hexadecimal digits
+    string_type hex() const {
+        const char* digits = "0123456789abcdef";
+        const std::uint64_t hash = value();
+        string_type str;
+        for (int shift = 60; shift >= 0; shift -= 4) {
+            str.push_back(static_cast<value_type>(digits[(hash >> shift) & 0xf]));
+        }
+        return str;
+    }
+
+    // Number of bytes added since the last reset()
+    std::uint64_t size() const {
+        return size_;
+    }
+
+    // Returns a render handler that adds the output to this digest and then
+    // passes it on to next, if set. The digest must outlive the handler.
+    render_handler sink(const render_handler& next = {}) {
+        basic_output_digest* digest = this;
+        if (!next) {
+            return [digest](const string_type& str) {
+                digest->update(str);
+            };
+        }
+        return [digest, next](const string_type& str) {
+            digest->update(str);
+            next(str);
+        };
+    }
+
+private:
+    static const std::uint64_t prime1 = 11400714785074694791ULL;
+    static const std::uint64_t prime2 = 14029467366897019727ULL;
+    static const std::uint64_t prime3 = 1609587929392839161ULL;
+    static const std::uint64_t prime4 = 9650029242287828579ULL;
+    static const std::uint64_t prime5 = 2870177450012600261ULL;
+    static const std::size_t stripe_size = 32;
+
+    std::uint64_t seed_;
+    std::uint64_t acc_[4];
+    std::uint64_t size_;
+    unsigned char buffer_[stripe_size];
+    std::size_t buffered_;
+
+    static std::uint64_t rotl(std::uint64_t x, int r) {
+        return (x << r) | (x >> (64 - r));
+    }
+
+    static std::uint64_t round(std::uint64_t acc, std::uint64_t input) {
+        return rotl(acc + input * prime2, 31) * prime1;
+    }
+
+    // little endian reads, independent of the machine
+    static std::uint64_t read64(const unsigned char* p) {
+        std::uint64_t x = 0;
+        for (int i = 7; i >= 0; --i) {
+            x = (x << 8) | p[i];
+        }
+        return x;
+    }
+
+    static std::uint64_t read32(const unsigned char* p) {
+        std::uint64_t x = 0;
+        for (int i = 3; i >= 0; --i) {
+            x = (x << 8) | p[i];
+        }
+        return x;
+    }
+
+    void consume(const unsigned char* stripe) {
+        for (int i = 0; i < 4; ++i) {
+            acc_[i] = round(acc_[i], read64(stripe + i * 8));
+        }
+    }
+};
+
+// Fixed-size pages for basic_page_buffer, kept for reuse when released.
+// Can be shared by buffers on different threads.
+template <typename string_type>
+class basic_page_pool {
+public:
+    using value_type = typename string_type::value_type;
+    using size_type = typename string_type::size_type;
+    using page_ptr = std::unique_ptr<value_type[]>;
+
+    // page_size is in characters, max_free is the number of released pages
+    // kept for reuse
+    explicit basic_page_pool(size_type page_size = 64 * 1024, size_type max_free = 16)
+        : page_size_(page_size > 0 ? page_size : 1)
+        , max_free_(max_free)
+    {
+    }
+
+    size_type page_size() const {
+        return page_size_;
+    }
+
+    size_type free_pages() const {
+        std::lock_guard<std::mutex> lock{mutex_};
+        return free_.size();
+    }
+
+    page_ptr acquire() {
+        {
+            std::lock_guard<std::mutex> lock{mutex_};
+            if (!free_.empty()) {
+                page_ptr page{std::move(free_.back())};
+                free_.pop_back();
+                return page;
+            }
+        }
+        return page_ptr{new value_type[page_size_]};
+    }
+
+    void release(page_ptr page) {
+        std::lock_guard<std::mutex> lock{mutex_};
+        if (page && free_.size() < max_free_) {
+            free_.push_back(std::move(page));
+        }
+    }
+
+private:
+    const size_type page_size_;
+    const size_type max_free_;
+    mutable std::mutex mutex_;
+    std::vector<page_ptr> free_;
+};
+
+// Output kept in a chain of pages from a basic_page_pool instead of one
+// contiguous string, so it is never reallocated or copied as it grows. With
+// a flush function, full pages are written out and returned to the pool as
+// soon as max_pages of them are filled. Rendered with
+// basic_mustache::render(data, sink()), which passes lines on in pieces,
+// the output then takes the page size and count rather than its own size;
+// a single value is still rendered whole before it is appended.
+template <typename string_type>
+class basic_page_buffer {
+public:
+    using value_type = typename string_type::value_type;
+    using size_type = typename string_type::size_type;
+    using pool_type = basic_page_pool<string_type>;
+    using render_handler = typename basic_mustache<string_type>::render_handler;
+    // Writes size characters, returns false on failure
+    using flush_function = std::function<bool(const value_type* data, size_type size)>;
+
+    class page {
+    public:
+        const value_type* data;
+        size_type size;
+    };
+    using const_iterator = typename std::vector<page>::const_iterator;
+
+    explicit basic_page_buffer(const std::shared_ptr<pool_type>& pool = std::make_shared<pool_type>(), const flush_function& flush = {}, size_type max_pages = 1)
+        : pool_(pool)
+        , flush_(flush)
+        , max_pages_(max_pages > 0 ? max_pages : 1)
+    {
+    }
+
+    basic_page_buffer(const basic_page_buffer&) = delete;
+    basic_page_buffer& operator= (const basic_page_buffer&) = delete;
+
+    ~basic_page_buffer() {
+        clear();
+    }
+
+    void append(const value_type* data, size_type size) {
+        while (size > 0) {
+            if (pages_.empty() || pages_.back().size == pool_->page_size()) {
+                if (flush_ && pages_.size() >= max_pages_) {
+                    flush_pages(pages_.size());
+                }
+                storage_.push_back(pool_->acquire());
+                pages_.push_back({storage_.back().get(), 0});
+            }
+            page& last = pages_.back();
+            const size_type count = std::min(size, pool_->page_size() - last.size);
+            std::copy(data, data + count, storage_.back().get() + last.size);
+            last.size += count;
+            size_ += count;
+            data += count;
+            size -= count;
+        }
+    }
+
+    void append(const string_type& str) {
+        append(str.data(), str.size());
+    }
+
+    // Returns a render handler that appends to this buffer, which must
+    // outlive the handler
+    render_handler sink() {
+        basic_page_buffer* buffer = this;
+        return [buffer](const string_type& str) {
+            buffer->append(str);
+        };
+    }
+
+    // Writes out and releases all pages, including the last partial one
+    bool flush() {
+        if (flush_) {
+            flush_pages(pages_.size());
+        }
+        return !failed_;
+    }
+
+    // Whether the flush function failed, output is discarded after that
+    bool failed() const {
+        return failed_;
+    }
+
+    // Pages not flushed yet
+    const_iterator begin() const {
+        return pages_.begin();
+    }
+
+    const_iterator end() const {
+        return pages_.end();
+    }
+
+    size_type page_count() const {
+        return pages_.size();
+    }
+
+    // Size of everything appended since the last clear(), flushed or not
+    size_type size() const {
+        return size_;
+    }
+
+    string_type str() const {
+        string_type str;
+        size_type size = 0;
+        for (const auto& p : pages_) {
+            size += p.size;
+        }
+        str.reserve(size);
+        for (const auto& p : pages_) {
+            str.append(p.data, p.size);
+        }
+        return str;
+    }
+
+    // Releases all pages without flushing them
+    void clear() {
+        release_pages(pages_.size());
+        size_ = 0;
+        failed_ = false;
+    }
+
+private:
+    std::shared_ptr<pool_type> pool_;
+    flush_function flush_;
+    size_type max_pages_;
+    std::vector<typename pool_type::page_ptr> storage_;
+    std::vector<page> pages_;
+    size_type size_ = 0;
+    bool failed_ = false;
+
+    void flush_pages(size_type count) {
+        for (size_type i = 0; i < count && !failed_; ++i) {
+            if (pages_[i].size > 0 && !flush_(pages_[i].data, pages_[i].size)) {
+                failed_ = true;
+            }
+        }
+        release_pages(count);
+    }
+
+    void release_pages(size_type count) {
+        for (size_type i = 0; i < count; ++i) {
+            pool_->release(std::move(storage_[i]));
+        }
+        storage_.erase(storage_.begin(), storage_.begin() + static_cast<std::ptrdiff_t>(count));
+        pages_.erase(pages_.begin(), pages_.begin() + static_cast<std::ptrdiff_t>(count));
+    }
+};
+
+#if defined(KAINJOW_MUSTACHE_POSIX)
+
+// Writes output to a file descriptor through a large buffer, so a render
+// takes a few write() calls instead of one per line. Pieces that do not fit
+// in the buffer are written together with it by a single writev(). Output is
+// written as the bytes of its code units. The descriptor is not closed.
+template <typename string_type>
+class basic_fd_sink {
+public:
+    using value_type = typename string_type::value_type;
+    using size_type = typename string_type::size_type;
+    using render_handler = typename basic_mustache<string_type>::render_handler;
+
+    explicit basic_fd_sink(int fd, std::size_t buffer_size = 1024 * 1024)
+        : fd_(fd)
+        , buffer_size_(buffer_size > 0 ? buffer_size : 1)
+    {
+    }
+
+    basic_fd_sink(const basic_fd_sink&) = delete;
+    basic_fd_sink& operator= (const basic_fd_sink&) = delete;
+
+    ~basic_fd_sink() {
+        finish();
+    }
+
+    // Only writes whole multiples of alignment from a buffer aligned to it,
+    // as O_DIRECT requires, until finish() writes the rest. If fd was opened
+    // with O_DIRECT, it is cleared for that last write. Must be set before
+    // writing.
+    void set_direct(bool direct, std::size_t alignment = 4096) {
+        assert(!buffer_);
+        direct_ = direct;
+        alignment_ = alignment > 0 ? alignment : 1;
+    }
+
+    // Whether finish() calls fsync()
+    void set_sync(bool sync) {
+        sync_ = sync;
+    }
+
+    // Output written after finish() is written by the next finish(), or
+    // when the sink is destroyed.
+    void write(const value_type* data, size_type count) {
+        const unsigned char* bytes = reinterpret_cast<const unsigned char*>(data);
+        std::size_t size = count * sizeof(value_type);
+        if (failed_ || size == 0) {
+            return;
+        }
+        finished_ = false;
+        allocate();
+        if (!direct_ && size > capacity_ - used_) {
+            write_vector(buffer_, used_, bytes, size);
+            used_ = 0;
+            return;
+        }
+        while (size > 0) {
+            const std::size_t n = std::min(size, capacity_ - used_);
+            std::memcpy(buffer_ + used_, bytes, n);
+            used_ += n;
+            bytes += n;
+            size -= n;
+            if (used_ == capacity_) {
+                write_fully(buffer_, used_);
+                used_ = 0;
+            }
+        }
+    }
+
+    void write(const string_type& str) {
+        write(str.data(), str.size());
+    }
+
+    // Returns a render handler that writes to this sink, which must outlive
+    // the handler
+    render_handler sink() {
+        basic_fd_sink* sink = this;
+        return [sink](const string_type& str) {
+            sink->write(str);
+        };
     }
 
-    string_type render(context_internal<string_type>& ctx) {
-        std::basic_ostringstream<typename string_type::value_type> ss;
-        render([&ss](const string_type& str) {
-            ss << str;
-        }, ctx);
-        return ss.str();
+    // Writes everything buffered, and syncs if set_sync() was set. Returns
+    // false if any write failed, see error().
+    bool finish() {
+        if (finished_) {
+            return !failed_;
+        }
+        finished_ = true;
+        if (!failed_ && used_ > 0) {
+            std::size_t aligned = direct_ ? used_ - used_ % alignment_ : used_;
+            write_fully(buffer_, aligned);
+#if defined(O_DIRECT)
+            if (direct_ && !failed_ && aligned < used_) {
+                const int flags = ::fcntl(fd_, F_GETFL);
+                if (flags != -1 && (flags & O_DIRECT) != 0) {
+                    ::fcntl(fd_, F_SETFL, flags & ~O_DIRECT);
+                }
+            }
+#endif
+            write_fully(buffer_ + aligned, used_ - aligned);
+            used_ = 0;
+        }
+        if (!failed_ && sync_ && ::fsync(fd_) != 0) {
+            fail(errno);
+        }
+        return !failed_;
     }
 
-    void render(const render_handler& handler, context_internal<string_type>& ctx, bool root_renderer = true) {
-        root_component_.walk_children([&handler, &ctx, this](component<string_type>& comp) -> typename component<string_type>::walk_control {
-            return render_component(handler, ctx, comp);
-        });
-        // process the last line, but only for the top-level renderer
-        if (root_renderer) {
-            render_current_line(handler, ctx, nullptr);
-        }
+    bool failed() const {
+        return failed_;
     }
 
-    void render_current_line(const render_handler& handler, context_internal<string_type>& ctx, const component<string_type>* comp) const {
-        // We're at the end of a line, so check the line buffer state to see
-        // if the line had tags in it, and also if the line is now empty or
-        // contains whitespace only. if this situation is true, skip the line.
-        bool output = true;
-        if (ctx.line_buffer.contained_section_tag && ctx.line_buffer.is_empty_or_contains_only_whitespace()) {
-            output = false;
+    // errno of the first failed call, or EIO for a write that wrote nothing
+    int error() const {
+        return error_;
+    }
+
+    // Bytes written to the descriptor so far
+    std::uint64_t written() const {
+        return written_;
+    }
+
+    // Number of write() and writev() calls so far
+    std::size_t writes() const {
+        return writes_;
+    }
+
+private:
+    int fd_;
+    std::size_t buffer_size_;
+    bool direct_ = false;
+    std::size_t alignment_ = 4096;
+    bool sync_ = false;
+    std::unique_ptr<unsigned char[]> storage_;
+    unsigned char* buffer_ = nullptr;
+    std::size_t capacity_ = 0;
+    std::size_t used_ = 0;
+    bool failed_ = false;
+    bool finished_ = false;
+    int error_ = 0;
+    std::uint64_t written_ = 0;
+    std::size_t writes_ = 0;
+
+    void allocate() {
+        if (buffer_) {
+            return;
         }
-        if (output) {
-            handler(ctx.line_buffer.data);
-            if (comp) {
-                handler(comp->text);
-            }
+        if (!direct_) {
+            capacity_ = buffer_size_;
+            storage_.reset(new unsigned char[capacity_]);
+            buffer_ = storage_.get();
+            return;
         }
-        ctx.line_buffer.clear();
+        capacity_ = (buffer_size_ + alignment_ - 1) / alignment_ * alignment_;
+        storage_.reset(new unsigned char[capacity_ + alignment_]);
+        const std::uintptr_t address = reinterpret_cast<std::uintptr_t>(storage_.get());
+        buffer_ = storage_.get() + (alignment_ - address % alignment_) % alignment_;
     }
 
-    void render_result(context_internal<string_type>& ctx, const string_type& text) const {
-        ctx.line_buffer.data.append(text);
+    void fail(int error) {
+        failed_ = true;
+        error_ = error;
     }
 
-    typename component<string_type>::walk_control render_component(const render_handler& handler, context_internal<string_type>& ctx, component<string_type>& comp) {
-        if (comp.is_text()) {
-            if (comp.is_newline()) {
-                render_current_line(handler, ctx, &comp);
-            } else {
-                render_result(ctx, comp.text);
+    void write_fully(const unsigned char* data, std::size_t size) {
+        while (size > 0 && !failed_) {
+            const ssize_t n = ::write(fd_, data, size);
+            if (n < 0) {
+                if (errno != EINTR) {
+                    fail(errno);
+                }
+                continue;
             }
-            return component<string_type>::walk_control::walk;
+            if (n == 0) {
+                // no progress, retrying would not end
+                fail(EIO);
+                return;
+            }
+            ++writes_;
+            written_ += static_cast<std::size_t>(n);
+            data += n;
+            size -= static_cast<std::size_t>(n);
         }
+    }
 
-        const mstch_tag<string_type>& tag{comp.tag};
-        const basic_data<string_type>* var = nullptr;
-        switch (tag.type) {
-            case tag_type::variable:
-            case tag_type::unescaped_variable:
-                if ((var = ctx.ctx.get(tag.name)) != nullptr) {
-                    if (!render_variable(handler, var, ctx, tag.type == tag_type::variable)) {
-                        return component<string_type>::walk_control::stop;
-                    }
+    void write_vector(const unsigned char* first, std::size_t first_size, const unsigned char* second, std::size_t second_size) {
+        iovec iov[2];
+        iov[0].iov_base = const_cast<unsigned char*>(first);
+        iov[0].iov_len = first_size;
+        iov[1].iov_base = const_cast<unsigned char*>(second);
+        iov[1].iov_len = second_size;
+        ssize_t n;
+        do {
+            n = ::writev(fd_, iov, 2);
+        } while (n < 0 && errno == EINTR);
+        if (n <= 0) {
+            fail(n < 0 ? errno : EIO);
+            return;
+        }
+        ++writes_;
+        const std::size_t done = static_cast<std::size_t>(n);
+        written_ += done;
+        if (done < first_size) {
+            write_fully(first + done, first_size - done);
+            write_fully(second, second_size);
+        } else {
+            write_fully(second + (done - first_size), second_size - (done - first_size));
+        }
+    }
+};
+
+#endif // KAINJOW_MUSTACHE_POSIX
+
+#if __cplusplus >= 202002L || (defined(_MSVC_LANG) && _MSVC_LANG >= 202002L)
+
+// A string literal usable as a template argument, e.g. compiled<"{{x}}">.
+template <typename char_type, std::size_t N>
+struct fixed_string {
+    char_type value[N];
+
+    constexpr fixed_string(const char_type (&str)[N]) {
+        for (std::size_t i = 0; i < N; ++i) {
+            value[i] = str[i];
+        }
+    }
+
+    static constexpr std::size_t size() {
+        return N - 1;
+    }
+};
+
+// Called when a string-literal template does not parse. It is deliberately
+// not constexpr, so the compiler reports this call and its message.
+inline void compile_time_parse_error(const char*) {}
+
+// The parser below is the constant-evaluated counterpart of parser. It emits
+// instructions instead of components, with strings referring to the template
+// literal itself, and follows the same tag, delimiter and section rules. It
+// also runs on strings shorter than N at run time, which the tests use to
+// check it against parser.
+template <typename char_type, std::size_t N>
+class constexpr_parser {
+public:
+    constexpr explicit constexpr_parser(const fixed_string<char_type, N>& input)
+        : input_(input.value)
+        , size_(N - 1)
+    {}
+
+    constexpr constexpr_parser(const char_type* input, std::size_t size)
+        : input_(input)
+        , size_(size)
+    {
+        assert(size < N);
+    }
+
+    // Returns the number of instructions; writes them when out is not null.
+    // Syntax errors are compile errors when constant evaluated, and are
+    // stored in error otherwise.
+    constexpr std::size_t parse(instruction* out, const char** error = nullptr) const {
+        const std::size_t size = size_;
+        std::size_t count = 0;
+        const auto fail = [error](const char* message) {
+            compile_time_parse_error(message);
+            if (error) {
+                *error = message;
+            }
+        };
+        const char_type default_begin[2] = {'{', '{'};
+        const char_type default_end[3] = {'}', '}', '}'};
+        const char_type* begin_delim = default_begin;
+        std::size_t begin_len = 2;
+        const char_type* end_delim = default_end;
+        std::size_t end_len = 2;
+        bool default_delimiters = true;
+
+        struct open_section {
+            std::size_t instruction;
+            std::size_t tag_position;
+            std::size_t name_offset;
+            std::size_t name_length;
+            std::size_t text_start;
+        };
+        open_section sections[N / 3 + 1] = {};
+        std::size_t depth = 0;
+        std::size_t first_unclosed = size;
+
+        const auto emit = [&count, out](opcode op, std::size_t offset, std::size_t length, std::size_t extra_offset, std::size_t extra_length) {
+            if (out) {
+                out[count] = instruction{op, static_cast<std::uint32_t>(offset), static_cast<std::uint32_t>(length),
+                    static_cast<std::uint32_t>(extra_offset), static_cast<std::uint32_t>(extra_length), 0};
+            }
+            return count++;
+        };
+
+        std::size_t text_start = size;
+        std::size_t pos = 0;
+        while (pos < size) {
+            const bool at_tag = matches(pos, begin_delim, begin_len, size);
+            const std::size_t newline_len = at_tag ? 0 : newline_length(pos, size);
+            if (!at_tag && newline_len == 0) {
+                if (text_start == size) {
+                    text_start = pos;
                 }
-                break;
-            case tag_type::section_begin:
-                if ((var = ctx.ctx.get(tag.name)) != nullptr) {
-                    if (var->is_lambda() || var->is_lambda2()) {
-                        if (!render_lambda(handler, var, ctx, render_lambda_escape::optional, *comp.tag.section_text, true)) {
-                            return component<string_type>::walk_control::stop;
-                        }
-                    } else if (!var->is_false() && !var->is_empty_list()) {
-                        render_section(handler, ctx, comp, var);
-                    }
+                ++pos;
+                continue;
+            }
+            if (text_start != size) {
+                emit(opcode::text, text_start, pos - text_start, 0, 0);
+                text_start = size;
+            }
+            if (!at_tag) {
+                emit(opcode::newline, pos, newline_len, 0, 0);
+                pos += newline_len;
+                continue;
+            }
+
+            const std::size_t tag_start = pos;
+            std::size_t contents_start = pos + begin_len;
+            const bool unescaped = default_delimiters && tag_start != size - 2 && input_[contents_start] == begin_delim[0];
+            const char_type* tag_end_delim = unescaped ? default_end : end_delim;
+            const std::size_t tag_end_len = unescaped ? 3 : end_len;
+            if (unescaped) {
+                ++contents_start;
+            }
+            const std::size_t tag_end = find(tag_end_delim, tag_end_len, contents_start, size);
+            if (tag_end == size) {
+                fail("Unclosed tag");
+                return count;
+            }
+            std::size_t first = contents_start;
+            std::size_t last = tag_end;
+            trim(first, last);
+            pos = tag_end + tag_end_len;
+
+            if (first != last && input_[first] == '=') {
+                // "=X X=": delimiters are the two whitespace separated words
+                if (last - first < 5 || input_[last - 1] != '=') {
+                    fail("Invalid set delimiter tag");
+                    return count;
                 }
-                return component<string_type>::walk_control::skip;
-            case tag_type::section_begin_inverted:
-                if ((var = ctx.ctx.get(tag.name)) == nullptr || var->is_false() || var->is_empty_list()) {
-                    render_section(handler, ctx, comp, var);
+                std::size_t inner_first = first + 1;
+                std::size_t inner_last = last - 1;
+                trim(inner_first, inner_last);
+                std::size_t space = inner_first;
+                while (space < inner_last && input_[space] != ' ') {
+                    ++space;
                 }
-                return component<string_type>::walk_control::skip;
-            case tag_type::partial:
-                if ((var = ctx.ctx.get_partial(tag.name)) != nullptr && (var->is_partial() || var->is_string())) {
-                    const auto& partial_result = var->is_partial() ? var->partial_value()() : var->string_value();
-                    basic_mustache tmpl{partial_result};
-                    tmpl.set_custom_escape(escape_);
-                    if (!tmpl.is_valid()) {
-                        error_message_ = tmpl.error_message();
-                    } else {
-                        tmpl.render(handler, ctx, false);
-                        if (!tmpl.is_valid()) {
-                            error_message_ = tmpl.error_message();
-                        }
+                if (space == inner_last) {
+                    fail("Invalid set delimiter tag");
+                    return count;
+                }
+                std::size_t nonspace = space;
+                while (input_[nonspace] == ' ') {
+                    ++nonspace;
+                }
+                if (!valid_delimiter(inner_first, space) || !valid_delimiter(nonspace, inner_last)) {
+                    fail("Invalid set delimiter tag");
+                    return count;
+                }
+                begin_delim = input_ + inner_first;
+                begin_len = space - inner_first;
+                end_delim = input_ + nonspace;
+                end_len = inner_last - nonspace;
+                default_delimiters = begin_len == 2 && end_len == 2 &&
+                    begin_delim[0] == '{' && begin_delim[1] == '{' && end_delim[0] == '}' && end_delim[1] == '}';
+                emit(opcode::set_delimiter, inner_first, begin_len, nonspace, end_len);
+                continue;
+            }
+
+            char_type sigil = 0;
+            if (!unescaped && first != last) {
+                sigil = input_[first];
+            }
+            switch (sigil) {
+                case '#': case '^': case '/': case '>': case '&': case '!':
+                    ++first;
+                    trim(first, last);
+                    break;
+                default:
+                    sigil = 0;
+                    break;
+            }
+            switch (sigil) {
+                case '#':
+                case '^': {
+                    const std::size_t index = emit(sigil == '#' ? opcode::section : opcode::inverted_section, first, last - first, 0, 0);
+                    sections[depth++] = open_section{index, tag_start, first, last - first, pos};
+                    break;
+                }
+                case '/': {
+                    if (depth == 0) {
+                        fail("Unopened section");
+                        return count;
+                    }
+                    const open_section& section = sections[--depth];
+                    if (!equal(section.name_offset, section.name_length, first, last - first) && section.tag_position < first_unclosed) {
+                        first_unclosed = section.tag_position;
                     }
-                    if (!tmpl.is_valid()) {
-                        return component<string_type>::walk_control::stop;
+                    if (out) {
+                        out[section.instruction].extra_offset = static_cast<std::uint32_t>(section.text_start);
+                        out[section.instruction].extra_length = static_cast<std::uint32_t>(tag_start - section.text_start);
+                        out[section.instruction].end = static_cast<std::uint32_t>(count);
                     }
+                    break;
                 }
-                break;
-            case tag_type::set_delimiter:
-                ctx.delim_set = *comp.tag.delim_set;
-                break;
-            default:
-                break;
+                case '>':
+                    emit(opcode::partial, first, last - first, instruction::no_instruction, 0);
+                    break;
+                case '&':
+                    emit(opcode::unescaped_variable, first, last - first, 0, 0);
+                    break;
+                case '!':
+                    break;
+                default:
+                    emit(unescaped ? opcode::unescaped_variable : opcode::variable, first, last - first, 0, 0);
+                    break;
+            }
         }
-
-        return component<string_type>::walk_control::walk;
+        if (text_start != size) {
+            emit(opcode::text, text_start, size - text_start, 0, 0);
+        }
+        if (depth > 0 && sections[0].tag_position < first_unclosed) {
+            first_unclosed = sections[0].tag_position;
+        }
+        if (first_unclosed != size) {
+            fail("Unclosed section");
+        }
+        return count;
     }
 
-    enum class render_lambda_escape {
-        escape,
-        unescape,
-        optional,
-    };
+private:
+    const char_type* input_;
+    std::size_t size_;
 
-    bool render_lambda(const render_handler& handler, const basic_data<string_type>* var, context_internal<string_type>& ctx, render_lambda_escape escape, const string_type& text, bool parse_with_same_context) {
-        const typename basic_renderer<string_type>::type2 render2 = [this, &ctx, parse_with_same_context, escape](const string_type& text, bool escaped) {
-            const auto process_template = [this, &ctx, escape, escaped](basic_mustache& tmpl) -> string_type {
-                if (!tmpl.is_valid()) {
-                    error_message_ = tmpl.error_message();
-                    return {};
-                }
-                const string_type str{tmpl.render(ctx)};
-                if (!tmpl.is_valid()) {
-                    error_message_ = tmpl.error_message();
-                    return {};
-                }
-                bool do_escape = false;
-                switch (escape) {
-                    case render_lambda_escape::escape:
-                        do_escape = true;
-                        break;
-                    case render_lambda_escape::unescape:
-                        do_escape = false;
-                        break;
-                    case render_lambda_escape::optional:
-                        do_escape = escaped;
-                        break;
-                }
-                return do_escape ? escape_(str) : str;
-            };
-            if (parse_with_same_context) {
-                basic_mustache tmpl{text, ctx};
-                tmpl.set_custom_escape(escape_);
-                return process_template(tmpl);
-            }
-            basic_mustache tmpl{text};
-            tmpl.set_custom_escape(escape_);
-            return process_template(tmpl);
-        };
-        const typename basic_renderer<string_type>::type1 render = [&render2](const string_type& text) {
-            return render2(text, false);
-        };
-        if (var->is_lambda2()) {
-            const basic_renderer<string_type> renderer{render, render2};
-            render_result(ctx, var->lambda2_value()(text, renderer));
-        } else {
-            render_current_line(handler, ctx, nullptr);
-            render_result(ctx, render(var->lambda_value()(text)));
+    static constexpr bool is_space(char_type ch) {
+        return ch == ' ' || ch == '\t' || ch == '\n' || ch == '\v' || ch == '\f' || ch == '\r';
+    }
+
+    constexpr void trim(std::size_t& first, std::size_t& last) const {
+        while (first < last && is_space(input_[first])) {
+            ++first;
+        }
+        while (last > first && is_space(input_[last - 1])) {
+            --last;
         }
-        return error_message_.empty();
     }
 
-    bool render_variable(const render_handler& handler, const basic_data<string_type>* var, context_internal<string_type>& ctx, bool escaped) {
-        if (var->is_string()) {
-            const auto& varstr = var->string_value();
-            render_result(ctx, escaped ? escape_(varstr) : varstr);
-        } else if (var->is_lambda()) {
-            const render_lambda_escape escape_opt = escaped ? render_lambda_escape::escape : render_lambda_escape::unescape;
-            return render_lambda(handler, var, ctx, escape_opt, {}, false);
-        } else if (var->is_lambda2()) {
-            using streamstring = std::basic_ostringstream<typename string_type::value_type>;
-            streamstring ss;
-            ss << "Lambda with render argument is not allowed for regular variables";
-            error_message_ = ss.str();
+    constexpr bool matches(std::size_t pos, const char_type* str, std::size_t len, std::size_t size) const {
+        if (pos + len > size) {
             return false;
         }
+        for (std::size_t i = 0; i < len; ++i) {
+            if (input_[pos + i] != str[i]) {
+                return false;
+            }
+        }
         return true;
     }
 
-    void render_section(const render_handler& handler, context_internal<string_type>& ctx, component<string_type>& incomp, const basic_data<string_type>* var) {
-        const auto callback = [&handler, &ctx, this](component<string_type>& comp) -> typename component<string_type>::walk_control {
-            return render_component(handler, ctx, comp);
-        };
-        if (var && var->is_non_empty_list()) {
-            for (const auto& item : var->list_value()) {
-                // account for the section begin tag
-                ctx.line_buffer.contained_section_tag = true;
+    constexpr std::size_t find(const char_type* str, std::size_t len, std::size_t pos, std::size_t size) const {
+        for (; pos + len <= size; ++pos) {
+            if (matches(pos, str, len, size)) {
+                return pos;
+            }
+        }
+        return size;
+    }
 
-                const context_pusher<string_type> ctxpusher{ctx, &item};
-                incomp.walk_children(callback);
+    constexpr std::size_t newline_length(std::size_t pos, std::size_t size) const {
+        if (input_[pos] == '\r') {
+            return pos + 1 < size && input_[pos + 1] == '\n' ? 2 : 1;
+        }
+        return input_[pos] == '\n' ? 1 : 0;
+    }
 
-                // ctx may have been cleared. account for the section end tag
-                ctx.line_buffer.contained_section_tag = true;
+    constexpr bool valid_delimiter(std::size_t first, std::size_t last) const {
+        for (; first < last; ++first) {
+            if (input_[first] == '=' || is_space(input_[first])) {
+                return false;
             }
-        } else if (var) {
-            // account for the section begin tag
-            ctx.line_buffer.contained_section_tag = true;
+        }
+        return true;
+    }
 
-            const context_pusher<string_type> ctxpusher{ctx, var};
-            incomp.walk_children(callback);
+    constexpr bool equal(std::size_t a, std::size_t a_len, std::size_t b, std::size_t b_len) const {
+        if (a_len != b_len) {
+            return false;
+        }
+        for (std::size_t i = 0; i < a_len; ++i) {
+            if (input_[a + i] != input_[b + i]) {
+                return false;
+            }
+        }
+        return true;
+    }
+};
 
-            // ctx may have been cleared. account for the section end tag
-            ctx.line_buffer.contained_section_tag = true;
-        } else {
-            // account for the section begin tag
-            ctx.line_buffer.contained_section_tag = true;
+template <fixed_string Source>
+struct constexpr_instructions {
+    using char_type = std::remove_cv_t<std::remove_reference_t<decltype(Source.value[0])>>;
+    using parser_type = constexpr_parser<char_type, Source.size() + 1>;
 
-            incomp.walk_children(callback);
+    static constexpr std::size_t size = parser_type{Source}.parse(nullptr);
 
-            // ctx may have been cleared. account for the section end tag
-            ctx.line_buffer.contained_section_tag = true;
+    static constexpr std::array<instruction, size> make() {
+        std::array<instruction, size> table{};
+        parser_type{Source}.parse(table.data());
+        return table;
+    }
+
+    static constexpr std::array<instruction, size> table = make();
+
+    // The names of the variables, sections and partials, built on first use
+    // so rendering looks them up without allocating
+    static const std::array<std::basic_string<char_type>, size>& names() {
+        static const std::array<std::basic_string<char_type>, size> names = make_names();
+        return names;
+    }
+
+    static std::array<std::basic_string<char_type>, size> make_names() {
+        std::array<std::basic_string<char_type>, size> names;
+        for (std::size_t index = 0; index < size; ++index) {
+            const instruction& ins = table[index];
+            if (ins.op != opcode::text && ins.op != opcode::newline && ins.op != opcode::set_delimiter) {
+                names[index].assign(Source.value + ins.offset, ins.length);
+            }
         }
+        return names;
+    }
+};
+
+// A string-literal template parsed at compile time:
+//   compiled<"Hello {{what}}!"> tmpl;
+//   tmpl.render({"what", "World"});
+// Syntax errors are reported as compile errors. The instruction table is a
+// constant, so no parsing or allocation happens when the template is created,
+// and tag names are looked up from strings built once per program.
+template <fixed_string Source>
+class compiled : public basic_compiled_template<std::basic_string<typename constexpr_instructions<Source>::char_type>> {
+public:
+    using string_type = std::basic_string<typename constexpr_instructions<Source>::char_type>;
+    using renderer_type = basic_compiled_renderer<string_type>;
+
+    compiled()
+        : basic_compiled_template<string_type>(&compiled::body)
+    {}
+
+    static basic_instruction_table<string_type> instructions() {
+        const auto& table = constexpr_instructions<Source>::table;
+        return {table.data(), table.size(), Source.value, constexpr_instructions<Source>::names().data()};
     }
 
 private:
-    string_type error_message_;
-    component<string_type> root_component_;
-    escape_handler escape_;
+    static bool body(renderer_type& renderer) {
+        return instructions().run(renderer);
+    }
 };
 
+#endif // C++20
+
 using mustache = basic_mustache<std::string>;
 using data = basic_data<mustache::string_type>;
 using object = basic_object<mustache::string_type>;
@@ -1174,6 +6410,26 @@ using renderer = basic_renderer<mustache::string_type>;
 using lambda = basic_lambda<mustache::string_type>;
 using lambda2 = basic_lambda2<mustache::string_type>;
 using lambda_t = basic_lambda_t<mustache::string_type>;
+using compiled_renderer = basic_compiled_renderer<mustache::string_type>;
+using compiled_template = basic_compiled_template<mustache::string_type>;
+using bundle_writer = basic_bundle_writer<mustache::string_type>;
+using bundle = basic_bundle<mustache::string_type>;
+using fragment_cache = basic_fragment_cache<mustache::string_type>;
+using incremental_render = basic_incremental_render<mustache::string_type>;
+using dependency = basic_dependency<mustache::string_type>;
+using dependencies = basic_dependencies<mustache::string_type>;
+using chunked_render = basic_chunked_render<mustache::string_type>;
+using vectored_output = basic_vectored_output<mustache::string_type>;
+using measurement = basic_measurement<mustache::string_type>;
+using output_digest = basic_output_digest<mustache::string_type>;
+using page_pool = basic_page_pool<mustache::string_type>;
+using page_buffer = basic_page_buffer<mustache::string_type>;
+#if defined(KAINJOW_MUSTACHE_POSIX)
+using fd_sink = basic_fd_sink<mustache::string_type>;
+#endif
+#if defined(KAINJOW_MUSTACHE_THREADS)
+using async_render = basic_async_render<mustache::string_type>;
+#endif
 
 using mustachew = basic_mustache<std::wstring>;
 using dataw = basic_data<mustachew::string_type>;
@@ -0,0 +1,298 @@
+/*
+ * Boost Software License - Version 1.0
+ *
+ * Copyright 2015-2019 Kevin Wojniak
+ *
+ * Permission is hereby granted, free of charge, to any person or organization
+ * obtaining a copy of the software and accompanying documentation covered by
+ * this license (the "Software") to use, reproduce, display, distribute,
+ * execute, and transmit the Software, and to prepare derivative works of the
+ * Software, and to permit third-parties to whom the Software is furnished to
+ * do so, all subject to the following:
+ *
+ * The copyright notices in the Software and this entire statement, including
+ * the above license grant, this restriction and the following disclaimer,
+ * must be included in all copies of the Software, in whole or in part, and
+ * all derivative works of the Software, unless such copies or derivative
+ * works are solely in the form of machine-executable object code generated by
+ * a source language processor.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, TITLE AND NON-INFRINGEMENT. IN NO EVENT
+ * SHALL THE COPYRIGHT HOLDERS OR ANYONE DISTRIBUTING THE SOFTWARE BE LIABLE
+ * FOR ANY DAMAGES OR OTHER LIABILITY, WHETHER IN CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+// mustache-compile reads a .mustache template and writes a C++ header that
+// renders it through basic_compiled_renderer, without parsing at run time.
+//
+// Usage: mustache-compile <input.mustache> <output.hpp> [name]
+//        mustache-compile --bundle <output.bin> <input.mustache>...
+//
+// The header defines mustache_compiled::<name>(), which returns a
+// kainjow::mustache::compiled_template. The name defaults to the input file
+// name without its extension.
+//
+// With --bundle, all inputs are written to one binary bundle for
+// kainjow::mustache::bundle, named after their files. Partials naming another
+// template of the bundle are resolved to it.
+
+#include "mustache.hpp"
+
+#include <cstdio>
+#include <fstream>
+
+using namespace kainjow::mustache;
+
+namespace {
+
+using string_type = mustache::string_type;
+
+std::string cpp_literal(const std::string& str) {
+    std::string ret{"\""};
+    for (const auto ch : str) {
+        switch (ch) {
+            case '\"':
+                ret.append("\\\"");
+                break;
+            case '\\':
+                ret.append("\\\\");
+                break;
+            case '\n':
+                ret.append("\\n");
+                break;
+            case '\r':
+                ret.append("\\r");
+                break;
+            case '\t':
+                ret.append("\\t");
+                break;
+            case '?':
+                // avoid accidental trigraphs
+                ret.append("\\?");
+                break;
+            default:
+                if (ch >= ' ' && ch <= '~') {
+                    ret.append(1, ch);
+                } else {
+                    char octal[5];
+                    std::snprintf(octal, sizeof(octal), "\\%03o", static_cast<unsigned char>(ch));
+                    ret.append(octal);
+                }
+                break;
+        }
+    }
+    ret.append("\"");
+    return ret;
+}
+
+std::string identifier(const std::string& str) {
+    std::string ret;
+    for (const auto ch : str) {
+        ret.append(1, std::isalnum(static_cast<unsigned char>(ch)) ? ch : '_');
+    }
+    if (ret.empty() || std::isdigit(static_cast<unsigned char>(ret[0]))) {
+        ret.insert(ret.begin(), '_');
+    }
+    return ret;
+}
+
+class generator {
+public:
+    void generate(const component<string_type>& root, const std::string& name, const std::string& source_name, std::ostream& out) {
+        std::ostringstream body;
+        generate_children(root, 1, body);
+
+        const std::string guard{"MUSTACHE_COMPILED_" + upper(name) + "_HPP"};
+        out << "// Generated by mustache-compile from " << source_name << ". Do not edit.\n";
+        out << "\n";
+        out << "#ifndef " << guard << "\n";
+        out << "#define " << guard << "\n";
+        out << "\n";
+        out << "#include \"mustache.hpp\"\n";
+        out << "\n";
+        out << "namespace mustache_compiled {\n";
+        out << "\n";
+        out << "inline bool " << name << "_body(kainjow::mustache::compiled_renderer& r) {\n";
+        if (!strings_.empty()) {
+            out << "    static const std::string s[] = {\n";
+            for (const auto& str : strings_) {
+                out << "        " << cpp_literal(str) << ",\n";
+            }
+            out << "    };\n";
+        }
+        out << body.str();
+        out << "    return true;\n";
+        out << "}\n";
+        out << "\n";
+        out << "inline kainjow::mustache::compiled_template " << name << "() {\n";
+        out << "    return kainjow::mustache::compiled_template{" << name << "_body};\n";
+        out << "}\n";
+        out << "\n";
+        out << "} // namespace mustache_compiled\n";
+        out << "\n";
+        out << "#endif // " << guard << "\n";
+    }
+
+private:
+    std::vector<std::string> strings_;
+
+    static std::string upper(const std::string& str) {
+        std::string ret{str};
+        for (auto& ch : ret) {
+            ch = static_cast<char>(std::toupper(static_cast<unsigned char>(ch)));
+        }
+        return ret;
+    }
+
+    std::string string_ref(const std::string& str) {
+        std::size_t index = 0;
+        while (index < strings_.size() && strings_[index] != str) {
+            ++index;
+        }
+        if (index == strings_.size()) {
+            strings_.push_back(str);
+        }
+        return "s[" + std::to_string(index) + "]";
+    }
+
+    static void flush_text(std::string& text, const std::string& indent, std::ostream& out) {
+        if (!text.empty()) {
+            out << indent << "r.text(" << cpp_literal(text) << ", " << text.size() << ");\n";
+            text.clear();
+        }
+    }
+
+    void generate_children(const component<string_type>& comp, int depth, std::ostream& out) {
+        const std::string indent(static_cast<std::size_t>(depth) * 4, ' ');
+        std::string text;
+        for (const auto& child : comp.children) {
+            if (child.is_text() && !child.is_newline()) {
+                // adjacent literals become a single append
+                text.append(child.text);
+                continue;
+            }
+            flush_text(text, indent, out);
+            if (child.is_newline()) {
+                out << indent << "r.newline(" << cpp_literal(child.text) << ", " << child.text.size() << ");\n";
+                continue;
+            }
+            const auto& tag = child.tag;
+            switch (tag.type) {
+                case tag_type::variable:
+                case tag_type::unescaped_variable:
+                    out << indent << "if (!r.variable(" << string_ref(tag.name) << ", " << (tag.type == tag_type::variable ? "true" : "false") << ")) return false;\n";
+                    break;
+                case tag_type::section_begin:
+                    out << indent << "if (!r.section(" << string_ref(tag.name) << ", " << string_ref(*tag.section_text) << ", [&r]() -> bool {\n";
+                    generate_children(child, depth + 1, out);
+                    out << indent << "    return true;\n";
+                    out << indent << "})) return false;\n";
+                    break;
+                case tag_type::section_begin_inverted:
+                    out << indent << "if (!r.inverted_section(" << string_ref(tag.name) << ", [&r]() -> bool {\n";
+                    generate_children(child, depth + 1, out);
+                    out << indent << "    return true;\n";
+                    out << indent << "})) return false;\n";
+                    break;
+                case tag_type::partial:
+                    out << indent << "if (!r.partial(" << string_ref(tag.name) << ")) return false;\n";
+                    break;
+                case tag_type::set_delimiter:
+                    out << indent << "r.set_delimiter(" << string_ref(tag.delim_set->begin) << ", " << string_ref(tag.delim_set->end) << ");\n";
+                    break;
+                default:
+                    break;
+            }
+        }
+        flush_text(text, indent, out);
+    }
+};
+
+bool read_file(const std::string& path, std::string& contents) {
+    std::ifstream file{path, std::ios::in | std::ios::binary};
+    if (!file) {
+        return false;
+    }
+    std::ostringstream ss;
+    ss << file.rdbuf();
+    contents = ss.str();
+    return true;
+}
+
+std::string file_name(const std::string& path) {
+    const auto slash = path.find_last_of("/\\");
+    return slash == std::string::npos ? path : path.substr(slash + 1);
+}
+
+std::string default_name(const std::string& path) {
+    const std::string name{file_name(path)};
+    return name.substr(0, name.find('.'));
+}
+
+int write_bundle(const std::string& output_path, char** inputs, int count) {
+    bundle_writer writer;
+    for (int i = 0; i < count; ++i) {
+        const std::string input_path{inputs[i]};
+        std::string input;
+        if (!read_file(input_path, input)) {
+            std::cerr << "error: cannot read " << input_path << std::endl;
+            return 1;
+        }
+        if (!writer.add(default_name(input_path), input)) {
+            std::cerr << input_path << ": " << writer.error_message() << std::endl;
+            return 1;
+        }
+    }
+    std::ofstream file{output_path, std::ios::out | std::ios::binary};
+    if (!file || !(file << writer.serialize())) {
+        std::cerr << "error: cannot write " << output_path << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    if (argc >= 4 && std::string{argv[1]} == "--bundle") {
+        return write_bundle(argv[2], argv + 3, argc - 3);
+    }
+    if (argc < 3 || argc > 4) {
+        std::cerr << "usage: " << argv[0] << " <input.mustache> <output.hpp> [name]" << std::endl;
+        std::cerr << "       " << argv[0] << " --bundle <output.bin> <input.mustache>..." << std::endl;
+        return 2;
+    }
+    const std::string input_path{argv[1]};
+    const std::string output_path{argv[2]};
+    const std::string name{identifier(argc == 4 ? argv[3] : default_name(input_path))};
+
+    std::string input;
+    if (!read_file(input_path, input)) {
+        std::cerr << "error: cannot read " << input_path << std::endl;
+        return 1;
+    }
+
+    component<string_type> root;
+    string_type error_message;
+    context<string_type> ctx;
+    context_internal<string_type> context{ctx};
+    parser<string_type>{input, context, root, error_message};
+    if (!error_message.empty()) {
+        std::cerr << input_path << ": " << error_message << std::endl;
+        return 1;
+    }
+
+    std::ostringstream out;
+    generator{}.generate(root, name, file_name(input_path), out);
+
+    std::ofstream file{output_path, std::ios::out | std::ios::binary};
+    if (!file || !(file << out.str())) {
+        std::cerr << "error: cannot write " << output_path << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -26,8 +26,21 @@
  * DEALINGS IN THE SOFTWARE.
  */
 
+// for set_parallel() and async_render
+#define KAINJOW_MUSTACHE_THREADS
 #include "mustache.hpp"
 
+#include <chrono>
+#include <future>
+#include <random>
+#include <thread>
+
+// Generated from fixtures/compiled_list.mustache by the build
+#ifdef MUSTACHE_COMPILED_FIXTURE
+#include "compiled_list.hpp"
+#include <fstream>
+#endif
+
 #define CATCH_CONFIG_MAIN
 #include "catch.hpp"
 
@@ -62,6 +75,28 @@ TEST_CASE("split") {
 
 }
 
+TEST_CASE("trim") {
+
+    CHECK(trim<std::string>("") == "");
+    CHECK(trim<std::string>(" \t\r\n") == "");
+    CHECK(trim<std::string>("\f a b \v") == "a b");
+    CHECK(trim<std::string>("\xa0x\xa0") == "\xa0x\xa0");
+    CHECK(trim<std::wstring>(L"  wide ") == L"wide");
+
+    const std::string input{"{{  name\t}}"};
+    std::string::size_type first = 2;
+    std::string::size_type last = 9;
+    trim(input, first, last);
+    CHECK(input.substr(first, last - first) == "name");
+
+    mustache tmpl{"{{ a }}{{# \tb\n}}{{\r& a}}{{/ b }}{{^\tc }}{{{ a }}}{{/c}}{{! note }}"};
+    REQUIRE(tmpl.is_valid());
+    data dat{"a", "<"};
+    dat["b"] = true;
+    CHECK(tmpl.render(dat) == "&lt;<<");
+
+}
+
 TEST_CASE("variables") {
 
     SECTION("empty") {
@@ -1086,6 +1121,17 @@ TEST_CASE("custom_escape") {
         CHECK(tmpl.render(dat) == "hello \\\"friend\\\"");
     }
 
+    SECTION("append") {
+        mustache tmpl{"{{a}} {{{a}}} {{>p}} {{#wrap}}{{a}}{{/wrap}}"};
+        tmpl.set_custom_escape_append([](const std::string& s, std::string& out) {
+            out.append(1, '[').append(s).append(1, ']');
+        });
+        data dat{"a", "<x>"};
+        dat["p"] = partial{[]{ return "{{a}}"; }};
+        dat["wrap"] = lambda{[](const std::string& text) { return "(" + text + ")"; }};
+        CHECK(tmpl.render(dat) == "[<x>] <x> [<x>] ([<x>])");
+    }
+
     SECTION("none") {
         mustache tmpl("hello {{what}}");
         mustache::escape_handler esc;
@@ -1288,6 +1334,38 @@ TEST_CASE("standalone_lines") {
         CHECK(root_children[14].children.empty());
     }
 
+    SECTION("merge_text") {
+        const mustache::string_type input =
+        "|\n"
+        "| This Is\n"
+        "  {{#boolean}}\r\n"
+        "|\n"
+        "{{/boolean}}\n"
+        "| A Line";
+        component<mustache::string_type> root_component;
+        mustache::string_type error_message;
+        context<mustache::string_type> ctx;
+        context_internal<mustache::string_type> context{ctx};
+        parser<mustache::string_type>{input, context, root_component, error_message};
+        merge_text(root_component);
+        const auto& root_children = root_component.children;
+        REQUIRE(root_children.size() == 3);
+        CHECK(root_children[0].text == "|\n| This Is\n  ");
+        CHECK(root_children[0].first_newline == 1);
+        CHECK(root_children[0].first_line_end == 2);
+        CHECK(root_children[0].lines_end == 12);
+        REQUIRE(root_children[1].children.size() == 1);
+        CHECK(root_children[1].children[0].text == "\r\n|\n");
+        CHECK(root_children[1].children[0].first_line_end == 2);
+        CHECK(root_children[1].children[0].lines_end == 4);
+        CHECK(root_children[2].text == "\n| A Line");
+        CHECK(root_children[2].lines_end == 1);
+
+        component<mustache::string_type> text;
+        text.append_text(component<mustache::string_type>{"abc", 0});
+        CHECK_FALSE(text.has_line_breaks());
+    }
+
     SECTION("remove_standalone_lines") {
         mustache tmpl{
             "|\n"
@@ -1474,3 +1552,2015 @@ TEST_CASE("standalone_lines") {
 
 }
 
+
+// Same shape as the output of mustache-compile for:
+// "{{#items}}\n- {{name}}\n{{/items}}\n{{^items}}none{{/items}}{{>footer}}"
+static bool compiled_list_body(compiled_renderer& r) {
+    static const std::string s[] = {
+        "items",
+        "\n- {{name}}\n",
+        "name",
+        "footer",
+    };
+    if (!r.section(s[0], s[1], [&r]() -> bool {
+        r.newline("\n", 1);
+        r.text("- ", 2);
+        if (!r.variable(s[2], true)) return false;
+        r.newline("\n", 1);
+        return true;
+    })) return false;
+    r.newline("\n", 1);
+    if (!r.inverted_section(s[0], [&r]() -> bool {
+        r.text("none", 4);
+        return true;
+    })) return false;
+    if (!r.partial(s[3])) return false;
+    return true;
+}
+
+TEST_CASE("compiled_template") {
+
+    const std::string input{"{{#items}}\n- {{name}}\n{{/items}}\n{{^items}}none{{/items}}{{>footer}}"};
+
+    SECTION("matches_runtime") {
+        data items{data::type::list};
+        items << data{"name", "<a>"} << data{"name", "b"};
+        data dat{"items", items};
+        dat["footer"] = partial{[]{ return "|{{#items}}{{name}}{{/items}}"; }};
+        compiled_template compiled{compiled_list_body};
+        mustache tmpl{input};
+        CHECK(compiled.render(dat) == "- &lt;a&gt;\n- b\n|&lt;a&gt;b");
+        CHECK(compiled.render(dat) == tmpl.render(dat));
+        CHECK(compiled.is_valid());
+    }
+
+    SECTION("empty") {
+        compiled_template compiled{compiled_list_body};
+        mustache tmpl{input};
+        CHECK(compiled.render(data{}) == "\nnone");
+        CHECK(compiled.render(data{}) == tmpl.render(data{}));
+    }
+
+    SECTION("lambda") {
+        data dat{"items", lambda{[](const std::string& text) {
+            CHECK(text == "\n- {{name}}\n");
+            return "{{name}}";
+        }}};
+        dat["name"] = "Steve";
+        compiled_template compiled{compiled_list_body};
+        CHECK(compiled.render(dat) == "Steve\n");
+    }
+
+    SECTION("custom_escape") {
+        data dat{"items", list{data{"name", "\"x\""}}};
+        compiled_template compiled{compiled_list_body};
+        compiled.set_custom_escape([](const std::string& s) { return "[" + s + "]"; });
+        CHECK(compiled.render(dat) == "- [\"x\"]\n");
+    }
+
+    SECTION("max_depth") {
+        // compiled sections and the partials they render count as runtime
+        // ones do
+        data items{data::type::list};
+        items << data{"name", "a"};
+        data dat{"items", items};
+        dat["footer"] = partial{[]{ return "{{#items}}{{name}}{{/items}}"; }};
+        compiled_template compiled{compiled_list_body};
+        compiled.set_max_depth(1);
+        CHECK(compiled.render(dat) == "- a\n");
+        CHECK_FALSE(compiled.is_valid());
+        CHECK(compiled.error_message() == "Render depth exceeds the maximum of 1");
+
+        compiled_template shallow{compiled_list_body};
+        shallow.set_max_depth(0);
+        shallow.render(dat);
+        CHECK(shallow.error_message() == "Render depth exceeds the maximum of 0");
+
+        compiled_template deep{compiled_list_body};
+        deep.set_max_depth(2);
+        CHECK(deep.render(dat) == "- a\na");
+        CHECK(deep.is_valid());
+    }
+
+    SECTION("error") {
+        data dat{"footer", partial{[]{ return "{{#oops}}"; }}};
+        compiled_template compiled{compiled_list_body};
+        CHECK(compiled.render(dat) == "\nnone");
+        CHECK_FALSE(compiled.is_valid());
+        CHECK(compiled.error_message() == "Unclosed section \"oops\" at 0");
+    }
+
+}
+
+#ifdef MUSTACHE_COMPILED_FIXTURE
+
+TEST_CASE("compiled_generator") {
+
+    std::ifstream file{MUSTACHE_COMPILED_FIXTURE, std::ios::in | std::ios::binary};
+    REQUIRE(file);
+    std::ostringstream source;
+    source << file.rdbuf();
+    mustache tmpl{source.str()};
+    REQUIRE(tmpl.is_valid());
+    compiled_template compiled{mustache_compiled::compiled_list()};
+
+    data items{data::type::list};
+    items << data{"name", "<a>"} << data{"name", "b"};
+    data dat{"items", items};
+    dat["footer"] = partial{[]{ return "|{{#items}}{{name}}{{/items}}"; }};
+    CHECK(compiled.render(dat) == tmpl.render(dat));
+    CHECK(compiled.render(data{}) == tmpl.render(data{}));
+    data lambda_data{"items", lambda{[](const std::string&) { return "{{name}}"; }}};
+    lambda_data["name"] = "Steve";
+    CHECK(compiled.render(lambda_data) == tmpl.render(lambda_data));
+    CHECK(compiled.is_valid());
+
+}
+
+#endif
+
+static bool instruction_table_body(compiled_renderer& r) {
+    // "{{#items}}<{{.}}>{{/items}}\n{{>p}}"
+    static const char strings[] = "items<.>\np";
+    static const instruction instructions[] = {
+        {opcode::section, 0, 5, 5, 3, 4},
+        {opcode::text, 5, 1, 0, 0, 0},
+        {opcode::variable, 6, 1, 0, 0, 0},
+        {opcode::text, 7, 1, 0, 0, 0},
+        {opcode::newline, 8, 1, 0, 0, 0},
+        {opcode::partial, 9, 1, instruction::no_instruction, 0, 0},
+    };
+    return basic_instruction_table<std::string>{instructions, 6, strings}.run(r);
+}
+
+TEST_CASE("instruction_table") {
+
+    data dat{"items", list{"a", "&"}};
+    dat["p"] = partial{[]{ return "{{#items}}{{.}}{{/items}}"; }};
+    compiled_template tmpl{instruction_table_body};
+    CHECK(tmpl.render(dat) == "<a><&amp;>\na&amp;");
+
+}
+
+#if __cplusplus >= 202002L || (defined(_MSVC_LANG) && _MSVC_LANG >= 202002L)
+
+TEST_CASE("compiled_literal") {
+
+    SECTION("basic") {
+        compiled<"Hello {{what}}!"> tmpl;
+        CHECK(tmpl.render({"what", "<World>"}) == "Hello &lt;World&gt;!");
+        CHECK(tmpl.instructions().size() == 3);
+    }
+
+    SECTION("matches_runtime") {
+        const char* input = "|\n  {{#items}}\n  {{name}}: {{{value}}}\n  {{/items}}\n{{^items}}none{{/items}}\n{{! comment }}{{=<% %>=}}<% name %>";
+        compiled<"|\n  {{#items}}\n  {{name}}: {{{value}}}\n  {{/items}}\n{{^items}}none{{/items}}\n{{! comment }}{{=<% %>=}}<% name %>"> tmpl;
+        data items{data::type::list};
+        items << object{{"name", "a"}, {"value", "<1>"}} << object{{"name", "b"}, {"value", "&"}};
+        data dat{"items", items};
+        dat["name"] = "top";
+        CHECK(tmpl.render(dat) == mustache{input}.render(dat));
+        CHECK(tmpl.render(data{}) == mustache{input}.render(data{}));
+    }
+
+    SECTION("lambda") {
+        compiled<"{{#wrap}}Hi {{name}}{{/wrap}}"> tmpl;
+        data dat{"name", "Steve"};
+        dat["wrap"] = lambda{[](const std::string& text) { return "<b>" + text + "</b>"; }};
+        CHECK(tmpl.render(dat) == "<b>Hi Steve</b>");
+    }
+
+    SECTION("names") {
+        // names are built once per template type and the template only
+        // keeps its body and settings
+        using long_names = compiled<"{{#a_long_section_name}}{{a_long_variable_name}}{{/a_long_section_name}}">;
+        const auto& names = constexpr_instructions<"{{#a_long_section_name}}{{a_long_variable_name}}{{/a_long_section_name}}">::names();
+        REQUIRE(names.size() == 2);
+        CHECK(names[0] == "a_long_section_name");
+        CHECK(names[1] == "a_long_variable_name");
+        CHECK(long_names::instructions()[1].op == opcode::variable);
+        long_names tmpl;
+        CHECK(sizeof(tmpl) < sizeof(mustache));
+        data dat{"a_long_section_name", list{data{"a_long_variable_name", "<1>"}, data{"a_long_variable_name", "2"}}};
+        CHECK(tmpl.render(dat) == "&lt;1&gt;2");
+        tmpl.set_escape(json_escape_append<std::string>);
+        CHECK(tmpl.render(dat) == "<1>2");
+        CHECK(tmpl.is_valid());
+    }
+
+    SECTION("max_depth") {
+        using nested = compiled<"{{#a}}{{#a}}{{^b}}x{{/b}}{{/a}}{{/a}}">;
+        data dat{"a", true};
+        nested tmpl;
+        tmpl.set_max_depth(3);
+        CHECK(tmpl.render(dat) == "x");
+        CHECK(tmpl.is_valid());
+        nested shallow;
+        shallow.set_max_depth(2);
+        CHECK(shallow.render(dat).empty());
+        CHECK(shallow.error_message() == "Render depth exceeds the maximum of 2");
+    }
+
+    SECTION("wide") {
+        compiled<L"Hello {{what}}!"> tmpl;
+        CHECK(tmpl.render(dataw{L"what", L"World"}) == L"Hello World!");
+    }
+
+}
+
+// Runs constexpr_parser and parser over the same templates, so the two
+// parsers cannot drift apart unnoticed.
+TEST_CASE("constexpr_parser_matches_parser") {
+
+    std::vector<std::string> inputs{
+        "Hello {{what}}!",
+        "{{{a}}} {{&a}} {{ a }} {{a.b.c}} {{.}}",
+        "{{#a}}[{{b}}]{{/a}}{{^a}}none{{/a}}",
+        "|\n  {{#a}}\n  x\n  {{/a}}\n|",
+        "|\r\n{{#a}}\r\n{{/a}}\r\n|",
+        "  {{! comment }}\n|{{! inline }}|\n{{!\nmultiline\n}}\nend",
+        "{{=<% %>=}}<% a %>{{a}}<%={{ }}=%>{{a}}",
+        "  {{=| |=}}\n|#a| x |/a|",
+        "{{>p}}\n  {{>p}}\n",
+        "{{#a}}{{#b}}{{/b}}{{/a}}\n",
+        "{{#a}}\n{{/a}}{{#a}}\n{{/a}}",
+        "{{a}", "{{#a}}", "{{/a}}", "{{#a}}{{/b}}", "{{=x=}}", "{{= a b c =}}", "{{=< >}}",
+        "{{#a}}{{^b}}{{/c}}{{/a}}", "{{", "}}", "{{}}", "{{{a}}", "{{ # a }}{{ / a }}",
+    };
+    std::mt19937 rng{27};
+    const char* pieces[] = {"{{#a}}", "{{/a}}", "{{^b}}", "{{/b}}", "{{x}}", "{{{x}}}", "{{&x}}", "{{.}}", "{{!c}}",
+        "{{>p}}", "{{=<% %>=}}", "<%x%>", "<%={{ }}=%>", "\n", "\r\n", "  ", "\t", "t", "{", "}", "{{", "}}"};
+    for (int i = 0; i < 5000; ++i) {
+        std::string input;
+        for (std::size_t n = rng() % 10; n > 0; --n) {
+            input.append(pieces[rng() % (sizeof(pieces) / sizeof(pieces[0]))]);
+        }
+        inputs.push_back(input);
+    }
+
+    data dat{"x", "<x>"};
+    dat["a"] = list{data{"x", "1"}, data{"x", "2"}};
+    dat["b"] = false;
+    dat["p"] = partial{[]{ return "[{{x}}]\n"; }};
+    for (const auto& input : inputs) {
+        INFO(input);
+        mustache tmpl{input};
+        const constexpr_parser<char, 512> parser{input.data(), input.size()};
+        const char* error = nullptr;
+        std::vector<instruction> table(parser.parse(nullptr, &error));
+        CHECK(tmpl.is_valid() == (error == nullptr));
+        if (!tmpl.is_valid() || error) {
+            continue;
+        }
+        parser.parse(table.data());
+        compiled_template compiled{[&table, &input](compiled_renderer& r) {
+            return basic_instruction_table<std::string>{table.data(), table.size(), input.data()}.run(r);
+        }};
+        CHECK(compiled.render(dat) == tmpl.render(dat));
+        CHECK(compiled.render(data{}) == tmpl.render(data{}));
+    }
+
+}
+
+#endif
+
+TEST_CASE("bundle") {
+
+    bundle_writer writer;
+    REQUIRE(writer.add("page", "<h1>{{title}}</h1>\n{{#items}}\n  {{>item}}\n{{/items}}\n{{>footer}}"));
+    REQUIRE(writer.add("item", "<li>{{name}}</li>\n"));
+    const std::string bytes = writer.serialize();
+    // keep the bundle 4-byte aligned, as a mapped file would be
+    std::vector<std::uint32_t> storage((bytes.size() + 3) / 4);
+    std::memcpy(storage.data(), bytes.data(), bytes.size());
+
+    SECTION("render") {
+        bundle b{storage.data(), bytes.size()};
+        REQUIRE(b.is_valid());
+        CHECK(b.size() == 2);
+        CHECK(b.name(1) == "item");
+        CHECK(b.find("page") == 0);
+        CHECK(b.find("missing") == bundle::npos);
+        data items{data::type::list};
+        items << data{"name", "a"} << data{"name", "<b>"};
+        data dat{"items", items};
+        dat["title"] = "T";
+        dat["footer"] = partial{[]{ return "-- {{title}} --"; }};
+        compiled_template tmpl = b.get("page");
+        CHECK(tmpl.render(dat) == "<h1>T</h1>\n  <li>a</li>\n\n  <li>&lt;b&gt;</li>\n\n-- T --");
+        mustache runtime{"<h1>{{title}}</h1>\n{{#items}}\n  {{>item}}\n{{/items}}\n{{>footer}}"};
+        dat["item"] = "<li>{{name}}</li>\n";
+        CHECK(tmpl.render(dat) == runtime.render(dat));
+    }
+
+    SECTION("missing") {
+        bundle b{storage.data(), bytes.size()};
+        compiled_template typo = b.get("pgae");
+        CHECK_FALSE(typo.is_valid());
+        CHECK(typo.error_message() == "No template named \"pgae\" in the bundle");
+        CHECK(typo.render(data{"title", "T"}).empty());
+        compiled_template out_of_range = b.get(2);
+        CHECK_FALSE(out_of_range.is_valid());
+        CHECK(out_of_range.error_message() == "No template at this index in the bundle");
+    }
+
+    SECTION("recursive partials") {
+        // partials resolved inside the bundle count towards the render depth
+        bundle_writer recursive;
+        REQUIRE(recursive.add("self", "x{{>self}}"));
+        REQUIRE(recursive.add("a", "a{{>b}}"));
+        REQUIRE(recursive.add("b", "b{{>a}}"));
+        REQUIRE(recursive.add("tree", "{{name}}{{#children}}({{>tree}}){{/children}}"));
+        const std::string recursive_bytes = recursive.serialize();
+        std::vector<std::uint32_t> recursive_storage((recursive_bytes.size() + 3) / 4);
+        std::memcpy(recursive_storage.data(), recursive_bytes.data(), recursive_bytes.size());
+        bundle b{recursive_storage.data(), recursive_bytes.size()};
+        REQUIRE(b.is_valid());
+
+        compiled_template self = b.get("self");
+        self.set_max_depth(10);
+        self.render(data{});
+        CHECK_FALSE(self.is_valid());
+        CHECK(self.error_message() == "Render depth exceeds the maximum of 10");
+
+        compiled_template mutual = b.get("a");
+        mutual.render(data{});
+        CHECK_FALSE(mutual.is_valid());
+        CHECK(mutual.error_message() == "Render depth exceeds the maximum of 1000");
+
+        data leaf{"name", "c"};
+        leaf["children"] = false;
+        data node{"name", "b"};
+        node["children"] = list{leaf};
+        data root{"name", "a"};
+        root["children"] = list{node};
+        compiled_template tree = b.get("tree");
+        CHECK(tree.render(root) == "a(b(c))");
+        CHECK(tree.is_valid());
+    }
+
+    SECTION("invalid") {
+        CHECK(writer.add("broken", "{{#a}}") == false);
+        CHECK(writer.error_message() == "Unclosed section \"a\" at 0");
+        bundle truncated{storage.data(), bytes.size() - 4};
+        CHECK_FALSE(truncated.is_valid());
+        CHECK(truncated.error_message() == "Bundle is truncated");
+        storage[1] = 99;
+        bundle version{storage.data(), bytes.size()};
+        CHECK(version.error_message() == "Unsupported bundle version");
+        storage[0] = 0;
+        bundle garbage{storage.data(), bytes.size()};
+        CHECK(garbage.error_message() == "Not a template bundle");
+        basic_bundle<std::wstring> wide{storage.data(), bytes.size()};
+        CHECK_FALSE(wide.is_valid());
+    }
+
+}
+
+TEST_CASE("lazy_sections") {
+
+    parse_options lazy;
+    lazy.lazy_sections = true;
+
+    SECTION("skimmed") {
+        const mustache::string_type input{"a{{#x}}b{{#y}}c{{/y}}{{/x}}{{^z}}d{{/z}}"};
+        component<mustache::string_type> root_component;
+        mustache::string_type error_message;
+        context<mustache::string_type> ctx;
+        context_internal<mustache::string_type> context{ctx};
+        parser<mustache::string_type>{input, context, root_component, error_message, lazy};
+        CHECK(error_message.empty());
+        REQUIRE(root_component.children.size() == 3);
+        const auto& section = root_component.children[1];
+        REQUIRE(section.lazy);
+        CHECK(section.children.empty());
+        CHECK(*section.tag.section_text == "b{{#y}}c{{/y}}");
+        const auto& body = section.lazy->body();
+        REQUIRE(body.children.size() == 2);
+        CHECK(body.children[0].text == "b");
+        REQUIRE(body.children[1].lazy);
+        CHECK(&section.lazy->body() == &body);
+        CHECK(root_component.children[2].lazy);
+    }
+
+    SECTION("render") {
+        const mustache::string_type input{
+            "|\n"
+            "{{#items}}\n"
+            "  {{name}}{{#tags}} #{{.}}{{/tags}}\n"
+            "{{/items}}\n"
+            "{{^items}}none{{/items}}\n"
+            "{{#wrap}}{{name}}{{/wrap}}"
+        };
+        data items{data::type::list};
+        items << object{{"name", "a"}, {"tags", list{"x", "y"}}} << data{"name", "<b>"};
+        data dat{"items", items};
+        dat["name"] = "top";
+        dat["wrap"] = lambda{[](const std::string& text) { return "[" + text + "]"; }};
+        mustache eager{input};
+        mustache tmpl{input, lazy};
+        REQUIRE(tmpl.is_valid());
+        CHECK(tmpl.render(dat) == eager.render(dat));
+        CHECK(tmpl.render(data{}) == eager.render(data{}));
+    }
+
+    SECTION("set_delimiter") {
+        const mustache::string_type input{"{{#a}}{{=<% %>=}}<%b%>{{/a}}<%/a%>{{b}}<%b%>"};
+        data dat{"a", true};
+        dat["b"] = "B";
+        mustache tmpl{input, lazy};
+        REQUIRE(tmpl.is_valid());
+        CHECK(tmpl.render(dat) == mustache{input}.render(dat));
+        CHECK(tmpl.render(dat) == "B{{/a}}{{b}}B");
+    }
+
+    SECTION("errors") {
+        const std::vector<std::string> invalids{
+            "{{#a}}",
+            "{{#a}}{{#b}}{{/b}}",
+            "{{#a}}{{^b}}{{/c}}{{/a}}",
+            "{{#a}}{{/b}}",
+            "{{#a}}{{b{{/a}}",
+            "x{{#a}}{{=< =}}{{/a}}",
+            "{{#a}}{{/a}}{{/b}}",
+        };
+        for (const auto& input : invalids) {
+            mustache eager{input};
+            mustache tmpl{input, lazy};
+            CHECK_FALSE(tmpl.is_valid());
+            CHECK(tmpl.error_message() == eager.error_message());
+        }
+    }
+
+    SECTION("malformed body") {
+        // skimming matches the same tags as a full parse, but an error in a
+        // body parsed later is kept rather than dropped
+        lazy_section<mustache::string_type> section{std::make_shared<mustache::string_type>("a{{#b}}c"), delimiter_set<mustache::string_type>{}};
+        CHECK(section.body().children.size() == 2);
+        CHECK(section.error_message() == "Unclosed section \"b\" at 1");
+
+        lazy_section<mustache::string_type> valid{std::make_shared<mustache::string_type>("a{{#b}}c{{/b}}"), delimiter_set<mustache::string_type>{}};
+        CHECK(valid.error_message().empty());
+    }
+
+    SECTION("partial") {
+        data dat{"p", partial{[]{ return "{{#a}}{{b}}{{/a}}"; }}};
+        dat["a"] = true;
+        dat["b"] = "B";
+        mustache tmpl{"<{{>p}}>", lazy};
+        CHECK(tmpl.render(dat) == "<B>");
+    }
+
+}
+
+TEST_CASE("specialize") {
+
+    // rendering the original with the constants on top of the data
+    const auto expected = [](mustache& tmpl, const data& constants, const data& dat) {
+        context<mustache::string_type> ctx{&dat};
+        ctx.push(&constants);
+        return tmpl.render(ctx);
+    };
+
+    data constants;
+    constants["site"] = "<Shop>";
+    constants["show_banner"] = true;
+    constants["beta"] = false;
+    constants["langs"] = list{"en", "de"};
+    constants["brand"] = object{{"color", "red"}};
+    constants["footer"] = partial{[]{ return "{{site}} {{user}}"; }};
+
+    data dat;
+    dat["user"] = "Ann & Bob";
+    dat["items"] = list{"1", "2"};
+
+    SECTION("equivalent") {
+        const std::vector<std::string> inputs{
+            "{{site}} {{{site}}} {{&site}} {{user}}",
+            "|\n{{#show_banner}}\n  {{site}}\n{{/show_banner}}\n{{^show_banner}}\nno\n{{/show_banner}}\n|",
+            "{{#beta}}\nbeta {{user}}\n{{/beta}}\n{{^beta}}\nstable\n{{/beta}}\n",
+            "{{#langs}}\n- {{.}}\n{{/langs}}\n",
+            "{{#brand}}{{color}} {{user}}{{/brand}} {{#brand}}{{color}}{{/brand}}",
+            "{{#items}}\n{{site}}:{{.}}\n{{/items}}\n",
+            "{{>footer}}\n{{missing}}{{#missing}}x{{/missing}}{{^missing}}y{{/missing}}",
+            "{{=<% %>=}}<%site%> <%#show_banner%><%user%><%/show_banner%>",
+        };
+        for (const auto& input : inputs) {
+            mustache tmpl{input};
+            mustache specialized{tmpl.specialize(constants)};
+            CHECK(specialized.render(dat) == expected(tmpl, constants, dat));
+        }
+    }
+
+    SECTION("item read by a kept tag") {
+        // tags left in the body of a list of scalars still read the item
+        const std::vector<std::string> inputs{
+            "{{#langs}}{{^missing}}{{.}}{{/missing}}{{/langs}}",
+            "{{#langs}}{{#user}}{{.}}{{/user}}{{/langs}}",
+            "{{#langs}}{{>item}}{{/langs}}",
+            "{{#langs}}{{upper}}{{/langs}}",
+        };
+        data scalars{constants};
+        scalars["item"] = partial{[]{ return "<{{.}}>"; }};
+        scalars["upper"] = lambda{[](const std::string&) { return "[{{.}}]"; }};
+        for (const auto& input : inputs) {
+            mustache tmpl{input};
+            mustache specialized{tmpl.specialize(scalars)};
+            CHECK(specialized.render(dat) == expected(tmpl, scalars, dat));
+        }
+        mustache tmpl{"{{#ls}}{{^m}}{{.}}{{/m}}{{/ls}}"};
+        CHECK(tmpl.specialize(data{"ls", list{"a", "b", "c"}}).render(data{}) == "abc");
+    }
+
+    SECTION("folded") {
+        mustache tmpl{"{{site}}|{{user}}"};
+        mustache specialized{tmpl.specialize(constants)};
+        specialized.set_custom_escape([](const std::string& s) { return "(" + s + ")"; });
+        CHECK(specialized.render(dat) == "&lt;Shop&gt;|(Ann & Bob)");
+    }
+
+    SECTION("layers") {
+        mustache tmpl{"{{a}} {{b}} {{c}}"};
+        mustache specialized{tmpl.specialize(data{"a", "1"}).specialize(data{"b", "2"})};
+        CHECK(specialized.render(data{"c", "3"}) == "1 2 3");
+    }
+
+    SECTION("invalid") {
+        mustache tmpl{"{{#a}}"};
+        mustache specialized{tmpl.specialize(constants)};
+        CHECK_FALSE(specialized.is_valid());
+        CHECK(specialized.error_message() == tmpl.error_message());
+    }
+
+}
+
+TEST_CASE("html_escape") {
+
+    SECTION("clean") {
+        const std::string input(100, 'x');
+        CHECK(html_escape(input) == input);
+        CHECK(html_escape(std::string{}).empty());
+    }
+
+    SECTION("every_position") {
+        // specials at each offset of the 16 and 32 character blocks
+        for (std::size_t size = 1; size <= 70; ++size) {
+            for (std::size_t pos = 0; pos < size; ++pos) {
+                for (const char ch : {'&', '<', '>', '\"', '\''}) {
+                    std::string input(size, 'a');
+                    input[pos] = ch;
+                    const std::string escaped{html_escape(input)};
+                    const std::string entity{ch == '&' ? "&amp;" : ch == '<' ? "&lt;" : ch == '>' ? "&gt;" : ch == '\"' ? "&quot;" : "&apos;"};
+                    REQUIRE(escaped == std::string(pos, 'a') + entity + std::string(size - pos - 1, 'a'));
+                }
+            }
+        }
+    }
+
+    SECTION("mixed") {
+        const std::string input{"<a href=\"x?a=1&b='2'\">Tom & Jerry</a> \xc3\xa9\x80\xff <<>>"};
+        CHECK(html_escape(input) == "&lt;a href=&quot;x?a=1&amp;b=&apos;2&apos;&quot;&gt;Tom &amp; Jerry&lt;/a&gt; \xc3\xa9\x80\xff &lt;&lt;&gt;&gt;");
+    }
+
+    SECTION("wide") {
+        CHECK(html_escape(std::wstring{L"Tom & \"Jerry\" <3"}) == L"Tom &amp; &quot;Jerry&quot; &lt;3");
+    }
+
+}
+
+TEST_CASE("escapers") {
+
+    SECTION("json") {
+        CHECK(json_escape(std::string{"say \"hi\"\\\n\t\x01\x1f caf\xc3\xa9"}) == "say \\\"hi\\\"\\\\\\n\\t\\u0001\\u001f caf\xc3\xa9");
+        CHECK(json_ascii_escape(std::string{"caf\xc3\xa9 \xe2\x82\xac \xf0\x9f\x98\x80 \xff"}) == "caf\\u00e9 \\u20ac \\ud83d\\ude00 \\ufffd");
+        CHECK(json_ascii_escape(std::wstring{L"caf\u00e9 \"x\""}) == L"caf\\u00e9 \\\"x\\\"");
+    }
+
+    SECTION("url") {
+        CHECK(url_escape(std::string{"a b&c=d/e?f~g.h_i-j\xc3\xa9"}) == "a%20b%26c%3Dd%2Fe%3Ff~g.h_i-j%C3%A9");
+        CHECK(url_escape(std::wstring{L"caf\u00e9 \u20ac"}) == L"caf%C3%A9%20%E2%82%AC");
+
+        // each byte of a narrow string needs room for %XX only
+        const std::string bytes(64, '\xe9');
+        std::string out;
+        out.reserve(bytes.size() * 3);
+        const std::size_t capacity = out.capacity();
+        url_escape_append(bytes, out);
+        CHECK(out.size() == bytes.size() * 3);
+        CHECK(out.capacity() == capacity);
+    }
+
+    SECTION("xml_attribute") {
+        CHECK(xml_attribute_escape(std::string{"a<b>&\"c\"\t'd'\r\n"}) == "a&lt;b&gt;&amp;&quot;c&quot;&#9;&apos;d&apos;&#13;&#10;");
+    }
+
+    SECTION("shell") {
+        CHECK(shell_escape(std::string{"/usr/bin/file-1.txt"}) == "/usr/bin/file-1.txt");
+        CHECK(shell_escape(std::string{}) == "''");
+        CHECK(shell_escape(std::string{"it's $HOME"}) == "'it'\\''s $HOME'");
+    }
+
+    SECTION("blocks") {
+        // each escaper against its scalar character test, across block sizes
+        for (std::size_t size = 1; size <= 70; ++size) {
+            for (std::size_t pos = 0; pos < size; ++pos) {
+                for (const char ch : {'\"', '\\', '\x01', ' ', '\'', '\n', '/', '\x80', '=', '~'}) {
+                    std::string input(size, 'a');
+                    input[pos] = ch;
+                    const std::string rest(size - pos - 1, 'a');
+                    const std::string prefix(pos, 'a');
+                    REQUIRE(json_escape(input) == prefix + json_escape(std::string(1, ch)) + rest);
+                    REQUIRE(url_escape(input) == prefix + url_escape(std::string(1, ch)) + rest);
+                    REQUIRE(xml_attribute_escape(input) == prefix + xml_attribute_escape(std::string(1, ch)) + rest);
+                    REQUIRE((shell_escape(input) == input) == (shell_escape(std::string(1, ch)) == std::string(1, ch)));
+                }
+            }
+        }
+    }
+
+    SECTION("set_escape") {
+        mustache tmpl{"{\"name\": \"{{name}}\"}"};
+        tmpl.set_escape(json_escape_append<mustache::string_type>);
+        CHECK(tmpl.render(data{"name", "a \"quoted\"\nname"}) == "{\"name\": \"a \\\"quoted\\\"\\nname\"}");
+        tmpl.set_custom_escape([](const std::string& s) { return "[" + s + "]"; });
+        CHECK(tmpl.render(data{"name", "x"}) == "{\"name\": \"[x]\"}");
+    }
+
+}
+
+TEST_CASE("escape_benchmark", "[.benchmark]") {
+
+    const auto bench = [](const char* name, void (*escape)(const std::string&, std::string&), const std::string& input) {
+        const int iterations = 2000;
+        std::string out;
+        const auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < iterations; ++i) {
+            out.clear();
+            escape(input, out);
+        }
+        const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        const double bytes = static_cast<double>(input.size()) * iterations;
+        std::cout << name << ": " << (bytes / elapsed.count() / 1e9) << " GB/s (" << out.size() << " bytes)" << std::endl;
+    };
+
+    std::string clean;
+    std::string mixed;
+    for (int i = 0; i < 4096; ++i) {
+        clean.append("The quick brown fox jumps over the lazy dog. ");
+        mixed.append("<p class=\"x\">Tom & 'Jerry' / caf\xc3\xa9 a=b</p>\n");
+    }
+    for (const auto& input : {std::make_pair("clean", clean), std::make_pair("mixed", mixed)}) {
+        std::cout << input.first << std::endl;
+        bench("  html_escape", html_escape_append<std::string>, input.second);
+        bench("  xml_attribute_escape", xml_attribute_escape_append<std::string>, input.second);
+        bench("  json_escape", json_escape_append<std::string>, input.second);
+        bench("  json_ascii_escape", json_ascii_escape_append<std::string>, input.second);
+        bench("  url_escape", url_escape_append<std::string>, input.second);
+        bench("  shell_escape", shell_escape_append<std::string>, input.second);
+    }
+
+}
+
+TEST_CASE("escaped_strings") {
+
+    SECTION("safe") {
+        data dat{"html", "<b>bold</b>"};
+        data safe{"<i>italic</i>"};
+        safe.set_safe(true);
+        dat.set("safe", safe);
+        mustache tmpl{"{{html}} {{safe}} {{{safe}}}"};
+        CHECK(tmpl.render(dat) == "&lt;b&gt;bold&lt;/b&gt; <i>italic</i> <i>italic</i>");
+        const data copy{dat};
+        CHECK(copy.get("safe")->is_safe());
+    }
+
+    SECTION("cached") {
+        data name{"Tom & Jerry"};
+        name.set_cache_escaped(true);
+        const data dat{"name", name};
+        const auto cached = dat.get("name");
+        mustache tmpl{"{{name}}|{{name}}"};
+        CHECK(tmpl.render(dat) == "Tom &amp; Jerry|Tom &amp; Jerry");
+        const std::string* escaped = &cached->escaped_string_value(html_escape_append<std::string>);
+        CHECK(*escaped == "Tom &amp; Jerry");
+        CHECK(tmpl.render(dat) == "Tom &amp; Jerry|Tom &amp; Jerry");
+        CHECK(&cached->escaped_string_value(html_escape_append<std::string>) == escaped);
+
+        // one cached form per escape function
+        tmpl.set_escape(url_escape_append<std::string>);
+        CHECK(tmpl.render(dat) == "Tom%20%26%20Jerry|Tom%20%26%20Jerry");
+        CHECK(cached->escaped_string_value(html_escape_append<std::string>) == "Tom &amp; Jerry");
+        CHECK(cached->escaped_string_value(url_escape_append<std::string>) == "Tom%20%26%20Jerry");
+
+        // custom escape functions are not cached
+        tmpl.set_custom_escape([](const std::string& s) { return "[" + s + "]"; });
+        CHECK(tmpl.render(dat) == "[Tom & Jerry]|[Tom & Jerry]");
+    }
+
+}
+
+TEST_CASE("render_depth") {
+
+    SECTION("deep_nesting") {
+        // the innermost child must be false, otherwise it resolves to the
+        // child of an outer context
+        data node{"value", "x"};
+        node.set("child", data{data::type::bool_false});
+        for (int i = 0; i < 1000; ++i) {
+            data parent{"value", "x"};
+            parent.set("child", node);
+            node = std::move(parent);
+        }
+        const data dat{"child", node};
+        mustache tmpl{"{{#child}}{{value}}{{>node}}{{/child}}"};
+        tmpl.set_max_depth(5000);
+        const data partials{"node", partial{[]{ return "{{#child}}{{value}}{{>node}}{{/child}}"; }}};
+        context<std::string> ctx{&partials};
+        ctx.push(&dat);
+        CHECK(tmpl.render(ctx) == std::string(1001, 'x'));
+        CHECK(tmpl.is_valid());
+    }
+
+    SECTION("recursive_partial") {
+        mustache tmpl{"{{>self}}"};
+        CHECK(tmpl.max_depth() == 1000);
+        data dat{"self", partial{[]{ return "x{{>self}}"; }}};
+        tmpl.render(dat);
+        CHECK_FALSE(tmpl.is_valid());
+        CHECK(tmpl.error_message() == "Render depth exceeds the maximum of 1000");
+    }
+
+    SECTION("recursive_lambda") {
+        data dat{"f", lambda{[](const std::string&) { return "{{#f}}x{{/f}}"; }}};
+        mustache tmpl{"{{#f}}{{/f}}"};
+        tmpl.set_max_depth(50);
+        tmpl.render(dat);
+        CHECK_FALSE(tmpl.is_valid());
+        CHECK(tmpl.error_message() == "Render depth exceeds the maximum of 50");
+
+        data var{"f", lambda{[](const std::string&) { return "{{f}}"; }}};
+        mustache variable{"{{f}}"};
+        variable.set_max_depth(50);
+        variable.render(var);
+        CHECK_FALSE(variable.is_valid());
+        CHECK(variable.error_message() == "Render depth exceeds the maximum of 50");
+
+        data dat2{"f", lambda2{[](const std::string&, const renderer& render) { return render("{{#f}}x{{/f}}"); }}};
+        mustache tmpl2{"{{#f}}{{/f}}"};
+        tmpl2.set_max_depth(50);
+        tmpl2.render(dat2);
+        CHECK_FALSE(tmpl2.is_valid());
+        CHECK(tmpl2.error_message() == "Render depth exceeds the maximum of 50");
+    }
+
+    SECTION("max_depth") {
+        const data dat{"a", data{"b", data{"c", "x"}}};
+        mustache tmpl{"{{#a}}{{#b}}{{c}}{{/b}}{{/a}}"};
+        tmpl.set_max_depth(2);
+        CHECK(tmpl.render(dat) == "x");
+        CHECK(tmpl.is_valid());
+
+        mustache shallow{"{{#a}}{{#b}}{{c}}{{/b}}{{/a}}"};
+        shallow.set_max_depth(1);
+        shallow.render(dat);
+        CHECK(shallow.error_message() == "Render depth exceeds the maximum of 1");
+    }
+
+    SECTION("lambda") {
+        mustache tmpl{"{{#wrap}}{{#a}}{{.}}{{/a}}{{/wrap}}"};
+        tmpl.set_max_depth(2);
+        data dat{"a", "x"};
+        dat["wrap"] = lambda2{[](const std::string& text, const renderer& render) {
+            return render(text);
+        }};
+        CHECK(tmpl.render(dat) == "x");
+        CHECK(tmpl.is_valid());
+
+        tmpl.set_max_depth(0);
+        tmpl.render(dat);
+        CHECK(tmpl.error_message() == "Render depth exceeds the maximum of 0");
+    }
+
+    SECTION("compiled") {
+        compiled_template compiled{compiled_list_body};
+        compiled.set_max_depth(10);
+        data dat{"items", data::type::list};
+        dat["footer"] = partial{[]{ return "{{>footer}}"; }};
+        compiled.render(dat);
+        CHECK_FALSE(compiled.is_valid());
+        CHECK(compiled.error_message() == "Render depth exceeds the maximum of 10");
+    }
+
+}
+
+TEST_CASE("fragment_cache") {
+
+    SECTION("hash") {
+        data a;
+        a.set("x", "1");
+        a.set("y", data{data::type::list});
+        data b;
+        b.set("y", data{data::type::list});
+        b.set("x", "1");
+        CHECK(a.hash() == b.hash());
+        b.set("x", "2");
+        CHECK(a.hash() != b.hash());
+        CHECK(data{"1"}.hash() != data{data::type::bool_true}.hash());
+        data safe{"1"};
+        safe.set_safe(true);
+        CHECK(data{"1"}.hash() != safe.hash());
+        data list1{data::type::list};
+        list1 << data{"a"} << data{"b"};
+        data list2{data::type::list};
+        list2 << data{"b"} << data{"a"};
+        CHECK(list1.hash() != list2.hash());
+        CHECK(a.equals(a));
+        CHECK_FALSE(a.equals(b));
+        b.set("x", "1");
+        CHECK(a.equals(b));
+        CHECK_FALSE(list1.equals(list2));
+        CHECK_FALSE(data{"1"}.equals(safe));
+    }
+
+    SECTION("collision") {
+        // entries of the same hash but other data are misses
+        fragment_cache cache;
+        const data one{"1"};
+        const data two{"2"};
+        fragment_cache::key key{};
+        key.section = fragment_cache::next_section_id();
+        key.hash = 42;
+        key.values.push_back(&one);
+        const auto value = std::make_shared<fragment_cache::fragment>();
+        value->output = "one";
+        cache.insert(key, "s", value);
+        CHECK(cache.find(key) == value);
+        key.values[0] = &two;
+        CHECK(cache.find(key) == nullptr);
+        key.values[0] = nullptr;
+        CHECK(cache.find(key) == nullptr);
+        key.values[0] = &one;
+        key.blank_line = true;
+        CHECK(cache.find(key) == nullptr);
+        CHECK(cache.hits() == 1);
+        CHECK(cache.misses() == 3);
+    }
+
+    SECTION("hits") {
+        auto cache = std::make_shared<fragment_cache>();
+        mustache tmpl{"{{title}}:{{#nav}}<{{name}}>{{/nav}}"};
+        tmpl.set_fragment_cache(cache);
+        data nav{data::type::list};
+        nav << data{"name", "a&b"} << data{"name", "c"};
+        data dat{"nav", nav};
+        dat["title"] = "one";
+        CHECK(tmpl.render(dat) == "one:<a&amp;b><c>");
+        CHECK(cache->misses() == 1);
+        dat["title"] = "two";
+        CHECK(tmpl.render(dat) == "two:<a&amp;b><c>");
+        CHECK(cache->hits() == 1);
+        CHECK(cache->size() > 0);
+
+        // the data of the section is part of the key
+        nav << data{"name", "d"};
+        dat.set("nav", nav);
+        CHECK(tmpl.render(dat) == "two:<a&amp;b><c><d>");
+        CHECK(cache->hits() == 1);
+
+        // and so is the escape function
+        tmpl.set_escape(url_escape_append<std::string>);
+        CHECK(tmpl.render(dat) == "two:<a%26b><c><d>");
+        CHECK(cache->hits() == 1);
+    }
+
+    SECTION("outer_names") {
+        auto cache = std::make_shared<fragment_cache>();
+        mustache tmpl{"{{#user}}{{name}} of {{site}}{{/user}}"};
+        tmpl.set_fragment_cache(cache);
+        data dat{"user", data{"name", "Steve"}};
+        dat["site"] = "a";
+        CHECK(tmpl.render(dat) == "Steve of a");
+        dat["site"] = "b";
+        CHECK(tmpl.render(dat) == "Steve of b");
+        CHECK(tmpl.render(dat) == "Steve of b");
+        CHECK(cache->hits() == 1);
+        CHECK(cache->misses() == 2);
+    }
+
+    SECTION("standalone_lines") {
+        const std::string input{"<ul>\n  {{#items}}\n  <li>{{.}}</li>\n  {{/items}}\n</ul>\n{{#items}}{{.}}{{/items}}"};
+        auto cache = std::make_shared<fragment_cache>();
+        mustache cached{input};
+        cached.set_fragment_cache(cache);
+        mustache tmpl{input};
+        data items{data::type::list};
+        items << data{"a"} << data{"b"};
+        const data dat{"items", items};
+        const std::string expected{tmpl.render(dat)};
+        CHECK(expected == "<ul>\n  <li>a</li>\n  <li>b</li>\n</ul>\nab");
+        CHECK(cached.render(dat) == expected);
+        CHECK(cached.render(dat) == expected);
+        CHECK(cache->hits() == 2);
+    }
+
+    SECTION("enclosing_item") {
+        // {{.}} in an inverted section over a missing name reads the item
+        // of the enclosing list, which is part of the key then
+        const std::string input{"{{#ls}}{{^m}}{{.}}{{/m}}{{/ls}}"};
+        auto cache = std::make_shared<fragment_cache>();
+        mustache tmpl{input};
+        tmpl.set_fragment_cache(cache, {"m"});
+        const data dat{"ls", list{"a", "b", "c", "b"}};
+        CHECK(tmpl.render(dat) == "abcb");
+        CHECK(cache->hits() == 1);
+        CHECK(tmpl.render(dat) == "abcb");
+        CHECK(cache->hits() == 5);
+    }
+
+    SECTION("selected_sections") {
+        auto cache = std::make_shared<fragment_cache>();
+        mustache tmpl{"{{#a}}{{x}}{{/a}}{{#b}}{{x}}{{/b}}"};
+        tmpl.set_fragment_cache(cache, {"b"});
+        data dat{"x", "1"};
+        dat["a"] = true;
+        dat["b"] = true;
+        CHECK(tmpl.render(dat) == "11");
+        CHECK(tmpl.render(dat) == "11");
+        CHECK(cache->hits() == 1);
+        CHECK(cache->misses() == 1);
+    }
+
+    SECTION("not_cached") {
+        auto cache = std::make_shared<fragment_cache>();
+        mustache tmpl{"{{#a}}{{>p}}{{/a}}{{#b}}{{l}}{{/b}}"};
+        tmpl.set_fragment_cache(cache);
+        data dat{"a", true};
+        dat["b"] = true;
+        dat["p"] = partial{[]{ return "p"; }};
+        int calls = 0;
+        dat["l"] = lambda{[&calls](const std::string&) {
+            return std::to_string(++calls);
+        }};
+        CHECK(tmpl.render(dat) == "p1");
+        CHECK(tmpl.render(dat) == "p2");
+        CHECK(cache->hits() == 0);
+        CHECK(cache->size() == 0);
+    }
+
+    SECTION("invalidation") {
+        auto cache = std::make_shared<fragment_cache>(8);
+        mustache tmpl{"{{#a}}{{.}}{{/a}}{{#b}}{{.}}{{/b}}"};
+        tmpl.set_fragment_cache(cache);
+        data dat{"a", "12345"};
+        dat["b"] = "6789";
+        CHECK(tmpl.render(dat) == "123456789");
+        // the least recently used section is evicted to stay within 8
+        CHECK(cache->size() == 4);
+        cache->erase_section("a");
+        CHECK(cache->size() == 4);
+        cache->erase_section("b");
+        CHECK(cache->size() == 0);
+        CHECK(tmpl.render(dat) == "123456789");
+        CHECK(cache->size() == 4);
+        cache->clear();
+        CHECK(cache->size() == 0);
+
+        tmpl.set_fragment_cache(nullptr);
+        CHECK(tmpl.render(dat) == "123456789");
+        CHECK(cache->size() == 0);
+    }
+
+}
+
+TEST_CASE("incremental_render") {
+
+    const std::string input{"<h1>{{title}}</h1>\n{{#items}}\n  <li>{{name}}: {{count}}</li>\n{{/items}}\n<p>{{user.name}} {{footer}}</p>\n"};
+
+    data items{data::type::list};
+    items << object{{"name", "a"}, {"count", "1"}} << object{{"name", "b"}, {"count", "2"}};
+    data dat{"title", "Status"};
+    dat.set("items", items);
+    dat.set("user", data{"name", "Steve"});
+    dat.set("footer", "bye");
+
+    SECTION("initial") {
+        incremental_render render{mustache{input}, dat};
+        CHECK(render.is_valid());
+        CHECK(render.output() == mustache{input}.render(dat));
+        CHECK(render.segment_count() > 3);
+    }
+
+    SECTION("edits") {
+        mustache tmpl{input};
+        incremental_render render{tmpl, dat};
+        const std::string before{render.output()};
+
+        CHECK(render.set("user.name", "Jill"));
+        const auto edits = render.update();
+        REQUIRE(edits.size() == 1);
+        std::string applied{before};
+        applied.replace(edits[0].offset, edits[0].length, edits[0].text);
+        CHECK(applied == render.output());
+        CHECK(render.output() == "<h1>Status</h1>\n  <li>a: 1</li>\n  <li>b: 2</li>\n<p>Jill bye</p>\n");
+
+        // nothing changed
+        CHECK(render.update().empty());
+
+        data changed_items{data::type::list};
+        changed_items << object{{"name", "a"}, {"count", "5"}};
+        CHECK(render.set("items", changed_items));
+        CHECK(render.set("title", "Now"));
+        const auto more_edits = render.update();
+        CHECK(more_edits.size() == 2);
+        CHECK(more_edits[0].offset < more_edits[1].offset);
+        CHECK(render.output() == "<h1>Now</h1>\n  <li>a: 5</li>\n<p>Jill bye</p>\n");
+
+        CHECK(render.remove("footer"));
+        CHECK_FALSE(render.remove("footer"));
+        CHECK_FALSE(render.remove("missing.name"));
+        render.update();
+        CHECK(render.output() == "<h1>Now</h1>\n  <li>a: 5</li>\n<p>Jill </p>\n");
+        CHECK(render.output() == tmpl.render(render.data()));
+    }
+
+    SECTION("dependencies") {
+        incremental_render render{mustache{"{{#a}}{{b.c}}{{/a}}{{.}}{{>p}}{{user.name}}"}, data{}};
+        REQUIRE(render.segment_count() == 4);
+        CHECK(render.segment_dependencies(0).depends_on("b"));
+        CHECK(render.segment_dependencies(0).depends_on("a.b.c.d"));
+        CHECK_FALSE(render.segment_dependencies(0).depends_on("c"));
+        CHECK(render.segment_dependencies(1).depends_on("c"));
+        CHECK(render.segment_dependencies(2).depends_on("c"));
+        CHECK(render.segment_dependencies(3).depends_on("user"));
+        CHECK_FALSE(render.segment_dependencies(3).depends_on("user.email"));
+        CHECK(render.set("a.x.y", "1"));
+        data not_object{data::type::list};
+        CHECK(render.set("l", not_object));
+        CHECK_FALSE(render.set("l.x", "1"));
+    }
+
+    SECTION("unaffected") {
+        // output is passed on by line, with the segment ending the line
+        mustache tmpl{"{{#user}}{{name}}{{/user}}\n{{user.email}}\n"};
+        data user{"name", "Steve"};
+        user.set("email", "s@example.com");
+        incremental_render render{tmpl, data{"user", user}};
+        CHECK(render.output() == "Steve\ns@example.com\n");
+        render.set("user.email", "steve@example.com");
+        const auto edits = render.update();
+        REQUIRE(edits.size() == 1);
+        CHECK(edits[0].offset == 6);
+        CHECK(edits[0].length == 14);
+        CHECK(edits[0].text == "steve@example.com\n");
+    }
+
+    SECTION("nested_sections") {
+        // a page wrapped in a section is split at the components of its body
+        mustache tmpl{"{{#page}}\n<h1>{{title}}</h1>\n{{#nav}}<b>{{heavy}}</b>{{/nav}}\n<p>{{footer}}</p>\n{{/page}}\n"};
+        int calls = 0;
+        data page{"title", "Home"};
+        page.set("nav", data{"heavy", lambda{[&calls](const std::string&) {
+            return std::to_string(++calls);
+        }}});
+        page.set("footer", "bye");
+        incremental_render render{tmpl, data{"page", page}};
+        CHECK(render.output() == "<h1>Home</h1>\n<b>1</b>\n<p>bye</p>\n");
+        CHECK(render.segment_count() == 2);
+
+        CHECK(render.set("page.footer", "later"));
+        const auto edits = render.update();
+        REQUIRE(edits.size() == 1);
+        // output is passed on by line
+        CHECK(edits[0].offset == 23);
+        CHECK(edits[0].length == 11);
+        CHECK(edits[0].text == "<p>later</p>\n");
+        CHECK(render.output() == "<h1>Home</h1>\n<b>1</b>\n<p>later</p>\n");
+        CHECK(calls == 1);
+
+        // replacing the section value renders the whole section again
+        data other{"title", "Other"};
+        CHECK(render.set("page", other));
+        render.update();
+        CHECK(render.output() == "<h1>Other</h1>\n\n<p></p>\n");
+        CHECK(render.set("page.nav.heavy", "x"));
+        render.update();
+        CHECK(render.output() == tmpl.render(render.data()));
+        CHECK(render.output() == "<h1>Other</h1>\n<b>x</b>\n<p></p>\n");
+        CHECK(render.remove("page"));
+        render.update();
+        CHECK(render.output() == "\n");
+    }
+
+    SECTION("line_state") {
+        // a section turning empty changes whether the next line is standalone
+        const std::string lines{"{{#a}}x{{/a}}{{#b}}\n{{/b}}y\n"};
+        data values{"a", true};
+        values.set("b", true);
+        incremental_render render{mustache{lines}, values};
+        CHECK(render.output() == "x\ny\n");
+        render.set("a", false);
+        render.update();
+        CHECK(render.output() == mustache{lines}.render(render.data()));
+        CHECK(render.output() == "y\n");
+    }
+
+}
+
+TEST_CASE("dependencies") {
+
+    SECTION("paths") {
+        mustache tmpl{"{{title}}{{#items}}{{name}}{{#tags}}{{.}}{{/tags}}{{/items}}{{^empty}}{{user.name}}{{/empty}}{{>footer}}"};
+        const auto deps = tmpl.dependencies();
+        std::vector<std::string> paths;
+        for (const auto& dep : deps.paths) {
+            paths.push_back(dep.path);
+        }
+        CHECK((paths == std::vector<std::string>{"title", "items", "name", "items.name", "tags", "items.tags", "empty", "user.name", "empty.user.name"}));
+        CHECK((deps.partials == std::vector<std::string>{"footer"}));
+        CHECK_FALSE(deps.reads_root);
+
+        CHECK(deps.find("title")->rendered);
+        CHECK(deps.find("items")->section);
+        CHECK(deps.find("items")->is_condition());
+        CHECK_FALSE(deps.find("items.tags")->is_condition());
+        CHECK(deps.find("empty")->inverted);
+        CHECK_FALSE(deps.find("empty")->section);
+        CHECK(deps.find("missing") == nullptr);
+    }
+
+    SECTION("depends_on") {
+        mustache tmpl{"{{#a}}{{b.c}}{{/a}}"};
+        const auto deps = tmpl.dependencies();
+        CHECK(deps.depends_on("a"));
+        CHECK(deps.depends_on("a.b.c"));
+        CHECK(deps.depends_on("b"));
+        CHECK(deps.depends_on("b.c.d"));
+        CHECK_FALSE(deps.depends_on("b.d"));
+        CHECK_FALSE(deps.depends_on("ab"));
+        CHECK(mustache{"{{.}}"}.dependencies().reads_root);
+        CHECK(mustache{"{{>p}}"}.dependencies().depends_on("anything"));
+    }
+
+    SECTION("lazy_sections") {
+        parse_options options;
+        options.lazy_sections = true;
+        mustache tmpl{"{{#a}}{{b}}{{/a}}", options};
+        CHECK(tmpl.dependencies().find("a.b") != nullptr);
+    }
+
+}
+
+TEST_CASE("chunked_render") {
+
+    const std::string input{"<ul>\n{{#items}}\n  <li>{{name}}</li>\n{{/items}}\n</ul>\n{{>footer}}"};
+    data items{data::type::list};
+    for (int i = 0; i < 50; ++i) {
+        items << data{"name", "item <" + std::to_string(i) + ">"};
+    }
+    data dat{"items", items};
+    dat["footer"] = partial{[]{ return "{{#items}}{{name}}{{/items}}"; }};
+
+    SECTION("buffer") {
+        mustache tmpl{input};
+        const std::string expected{mustache{input}.render(dat)};
+        for (std::size_t capacity : {1, 7, 64, 100000}) {
+            chunked_render render{tmpl, dat};
+            std::string output;
+            std::vector<char> buffer(capacity);
+            std::size_t count;
+            do {
+                count = render.next_chunk(buffer.data(), capacity);
+                CHECK(count <= capacity);
+                output.append(buffer.data(), count);
+            } while (count == capacity);
+            CHECK(render.done());
+            CHECK(output == expected);
+        }
+    }
+
+    SECTION("strings") {
+        mustache tmpl{input};
+        chunked_render render{tmpl, dat};
+        std::string output;
+        std::size_t chunks = 0;
+        for (std::string chunk{render.next_chunk()}; !chunk.empty(); chunk = render.next_chunk()) {
+            output.append(chunk);
+            ++chunks;
+        }
+        CHECK(output == mustache{input}.render(dat));
+        CHECK(chunks > 50);
+        CHECK(render.is_valid());
+    }
+
+    SECTION("errors") {
+        mustache invalid{"{{#a}}"};
+        chunked_render render{invalid, dat};
+        CHECK_FALSE(render.is_valid());
+        CHECK(render.done());
+        CHECK(render.next_chunk().empty());
+
+        mustache tmpl{"x\n{{>self}}"};
+        data self{"self", partial{[]{ return "{{>self}}"; }}};
+        chunked_render recursive{tmpl, self};
+        CHECK(recursive.next_chunk() == "x\n");
+        CHECK(recursive.next_chunk().empty());
+        CHECK(recursive.error_message() == "Render depth exceeds the maximum of 1000");
+    }
+
+    SECTION("long_line") {
+        // a line without line breaks is passed on as it is rendered
+        data many{data::type::list};
+        for (int i = 0; i < 100000; ++i) {
+            many << data{std::to_string(i % 10)};
+        }
+        mustache tmpl{"  {{#items}}<{{.}}>{{/items}}\n"};
+        const data values{"items", many};
+        chunked_render render{tmpl, values};
+        std::string output;
+        std::size_t largest = 0;
+        for (std::string chunk{render.next_chunk()}; !chunk.empty(); chunk = render.next_chunk()) {
+            largest = std::max(largest, chunk.size());
+            output.append(chunk);
+        }
+        CHECK(output == tmpl.render(values));
+        CHECK(output.size() == 300003);
+        CHECK(largest <= 8);
+    }
+
+    SECTION("fragment_cache") {
+        mustache tmpl{input};
+        tmpl.set_fragment_cache(std::make_shared<fragment_cache>());
+        const std::string expected{mustache{input}.render(dat)};
+        for (int i = 0; i < 2; ++i) {
+            chunked_render render{tmpl, dat};
+            std::string output;
+            for (std::string chunk{render.next_chunk()}; !chunk.empty(); chunk = render.next_chunk()) {
+                output.append(chunk);
+            }
+            CHECK(output == expected);
+        }
+        // the section of the partial is not cached
+        CHECK(tmpl.fragment_cache()->hits() == 1);
+    }
+
+}
+
+TEST_CASE("vectored_output") {
+
+    const std::string input{
+        "<h1>{{title}}</h1>\n"
+        "{{#items}}\n"
+        "  <li>{{name}} {{{raw}}}</li>\n"
+        "{{/items}}\n"
+        "{{^items}}none{{/items}}\n"
+        "{{>footer}}\n"
+        "  {{#hidden}}\n"
+        "  {{/hidden}}\n"
+        "{{=<% %>=}}<%title%>"};
+    data dat{"title", "A & B"};
+    data items{data::type::list};
+    for (int i = 0; i < 5; ++i) {
+        data item{"name", "<" + std::to_string(i) + ">"};
+        item.set("raw", "<b>" + std::to_string(i) + "</b>");
+        items << item;
+    }
+    dat.set("items", items);
+    dat.set("hidden", data{data::type::bool_false});
+    dat.set("footer", partial{[]{ return "  {{#items}}{{/items}}\n<footer>{{title}}</footer>\n"; }});
+
+    SECTION("output") {
+        mustache tmpl{input};
+        vectored_output out;
+        tmpl.render_vectored(dat, out);
+        CHECK(tmpl.is_valid());
+        CHECK(out.str() == mustache{input}.render(dat));
+        CHECK(out.size() == out.str().size());
+        std::size_t size = 0;
+        for (const auto& seg : out.segments()) {
+            CHECK(seg.size > 0);
+            size += seg.size;
+        }
+        CHECK(size == out.size());
+    }
+
+    SECTION("references") {
+        mustache tmpl{"{{{a}}}-{{b}}-{{c}}"};
+        data values{"a", "<raw>"};
+        values.set("b", "plain");
+        values.set("c", "x<y");
+        vectored_output out;
+        tmpl.render_vectored(values, out);
+        CHECK(out.str() == "<raw>-plain-x&lt;y");
+        REQUIRE(out.segments().size() == 5);
+        CHECK(out.segments()[0].data == values.get("a")->string_value().data());
+        CHECK(out.segments()[2].data == values.get("b")->string_value().data());
+        // only the escaped value is copied
+        CHECK(out.scratch_size() == std::string{"x&lt;y"}.size());
+
+        tmpl.render_vectored(data{"c", "z"}, out);
+        CHECK(out.str() == "--z");
+    }
+
+    SECTION("lambdas") {
+        mustache tmpl{"{{#wrap}}{{x}}{{/wrap}} {{plain}}"};
+        data values{"x", "1"};
+        values.set("wrap", lambda2{[](const std::string& text, const renderer& render) { return "[" + render(text) + "]"; }});
+        values.set("plain", lambda{[](const std::string&) { return "{{x}}<"; }});
+        vectored_output out;
+        tmpl.render_vectored(values, out);
+        CHECK(out.str() == "[1] 1&lt;");
+        CHECK(out.str() == tmpl.render(values));
+    }
+
+    SECTION("errors") {
+        mustache invalid{"{{#a}}"};
+        vectored_output out;
+        invalid.render_vectored(dat, out);
+        CHECK(out.segments().empty());
+
+        mustache tmpl{"x\n{{>self}}"};
+        tmpl.render_vectored(data{"self", partial{[]{ return "{{>self}}"; }}}, out);
+        CHECK_FALSE(tmpl.is_valid());
+        CHECK(tmpl.error_message() == "Render depth exceeds the maximum of 1000");
+    }
+
+}
+
+TEST_CASE("render_to") {
+
+    mustache tmpl{"{{#items}}\n<{{.}}>\n{{/items}}\nend"};
+    data dat{"items", data{data::type::list}};
+    for (int i = 0; i < 3; ++i) {
+        dat["items"].push_back(std::to_string(i));
+    }
+    const std::string expected{tmpl.render(dat)};
+
+    SECTION("fits") {
+        char buf[64];
+        CHECK(tmpl.render_to(dat, buf, sizeof(buf)) == expected.size());
+        CHECK(std::string{buf} == expected);
+    }
+
+    SECTION("exact") {
+        std::vector<char> buf(expected.size() + 1, 'x');
+        CHECK(tmpl.render_to(dat, buf.data(), buf.size()) == expected.size());
+        CHECK(std::string{buf.data()} == expected);
+    }
+
+    SECTION("truncated") {
+        for (std::size_t cap = 1; cap <= expected.size(); ++cap) {
+            std::vector<char> buf(cap + 1, 'x');
+            CHECK(tmpl.render_to(dat, buf.data(), cap) == expected.size());
+            CHECK(std::string{buf.data()} == expected.substr(0, cap - 1));
+            CHECK(buf[cap] == 'x');
+        }
+    }
+
+    SECTION("size only") {
+        CHECK(tmpl.render_to(dat, nullptr, 0) == expected.size());
+    }
+
+    SECTION("invalid") {
+        mustache invalid{"{{#a}}"};
+        char buf[4] = "abc";
+        CHECK(invalid.render_to(dat, buf, sizeof(buf)) == 0);
+        CHECK(std::string{buf}.empty());
+    }
+
+}
+
+TEST_CASE("measure") {
+
+    const std::string input{
+        "<h1>{{title}}</h1>\n"
+        "{{#items}}\n"
+        "  <li>{{name}}</li>\n"
+        "{{/items}}\n"
+        "{{>footer}}"};
+    data dat{"title", "A & B"};
+    data items{data::type::list};
+    for (int i = 0; i < 20; ++i) {
+        items << data{"name", "<" + std::to_string(i) + ">"};
+    }
+    dat.set("items", items);
+    dat.set("footer", partial{[]{ return "  {{#items}}{{/items}}\n<footer>{{title}}</footer>\n"; }});
+
+    SECTION("size") {
+        mustache tmpl{input};
+        const measurement m{tmpl.measure(dat)};
+        const std::string expected{tmpl.render(dat)};
+        CHECK(m.size() == expected.size());
+        const std::string output{tmpl.render_measured(dat, m)};
+        CHECK(output == expected);
+        CHECK(output.capacity() >= m.size());
+    }
+
+    SECTION("lambdas") {
+        mustache tmpl{"{{counter}}\n{{#wrap}}{{counter}}{{/wrap}}\n{{counter}}"};
+        int calls = 0;
+        data values{"counter", lambda{[&calls](const std::string&) {
+            ++calls;
+            return std::string(static_cast<std::size_t>(calls), '*');
+        }}};
+        values.set("wrap", lambda2{[](const std::string& text, const renderer& render) {
+            return "[" + render(text) + "]";
+        }});
+        const measurement m{tmpl.measure(values)};
+        CHECK(calls == 3);
+        CHECK(m.size() == std::string{"*\n[**]\n***"}.size());
+        CHECK(tmpl.render_measured(values, m) == "*\n[**]\n***");
+        CHECK(calls == 3);
+        // without the measurement the lambdas are called again
+        CHECK(tmpl.render(values) == "****\n[*****]\n******");
+    }
+
+    SECTION("partials") {
+        mustache tmpl{"{{>p}}-{{counter}}-{{>p}}"};
+        int calls = 0;
+        data values{"p", partial{[&calls] {
+            ++calls;
+            return std::string(static_cast<std::size_t>(calls), '+') + "{{counter}}";
+        }}};
+        values.set("counter", lambda{[&calls](const std::string&) {
+            ++calls;
+            return std::to_string(calls);
+        }});
+        const measurement m{tmpl.measure(values)};
+        CHECK(calls == 5);
+        CHECK(m.size() == std::string{"+2-3-++++5"}.size());
+        CHECK(tmpl.render_measured(values, m) == "+2-3-++++5");
+        CHECK(calls == 5);
+    }
+
+    SECTION("invalid") {
+        mustache tmpl{"{{#a}}"};
+        const measurement m{tmpl.measure(dat)};
+        CHECK(m.size() == 0);
+        CHECK(tmpl.render_measured(dat, m).empty());
+    }
+
+}
+
+TEST_CASE("output_digest") {
+
+    const auto digest_of = [](const std::string& str) {
+        output_digest digest;
+        digest.update(str);
+        return digest.hex();
+    };
+
+    SECTION("xxh64") {
+        CHECK(digest_of("") == "ef46db3751d8e999");
+        CHECK(digest_of("a") == "d24ec4f1a98c6e5b");
+        CHECK(digest_of("abc") == "44bc2cf5ad770999");
+        CHECK(digest_of("Nobody inspects the spammish repetition") == "fbcea83c8a378bf1");
+    }
+
+    SECTION("chunks") {
+        std::string input;
+        for (int i = 0; i < 200; ++i) {
+            input.append(std::to_string(i * 7919));
+        }
+        output_digest whole;
+        whole.update(input);
+        for (std::size_t step = 1; step < 70; step += 3) {
+            output_digest digest;
+            for (std::size_t i = 0; i < input.size(); i += step) {
+                digest.update(input.substr(i, step));
+            }
+            CHECK(digest.value() == whole.value());
+            CHECK(digest.size() == input.size());
+        }
+        whole.reset();
+        CHECK(whole.hex() == "ef46db3751d8e999");
+    }
+
+    SECTION("render") {
+        mustache tmpl{"{{#items}}\n<li>{{.}}</li>\n{{/items}}\n"};
+        data dat{"items", data{data::type::list}};
+        for (int i = 0; i < 100; ++i) {
+            dat["items"].push_back(std::to_string(i));
+        }
+        const std::string expected{tmpl.render(dat)};
+
+        output_digest digest;
+        std::string output;
+        tmpl.render(dat, digest.sink([&output](const std::string& str) {
+            output.append(str);
+        }));
+        CHECK(output == expected);
+        CHECK(digest.hex() == digest_of(expected));
+
+        output_digest only;
+        tmpl.render(dat, only.sink());
+        CHECK(only.value() == digest.value());
+        CHECK(only.size() == expected.size());
+    }
+
+}
+
+TEST_CASE("page_buffer") {
+
+    mustache tmpl{"{{#items}}\n<li>{{.}}</li>\n{{/items}}\n"};
+    data dat{"items", data{data::type::list}};
+    for (int i = 0; i < 500; ++i) {
+        dat["items"].push_back(std::to_string(i));
+    }
+    const std::string expected{tmpl.render(dat)};
+    const auto pool = std::make_shared<page_pool>(100, 4);
+
+    SECTION("pages") {
+        page_buffer buffer{pool};
+        tmpl.render(dat, buffer.sink());
+        CHECK(buffer.size() == expected.size());
+        CHECK(buffer.str() == expected);
+        CHECK(buffer.page_count() == (expected.size() + 99) / 100);
+        std::string joined;
+        for (const auto& page : buffer) {
+            CHECK(page.size <= 100);
+            joined.append(page.data, page.size);
+        }
+        CHECK(joined == expected);
+
+        buffer.clear();
+        CHECK(buffer.page_count() == 0);
+        CHECK(pool->free_pages() == 4);
+        tmpl.render(dat, buffer.sink());
+        CHECK(buffer.str() == expected);
+    }
+
+    SECTION("flush") {
+        std::string output;
+        std::size_t writes = 0;
+        std::size_t max_pages = 0;
+        page_buffer* current = nullptr;
+        page_buffer buffer{pool, [&](const char* data, std::size_t size) {
+            output.append(data, size);
+            ++writes;
+            max_pages = std::max(max_pages, current->page_count());
+            return true;
+        }, 3};
+        current = &buffer;
+        tmpl.render(dat, buffer.sink());
+        CHECK(output.size() < expected.size());
+        CHECK(buffer.flush());
+        CHECK(output == expected);
+        CHECK(buffer.page_count() == 0);
+        CHECK(buffer.size() == expected.size());
+        CHECK(writes == (expected.size() + 99) / 100);
+        CHECK(max_pages <= 3);
+    }
+
+    SECTION("single_line") {
+        // output without line breaks is flushed as it is rendered
+        mustache line{"{{#items}}<li>{{.}}</li>{{/items}}{{#end}}{{/end}}"};
+        std::string output;
+        page_buffer buffer{pool, [&output](const char* data, std::size_t size) {
+            output.append(data, size);
+            return true;
+        }, 3};
+        std::size_t flushed_before_end = 0;
+        data values{dat};
+        values["end"] = lambda2{[&](const std::string&, const renderer&) {
+            flushed_before_end = output.size();
+            return std::string{};
+        }};
+        line.render(values, buffer.sink());
+        CHECK(buffer.flush());
+        CHECK(flushed_before_end >= output.size() - 300);
+        CHECK(output == line.render(values));
+    }
+
+    SECTION("failure") {
+        std::size_t writes = 0;
+        page_buffer buffer{pool, [&writes](const char*, std::size_t) {
+            ++writes;
+            return false;
+        }};
+        tmpl.render(dat, buffer.sink());
+        CHECK(buffer.failed());
+        CHECK_FALSE(buffer.flush());
+        CHECK(writes == 1);
+        CHECK(buffer.page_count() == 0);
+    }
+
+}
+
+#if defined(KAINJOW_MUSTACHE_POSIX)
+
+TEST_CASE("fd_sink") {
+
+    mustache tmpl{"{{#items}}\n{{.}},{{.}}\n{{/items}}\n"};
+    data dat{"items", data{data::type::list}};
+    for (int i = 0; i < 5000; ++i) {
+        dat["items"].push_back(std::to_string(i));
+    }
+    const std::string expected{tmpl.render(dat)};
+
+    char path[] = "/tmp/mustache_fd_sink_XXXXXX";
+    const int fd = ::mkstemp(path);
+    REQUIRE(fd != -1);
+    ::unlink(path);
+    const auto contents = [fd]() {
+        std::string str;
+        char buf[4096];
+        ::lseek(fd, 0, SEEK_SET);
+        for (ssize_t n; (n = ::read(fd, buf, sizeof(buf))) > 0;) {
+            str.append(buf, static_cast<std::size_t>(n));
+        }
+        return str;
+    };
+
+    SECTION("buffered") {
+        fd_sink sink{fd, 4096};
+        tmpl.render(dat, sink.sink());
+        CHECK(sink.finish());
+        CHECK(contents() == expected);
+        CHECK(sink.written() == expected.size());
+        CHECK(sink.writes() == (expected.size() + 4095) / 4096);
+    }
+
+    SECTION("large pieces") {
+        const std::string large(10000, 'x');
+        fd_sink sink{fd, 4096};
+        sink.write("abc");
+        sink.write(large);
+        sink.write("def");
+        sink.set_sync(true);
+        CHECK(sink.finish());
+        CHECK(contents() == "abc" + large + "def");
+        CHECK(sink.writes() == 2);
+    }
+
+    SECTION("write after finish") {
+        {
+            fd_sink sink{fd, 4096};
+            sink.write("abc");
+            CHECK(sink.finish());
+            sink.write("def");
+            CHECK(contents() == "abc");
+            CHECK(sink.finish());
+            CHECK(contents() == "abcdef");
+            sink.write("ghi");
+        }
+        // the destructor writes what came after the last finish()
+        CHECK(contents() == "abcdefghi");
+    }
+
+    SECTION("direct") {
+        fd_sink sink{fd, 5000};
+        sink.set_direct(true, 512);
+        tmpl.render(dat, sink.sink());
+        CHECK(sink.written() % 512 == 0);
+        CHECK(sink.written() % 5120 == 0);
+        CHECK(sink.finish());
+        CHECK(contents() == expected);
+    }
+
+    SECTION("errors") {
+        fd_sink sink{-1, 16};
+        sink.write(expected);
+        CHECK(sink.failed());
+        CHECK(sink.error() == EBADF);
+        CHECK_FALSE(sink.finish());
+        CHECK(sink.written() == 0);
+    }
+
+    ::close(fd);
+
+}
+
+#endif
+
+TEST_CASE("flush_hints") {
+
+    SECTION("static_prefix") {
+        CHECK(mustache{"<!doctype html>\n<head>\n<title>{{title}}</title>\n"}.static_prefix() == "<!doctype html>\n<head>\n<title>");
+        CHECK(mustache{"<p>\n  {{#a}}\n{{/a}}"}.static_prefix() == "<p>\n");
+        CHECK(mustache{"no tags\nat all"}.static_prefix() == "no tags\nat all");
+        CHECK(mustache{"{{a}}\n"}.static_prefix().empty());
+        CHECK(mustache{"{{#a}}"}.static_prefix().empty());
+        CHECK(mustache{"  {{! comment }}\n"}.static_prefix().empty());
+        // text before a tag on its line keeps it from being standalone
+        CHECK(mustache{"<a>{{! comment }}\n"}.static_prefix() == "<a>");
+        CHECK(mustache{"<!doctype html><head></head><body>{{#slow}}x{{/slow}}"}.static_prefix() == "<!doctype html><head></head><body>");
+    }
+
+    SECTION("flush points") {
+        mustache tmpl{
+            "<!doctype html>\n"
+            "<head>\n"
+            "<title>{{title}}</title>\n"
+            "{{>header}}\n"
+            "{{#slow}}body{{/slow}}\n"
+            "{{fast}}\n"
+            "{{count}}\n"};
+        data dat{"title", "T"};
+        dat.set("fast", "F");
+        dat.set("header", partial{[]{ return "<h1>{{title}}</h1>"; }});
+        dat.set("slow", lambda{[](const std::string& text) { return "<" + text + ">"; }});
+        dat.set("count", lambda{[](const std::string&) { return "3"; }});
+
+        std::string output;
+        std::vector<std::string> flushed;
+        tmpl.render(dat, [&output](const std::string& str) {
+            output.append(str);
+        }, [&output, &flushed]() {
+            flushed.push_back(output);
+        });
+        CHECK(output == tmpl.render(dat));
+        CHECK(tmpl.static_prefix() == "<!doctype html>\n<head>\n<title>");
+        const std::vector<std::string> expected{
+            "<!doctype html>\n<head>\n<title>",
+            "<!doctype html>\n<head>\n<title>T</title>\n",
+            "<!doctype html>\n<head>\n<title>T</title>\n<h1>T</h1>\n",
+            "<!doctype html>\n<head>\n<title>T</title>\n<h1>T</h1>\n<body>\nF\n",
+        };
+        CHECK(flushed == expected);
+    }
+
+    SECTION("partial lines") {
+        // a page without line breaks is flushed up to the slow section
+        mustache tmpl{"<!doctype html><head></head><body>{{#slow}}x{{/slow}} {{#slow}}y{{/slow}}  "};
+        data dat{"slow", lambda{[](const std::string& text) { return "<" + text + ">"; }}};
+        std::string output;
+        std::vector<std::string> flushed;
+        tmpl.render(dat, [&output](const std::string& str) {
+            output.append(str);
+        }, [&output, &flushed]() {
+            flushed.push_back(output);
+        });
+        CHECK(output == tmpl.render(dat));
+        const std::vector<std::string> expected{
+            "<!doctype html><head></head><body>",
+            "<!doctype html><head></head><body><x> ",
+        };
+        CHECK(flushed == expected);
+        CHECK(flushed[0] == tmpl.static_prefix());
+    }
+
+}
+
+TEST_CASE("async_render") {
+
+    const std::string input{
+        "<h1>{{title}}</h1>\n"
+        "{{#user}}\n"
+        "<p>{{name}}</p>\n"
+        "{{/user}}\n"
+        "<ul>\n"
+        "{{#items}}\n"
+        "<li>{{.}}</li>\n"
+        "{{/items}}\n"
+        "</ul>\n"
+        "{{footer}}"};
+    data full{"title", "T"};
+    full.set("user", data{"name", "N"});
+    data items{data::type::list};
+    items << data{"a"} << data{"b"};
+    full.set("items", items);
+    full.set("footer", "F");
+    const std::string expected{mustache{input}.render(full)};
+
+    SECTION("in order") {
+        std::promise<data> user;
+        std::promise<data> list;
+        int footer_calls = 0;
+        data dat{"title", "T"};
+        dat.set("footer", lambda{[&footer_calls](const std::string&) {
+            ++footer_calls;
+            return "F";
+        }});
+        async_render render{mustache{input}, dat};
+        render.set_future("user", user.get_future().share());
+        render.set_future("items", list.get_future().share());
+        CHECK(render.pending() == 2);
+
+        std::string output;
+        const auto handler = [&output](const std::string& str) {
+            output.append(str);
+        };
+        CHECK_FALSE(render.poll(handler));
+        CHECK(output == "<h1>T</h1>\n");
+        // the footer is rendered ahead and kept
+        CHECK(footer_calls == 1);
+
+        list.set_value(items);
+        CHECK_FALSE(render.poll(handler));
+        CHECK(output == "<h1>T</h1>\n");
+        CHECK(render.pending() == 1);
+
+        user.set_value(data{"name", "N"});
+        CHECK(render.poll(handler));
+        CHECK(render.done());
+        CHECK(output == expected);
+        CHECK(footer_calls == 1);
+        CHECK(render.pending() == 0);
+    }
+
+    SECTION("wait") {
+        data dat{"title", "T"};
+        dat.set("footer", "F");
+        async_render render{mustache{input}, dat};
+        render.set_future("user.name", std::async(std::launch::async, [] {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            return data{"N"};
+        }).share());
+        render.set_future("items", std::async(std::launch::async, [&items] {
+            return data{items};
+        }).share());
+        std::string output;
+        render.wait([&output](const std::string& str) {
+            output.append(str);
+        });
+        CHECK(render.done());
+        CHECK(output == expected);
+    }
+
+    SECTION("nested") {
+        // a page wrapped in a section is split at the components of its body
+        std::promise<data> user;
+        int footer_calls = 0;
+        data page{"title", "T"};
+        page.set("footer", lambda{[&footer_calls](const std::string&) {
+            ++footer_calls;
+            return "F";
+        }});
+        data dat{"page", page};
+        const std::string wrapped{"{{#page}}\n<h1>{{title}}</h1>\n<p>{{user.name}}</p>\n{{footer}}\n{{/page}}\n"};
+        async_render render{mustache{wrapped}, dat};
+        render.set_future("page.user", user.get_future().share());
+        std::string output;
+        const auto handler = [&output](const std::string& str) {
+            output.append(str);
+        };
+        CHECK_FALSE(render.poll(handler));
+        CHECK(output == "<h1>T</h1>\n");
+        CHECK(footer_calls == 1);
+
+        user.set_value(data{"name", "N"});
+        CHECK(render.poll(handler));
+        CHECK(output == "<h1>T</h1>\n<p>N</p>\nF\n");
+        CHECK(footer_calls == 1);
+
+        // a pending section value holds back the whole section
+        std::promise<data> pending_page;
+        async_render whole{mustache{wrapped}, data{"page", page}};
+        whole.set_future("page", pending_page.get_future().share());
+        output.clear();
+        CHECK_FALSE(whole.poll(handler));
+        CHECK(output.empty());
+        pending_page.set_value(data{"title", "P"});
+        CHECK(whole.poll(handler));
+        CHECK(output == "<h1>P</h1>\n<p></p>\n\n");
+    }
+
+    SECTION("line state") {
+        // the part after the pending one does not start on a new line
+        std::promise<data> value;
+        mustache tmpl{"a{{x}}  {{#s}}\n{{/s}}b\n"};
+        async_render render{tmpl, data{"s", true}};
+        render.set_future("x", value.get_future().share());
+        std::string output;
+        const auto handler = [&output](const std::string& str) {
+            output.append(str);
+        };
+        CHECK_FALSE(render.poll(handler));
+        value.set_value(data{""});
+        CHECK(render.poll(handler));
+        data dat{"x", ""};
+        dat.set("s", true);
+        CHECK(output == tmpl.render(dat));
+    }
+
+    SECTION("errors") {
+        async_render invalid{mustache{"{{#a}}"}, data{}};
+        CHECK_FALSE(invalid.is_valid());
+        CHECK(invalid.done());
+
+        async_render render{mustache{"x\n{{>self}}"}, data{"self", partial{[]{ return "{{>self}}"; }}}};
+        std::string output;
+        CHECK(render.poll([&output](const std::string& str) {
+            output.append(str);
+        }));
+        CHECK_FALSE(render.is_valid());
+        CHECK(render.error_message() == "Render depth exceeds the maximum of 1000");
+    }
+
+}
+
+TEST_CASE("parallel") {
+
+    data items{data::type::list};
+    for (int i = 0; i < 5000; ++i) {
+        data item{"name", "<" + std::to_string(i) + ">"};
+        item.set("even", i % 2 == 0);
+        items << item;
+    }
+    data dat{"items", items};
+    dat.set("title", "T");
+
+    SECTION("output") {
+        const std::vector<std::string> inputs{
+            "{{#items}}\n<li>{{name}} {{title}}</li>\n{{/items}}\n",
+            "<ul>{{#items}}<li>{{name}}</li>{{/items}}</ul>",
+            "{{#items}}{{name}},{{/items}}",
+            "{{#items}}\n  {{#even}}\n{{name}}\n  {{/even}}\n{{/items}}\nend",
+            "{{#items}}{{#even}}\n{{/even}}{{name}}\n{{/items}}",
+            "{{#items}}{{=<% %>=}}<%name%>\n<%={{ }}=%>{{/items}}",
+            "{{#items}}{{name}}{{^even}}\n{{/even}}{{/items}}",
+        };
+        for (const auto& input : inputs) {
+            mustache serial{input};
+            mustache tmpl{input};
+            tmpl.set_parallel(4, 100);
+            CHECK(tmpl.parallel_threads() == 4);
+            CHECK(tmpl.render(dat) == serial.render(dat));
+        }
+    }
+
+    SECTION("lambdas") {
+        const std::string input{"{{#items}}{{name}}{{upper}}\n{{/items}}"};
+        data values{"items", items};
+        std::thread::id caller{std::this_thread::get_id()};
+        std::atomic<int> other_threads{0};
+        values.set("upper", lambda{[caller, &other_threads](const std::string&) {
+            if (std::this_thread::get_id() != caller) {
+                ++other_threads;
+            }
+            return "!";
+        }});
+        mustache tmpl{input};
+        tmpl.set_parallel(4, 100);
+        const std::string expected{mustache{input}.render(values)};
+        CHECK(tmpl.render(values) == expected);
+        CHECK(other_threads == 0);
+
+        tmpl.set_parallel(4, 100, true);
+        CHECK(tmpl.render(values) == expected);
+        CHECK(other_threads > 0);
+    }
+
+    SECTION("thread pool") {
+        // renders reuse the threads started by set_parallel()
+        const std::string input{"{{#items}}{{name}}{{thread}}\n{{/items}}"};
+        data values{"items", items};
+        std::mutex mutex;
+        std::vector<std::thread::id> threads;
+        values.set("thread", lambda{[&mutex, &threads](const std::string&) {
+            std::lock_guard<std::mutex> lock{mutex};
+            if (std::find(threads.begin(), threads.end(), std::this_thread::get_id()) == threads.end()) {
+                threads.push_back(std::this_thread::get_id());
+            }
+            return "";
+        }});
+        mustache tmpl{input};
+        tmpl.set_parallel(4, 100, true);
+        const std::string expected{mustache{input}.render(values)};
+        for (int i = 0; i < 5; ++i) {
+            CHECK(tmpl.render(values) == expected);
+        }
+        CHECK(threads.size() <= 4);
+    }
+
+    SECTION("nested lists") {
+        // the lists in the items of a list rendered in parallel are not
+        // split, so the first item stays on the calling thread
+        std::thread::id caller{std::this_thread::get_id()};
+        std::atomic<int> other_threads{0};
+        const lambda check{[caller, &other_threads](const std::string&) {
+            if (std::this_thread::get_id() != caller) {
+                ++other_threads;
+            }
+            return "";
+        }};
+        data outer{data::type::list};
+        data first{"items", items};
+        first.set("check", check);
+        outer << first;
+        for (int i = 1; i < 200; ++i) {
+            outer << data{"items", items};
+        }
+        const std::string input{"{{#outer}}{{#items}}{{name}}{{check}}{{/items}}{{/outer}}"};
+        mustache tmpl{input};
+        tmpl.set_parallel(4, 100, true);
+        CHECK(tmpl.render(data{"outer", outer}) == mustache{input}.render(data{"outer", outer}));
+        CHECK(other_threads == 0);
+
+        // a list too short to be split leaves the lists inside it to be
+        data short_outer{data::type::list};
+        short_outer << first;
+        CHECK(tmpl.render(data{"outer", short_outer}) == mustache{input}.render(data{"outer", short_outer}));
+        CHECK(other_threads > 0);
+    }
+
+    SECTION("errors") {
+        data nested{"items", items};
+        mustache tmpl{"{{#items}}{{#even}}{{name}}{{/even}}{{/items}}"};
+        tmpl.set_parallel(4, 100);
+        tmpl.set_max_depth(1);
+        CHECK(tmpl.render(nested).empty());
+        CHECK(tmpl.error_message() == "Render depth exceeds the maximum of 1");
+    }
+
+}